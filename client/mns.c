@@ -37,6 +37,7 @@
 #include "mns.h"
 
 #define ERROR_INF MNS_INTERFACE ".Error"
+#define MNS_ERROR mns_error_quark()
 #define MASINSTANCEID_TAG	0x0F
 
 #define MET_NEW_MESSAGE		1
@@ -56,6 +57,8 @@
 
 #define MNS_UUID "00001133-0000-1000-8000-00805f9b34fb"
 
+#define MNS_CONNECT_TIMEOUT 30	/* Seconds */
+
 struct event_apparam {
 	uint8_t	tag;
 	uint8_t	len;
@@ -67,77 +70,132 @@ static DBusConnection *conn = NULL;
 struct mns {
 	DBusMessage *msg;
 	struct obc_session *session;
+	uint8_t masinstanceid;
+	GQueue *reports;	/* Event reports still to be sent */
+	mns_callback_t func;	/* Replaces msg for in-process senders */
+	void *user_data;
+	gboolean connecting;
+	gboolean closed;
+	guint timeout;		/* Gives up on a connection that hangs */
 };
 
+static GQuark mns_error_quark(void)
+{
+	return g_quark_from_static_string("mns-error-quark");
+}
+
+static void clear_reports(struct mns *mns)
+{
+	g_queue_foreach(mns->reports, (GFunc) g_free, NULL);
+	g_queue_clear(mns->reports);
+}
+
 static void mns_send_event_callback(struct obc_session *session,
-					GError *err, void *user_data)
+					GError *err, void *user_data);
+
+/* An event report holds a single event, so every one of them is a PUT */
+static int send_next_report(struct mns *mns)
 {
-	struct mns *mns = user_data;
-	struct obc_transfer *transfer = obc_session_get_transfer(session);
+	struct event_apparam eapp;
+	char *cbuf;
+
+	cbuf = g_queue_pop_head(mns->reports);
+	if (cbuf == NULL)
+		return -ENOENT;
+
+	eapp.tag = MASINSTANCEID_TAG;
+	eapp.len = 1;
+	eapp.masinstanceid = mns->masinstanceid;
+
+	DBG("Object to be sent:");
+	DBG("%s", cbuf);
+
+	/* XXX: currently it also sends obex length header. can we ignore this?
+	 * This makes test device respond with code 500.
+	 * (also see MAP specification, page 64)
+	 * note: temporary "fixed" in obex-priv.c (may definitely break another
+	 * things)
+	 */
+	/* XXX: implementation sends separate Body and EndOfBody headers in
+	 * separate packets - ugly (would require fix in openobex) */
+	/* XXX: session_put makes a copy of eapp, cbuf will be freed after use
+	 */
+
+	if (obc_session_put(mns->session, "x-bt/MAP-event-report", NULL, NULL,
+				(const guint8 *)&eapp, sizeof(eapp),
+				mns_send_event_callback, cbuf, mns) < 0) {
+		DBG("obc_session_put() failed!");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static void reports_complete(struct mns *mns, GError *err)
+{
+	mns_callback_t func = mns->func;
 	DBusMessage *reply;
 
-	DBG("session = %p, mns = %p, transfer = %p", session, mns, transfer);
+	clear_reports(mns);
 
-	if (mns->msg == NULL)
-		goto done;
+	if (func != NULL) {
+		mns->func = NULL;
+		func(mns, err, mns->user_data);
+		return;
+	}
 
-	if (err != NULL) {
-		DBG("err: %s", err->message);
+	if (err != NULL)
 		reply = g_dbus_create_error(mns->msg,
 						ERROR_INF ".Failed",
 						"%s", err->message);
-	} else {
+	else
 		reply = dbus_message_new_method_return(mns->msg);
-	}
 
 	g_dbus_send_message(conn, reply);
 	dbus_message_unref(mns->msg);
 	mns->msg = NULL;
-
-done:
-	obc_transfer_unregister(transfer);
 }
 
-
-static DBusMessage *mns_send_event(DBusConnection *connection,
-					DBusMessage *message, void *user_data)
+static void mns_send_event_callback(struct obc_session *session,
+					GError *err, void *user_data)
 {
 	struct mns *mns = user_data;
-	GString *buf;
-	uint8_t evtype;
-	uint8_t msgtype;
-	uint8_t masinstanceid;
-	const char *handle, *folder, *old_folder;
-	struct event_apparam eapp;
-	char *cbuf;
+	struct obc_transfer *transfer = obc_session_get_transfer(session);
+	GError *gerr = NULL;
 
-	DBG("mns = %p", mns);
+	DBG("session = %p, mns = %p, transfer = %p", session, mns, transfer);
 
-	if (mns->msg) {
-		DBG("Another transfer in progress!");
-		return g_dbus_create_error(message,
-				"org.openobex.Error.InProgress",
-				"Transfer in progress");
-	}
+	obc_transfer_unregister(transfer);
 
-	buf = g_string_new("");
+	if (mns->msg == NULL && mns->func == NULL)
+		return;
 
-	if (dbus_message_get_args(message, NULL,
-			DBUS_TYPE_BYTE, &masinstanceid,
-			DBUS_TYPE_BYTE, &evtype,
-			DBUS_TYPE_STRING, &handle,
-			DBUS_TYPE_STRING, &folder,
-			DBUS_TYPE_STRING, &old_folder,
-			DBUS_TYPE_BYTE, &msgtype,
-			DBUS_TYPE_INVALID) == FALSE) {
-		DBG("Invalid arguments!");
-		return g_dbus_create_error(message,
-				ERROR_INF ".InvalidArguments", NULL);
+	if (err != NULL) {
+		DBG("err: %s", err->message);
+		reports_complete(mns, err);
+		return;
 	}
 
-	eapp.tag = MASINSTANCEID_TAG;
-	eapp.len = 1;
-	eapp.masinstanceid = masinstanceid;
+	if (g_queue_is_empty(mns->reports)) {
+		reports_complete(mns, NULL);
+		return;
+	}
+
+	if (send_next_report(mns) == 0)
+		return;
+
+	g_set_error(&gerr, MNS_ERROR, -EIO, "Fail me more.");
+	reports_complete(mns, gerr);
+	g_error_free(gerr);
+}
+
+static char *event_report(uint8_t evtype, const char *handle,
+				const char *folder, const char *old_folder,
+				uint8_t msgtype)
+{
+	GString *buf;
+
+	buf = g_string_new("");
 
 	g_string_append(buf, "<MAP-event-report version=\"1.0\">\n");
 
@@ -172,9 +230,7 @@ static DBusMessage *mns_send_event(DBusConnection *connection,
 	default:
 		DBG("Incorrect type of event!");
 		g_string_free(buf, TRUE);
-		return g_dbus_create_error(message,
-				ERROR_INF ".InvalidArguments",
-				"Incorrect event type");
+		return NULL;
 	}
 
 	/* FIXME: escape disallowed characters */
@@ -205,28 +261,13 @@ static DBusMessage *mns_send_event(DBusConnection *connection,
 
 	g_string_append(buf, "/>\n</MAP-event-report>");
 
-	DBG("Object to be sent:");
-	DBG("%s", buf->str);
-
-	cbuf = buf->str;
-
-	g_string_free(buf, FALSE);
-
-	/* XXX: currently it also sends obex length header. can we ignore this?
-	 * This makes test device respond with code 500.
-	 * (also see MAP specification, page 64)
-	 * note: temporary "fixed" in obex-priv.c (may definitely break another
-	 * things)
-	 */
-	/* XXX: implementation sends separate Body and EndOfBody headers in
-	 * separate packets - ugly (would require fix in openobex) */
-	/* XXX: session_put makes a copy of eapp, cbuf will be freed after use
-	 */
+	return g_string_free(buf, FALSE);
+}
 
-	if (obc_session_put(mns->session, "x-bt/MAP-event-report", NULL, NULL,
-				(const guint8 *)&eapp, sizeof(eapp),
-				mns_send_event_callback, cbuf, mns) < 0) {
-		DBG("obc_session_put() failed!");
+static DBusMessage *send_reports(struct mns *mns, DBusMessage *message)
+{
+	if (send_next_report(mns) < 0) {
+		clear_reports(mns);
 		return g_dbus_create_error(message,
 				ERROR_INF ".Failed",
 				"Fail me more.");
@@ -237,10 +278,120 @@ static DBusMessage *mns_send_event(DBusConnection *connection,
 	return NULL;
 }
 
+static DBusMessage *mns_send_event(DBusConnection *connection,
+					DBusMessage *message, void *user_data)
+{
+	struct mns *mns = user_data;
+	uint8_t evtype;
+	uint8_t msgtype;
+	uint8_t masinstanceid;
+	const char *handle, *folder, *old_folder;
+	char *cbuf;
+
+	DBG("mns = %p", mns);
+
+	if (mns->msg) {
+		DBG("Another transfer in progress!");
+		return g_dbus_create_error(message,
+				"org.openobex.Error.InProgress",
+				"Transfer in progress");
+	}
+
+	if (dbus_message_get_args(message, NULL,
+			DBUS_TYPE_BYTE, &masinstanceid,
+			DBUS_TYPE_BYTE, &evtype,
+			DBUS_TYPE_STRING, &handle,
+			DBUS_TYPE_STRING, &folder,
+			DBUS_TYPE_STRING, &old_folder,
+			DBUS_TYPE_BYTE, &msgtype,
+			DBUS_TYPE_INVALID) == FALSE) {
+		DBG("Invalid arguments!");
+		return g_dbus_create_error(message,
+				ERROR_INF ".InvalidArguments", NULL);
+	}
+
+	cbuf = event_report(evtype, handle, folder, old_folder, msgtype);
+	if (cbuf == NULL)
+		return g_dbus_create_error(message,
+				ERROR_INF ".InvalidArguments",
+				"Incorrect event type");
+
+	mns->masinstanceid = masinstanceid;
+	g_queue_push_tail(mns->reports, cbuf);
+
+	return send_reports(mns, message);
+}
+
+/* Same as SendEvent for a whole burst, replies once all are sent */
+static DBusMessage *mns_send_events(DBusConnection *connection,
+					DBusMessage *message, void *user_data)
+{
+	struct mns *mns = user_data;
+	DBusMessageIter iter, array, entry;
+	uint8_t evtype;
+	uint8_t msgtype;
+	const char *handle, *folder, *old_folder;
+	char *cbuf;
+
+	DBG("mns = %p", mns);
+
+	if (mns->msg) {
+		DBG("Another transfer in progress!");
+		return g_dbus_create_error(message,
+				"org.openobex.Error.InProgress",
+				"Transfer in progress");
+	}
+
+	if (!dbus_message_has_signature(message, "ya(ysssy)")) {
+		DBG("Invalid arguments!");
+		return g_dbus_create_error(message,
+				ERROR_INF ".InvalidArguments", NULL);
+	}
+
+	dbus_message_iter_init(message, &iter);
+	dbus_message_iter_get_basic(&iter, &mns->masinstanceid);
+	dbus_message_iter_next(&iter);
+	dbus_message_iter_recurse(&iter, &array);
+
+	while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT) {
+		dbus_message_iter_recurse(&array, &entry);
+
+		dbus_message_iter_get_basic(&entry, &evtype);
+		dbus_message_iter_next(&entry);
+		dbus_message_iter_get_basic(&entry, &handle);
+		dbus_message_iter_next(&entry);
+		dbus_message_iter_get_basic(&entry, &folder);
+		dbus_message_iter_next(&entry);
+		dbus_message_iter_get_basic(&entry, &old_folder);
+		dbus_message_iter_next(&entry);
+		dbus_message_iter_get_basic(&entry, &msgtype);
+
+		cbuf = event_report(evtype, handle, folder, old_folder,
+								msgtype);
+		if (cbuf == NULL) {
+			clear_reports(mns);
+			return g_dbus_create_error(message,
+					ERROR_INF ".InvalidArguments",
+					"Incorrect event type");
+		}
+
+		g_queue_push_tail(mns->reports, cbuf);
+
+		dbus_message_iter_next(&array);
+	}
+
+	if (g_queue_is_empty(mns->reports))
+		return dbus_message_new_method_return(message);
+
+	return send_reports(mns, message);
+}
+
 
 static GDBusMethodTable mns_methods[] = {
 	{ "SendEvent",	"yysssy",	"",	mns_send_event,
 						G_DBUS_METHOD_FLAG_ASYNC },
+	{ "SendEvents",	"ya(ysssy)",	"",	mns_send_events,
+						G_DBUS_METHOD_FLAG_ASYNC },
 	{ }
 };
 
@@ -248,6 +399,8 @@ static void mns_free(void *data)
 {
 	struct mns *mns = data;
 
+	clear_reports(mns);
+	g_queue_free(mns->reports);
 	obc_session_unref(mns->session);
 	g_free(mns);
 }
@@ -264,6 +417,7 @@ static int mns_probe(struct obc_session *session)
 		return -ENOMEM;
 
 	mns->session = obc_session_ref(session);
+	mns->reports = g_queue_new();
 
 	if (!g_dbus_register_interface(conn, path, MNS_INTERFACE,
 				mns_methods, NULL, NULL, mns, mns_free)) {
@@ -284,6 +438,162 @@ static void mns_remove(struct obc_session *session)
 }
 
 
+/* In-process senders, used by obexd to skip the D-Bus round trip to
+ * obex-client. Sessions made here are never registered on the bus. */
+
+static void mns_destroy(struct mns *mns)
+{
+	obc_session_shutdown(mns->session);
+	mns_free(mns);
+}
+
+static gboolean mns_destroy_idle(gpointer user_data)
+{
+	mns_destroy(user_data);
+
+	return FALSE;
+}
+
+static void mns_connect_callback(struct obc_session *session,
+					GError *err, void *user_data)
+{
+	struct mns *mns = user_data;
+	mns_callback_t func = mns->func;
+
+	DBG("session = %p, mns = %p", session, mns);
+
+	mns->connecting = FALSE;
+
+	if (mns->timeout) {
+		g_source_remove(mns->timeout);
+		mns->timeout = 0;
+	}
+
+	if (mns->closed) {
+		mns_destroy(mns);
+		return;
+	}
+
+	mns->func = NULL;
+	func(mns, err, mns->user_data);
+}
+
+/* The session still calls back once shut down, mns is freed then */
+static gboolean mns_connect_timeout(gpointer user_data)
+{
+	struct mns *mns = user_data;
+	mns_callback_t func = mns->func;
+	GError *gerr = NULL;
+
+	DBG("mns = %p", mns);
+
+	mns->timeout = 0;
+	mns->func = NULL;
+	mns->closed = TRUE;
+
+	obc_session_shutdown(mns->session);
+
+	g_set_error(&gerr, MNS_ERROR, -ETIMEDOUT, "Connection timed out");
+	func(mns, gerr, mns->user_data);
+	g_error_free(gerr);
+
+	return FALSE;
+}
+
+struct mns *mns_connect(const char *source, const char *destination,
+				mns_callback_t func, void *user_data)
+{
+	struct mns *mns;
+
+	DBG("%s", destination);
+
+	/* The MNS driver is not registered */
+	if (conn == NULL)
+		return NULL;
+
+	mns = g_try_malloc0(sizeof(*mns));
+	if (!mns)
+		return NULL;
+
+	mns->reports = g_queue_new();
+	mns->func = func;
+	mns->user_data = user_data;
+	mns->connecting = TRUE;
+
+	mns->session = obc_session_create(source, destination, "MNS", 0,
+					NULL, mns_connect_callback, mns);
+	if (mns->session == NULL) {
+		g_queue_free(mns->reports);
+		g_free(mns);
+		return NULL;
+	}
+
+	mns->timeout = g_timeout_add_seconds(MNS_CONNECT_TIMEOUT,
+						mns_connect_timeout, mns);
+
+	return mns;
+}
+
+int mns_queue_report(struct mns *mns, uint8_t evtype, const char *handle,
+				const char *folder, const char *old_folder,
+				uint8_t msgtype)
+{
+	char *cbuf;
+
+	cbuf = event_report(evtype, handle, folder, old_folder, msgtype);
+	if (cbuf == NULL)
+		return -EINVAL;
+
+	g_queue_push_tail(mns->reports, cbuf);
+
+	return 0;
+}
+
+/* Sends the queued reports, func is called once all of them are out */
+int mns_send_reports(struct mns *mns, uint8_t masinstanceid,
+				mns_callback_t func, void *user_data)
+{
+	int err;
+
+	if (mns->connecting || mns->func != NULL)
+		return -EBUSY;
+
+	mns->masinstanceid = masinstanceid;
+	mns->func = func;
+	mns->user_data = user_data;
+
+	err = send_next_report(mns);
+	if (err < 0) {
+		mns->func = NULL;
+		clear_reports(mns);
+	}
+
+	return err;
+}
+
+/* No callback is made after this. The session is shut down from idle as
+ * the caller may well be inside one of our callbacks. */
+void mns_disconnect(struct mns *mns)
+{
+	DBG("mns = %p", mns);
+
+	mns->func = NULL;
+	clear_reports(mns);
+
+	if (mns->timeout) {
+		g_source_remove(mns->timeout);
+		mns->timeout = 0;
+	}
+
+	if (mns->connecting) {
+		mns->closed = TRUE;
+		obc_session_shutdown(mns->session);
+		return;
+	}
+
+	g_idle_add(mns_destroy_idle, mns);
+}
+
 static struct obc_driver mns = {
 	.service = "MNS",
 	.uuid = MNS_UUID,
@@ -26,10 +26,24 @@
 
 #define MNS_INTERFACE  "org.openobex.MNS"
 
+struct mns;
+
+typedef void (*mns_callback_t) (struct mns *mns, GError *err,
+							void *user_data);
+
 gboolean mns_register_interface(DBusConnection *connection, const char *path,
 				void *user_data, GDBusDestroyFunction destroy);
 void mns_unregister_interface(DBusConnection *connection, const char *path,
 				void *user_data);
 
+struct mns *mns_connect(const char *source, const char *destination,
+				mns_callback_t func, void *user_data);
+int mns_queue_report(struct mns *mns, uint8_t evtype, const char *handle,
+				const char *folder, const char *old_folder,
+				uint8_t msgtype);
+int mns_send_reports(struct mns *mns, uint8_t masinstanceid,
+				mns_callback_t func, void *user_data);
+void mns_disconnect(struct mns *mns);
+
 int mns_init(void);
 void mns_exit(void);
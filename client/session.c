@@ -102,6 +102,7 @@ struct obc_session {
 	GSList *pending_calls;
 	void *priv;
 	char *adapter;
+	gboolean srm;		/* Single Response Mode requested */
 };
 
 static GSList *sessions = NULL;
@@ -308,6 +309,8 @@ static void rfcomm_callback(GIOChannel *io, GError *err, gpointer user_data)
 
 	obex = gw_obex_setup_fd(fd, driver->target, driver->target_len,
 								NULL, NULL);
+	if (obex)
+		gw_obex_set_srm(obex, session->srm);
 
 	session->obex = obex;
 
@@ -427,18 +430,42 @@ failed:
 	g_free(callback);
 }
 
+/* Reports a session that couldn't be set up, callers always get called */
+static void connection_failed(struct callback_data *callback, int err,
+							const char *msg)
+{
+	GError *gerr = NULL;
+
+	g_set_error(&gerr, OBEX_IO_ERROR, err, "%s", msg);
+	callback->func(callback->session, gerr, callback->data);
+	g_clear_error(&gerr);
+
+	obc_session_unref(callback->session);
+	g_free(callback);
+}
+
 static gboolean process_callback(GIOChannel *io, GIOCondition cond,
 							gpointer user_data)
 {
 	struct callback_data *callback = user_data;
+	struct obc_session *session = callback->session;
 
 	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
-		return FALSE;
+		goto failed;
 
 	if (sdp_process(callback->sdp) < 0)
 		return FALSE;
 
 	return TRUE;
+
+failed:
+	sdp_close(callback->sdp);
+	g_io_channel_unref(session->io);
+	session->io = NULL;
+
+	connection_failed(callback, -EIO, "Service search failed");
+
+	return FALSE;
 }
 
 static int bt_string2uuid(uuid_t *uuid, const char *string)
@@ -678,8 +705,7 @@ static void adapter_reply(DBusPendingCall *call, void *user_data)
 	goto proceed;
 
 failed:
-	obc_session_unref(session);
-	g_free(callback);
+	connection_failed(callback, -EIO, "Unable to request session");
 
 proceed:
 	dbus_message_unref(reply);
@@ -730,8 +756,7 @@ static void manager_reply(DBusPendingCall *call, void *user_data)
 	goto proceed;
 
 failed:
-	obc_session_unref(session);
-	g_free(callback);
+	connection_failed(callback, -EIO, "Unable to find adapter");
 
 proceed:
 	dbus_message_unref(reply);
@@ -930,6 +955,9 @@ static void append_entry(DBusMessageIter *dict,
 	case DBUS_TYPE_UINT64:
 		signature = DBUS_TYPE_UINT64_AS_STRING;
 		break;
+	case DBUS_TYPE_BOOLEAN:
+		signature = DBUS_TYPE_BOOLEAN_AS_STRING;
+		break;
 	default:
 		signature = DBUS_TYPE_VARIANT_AS_STRING;
 		break;
@@ -951,6 +979,7 @@ static DBusMessage *session_get_properties(DBusConnection *connection,
 	DBusMessageIter iter, dict;
 	char addr[18];
 	char *paddr = addr;
+	dbus_bool_t srm;
 
 	reply = dbus_message_new_method_return(message);
 	if (!reply)
@@ -971,18 +1000,97 @@ static DBusMessage *session_get_properties(DBusConnection *connection,
 
 	append_entry(&dict, "Channel", DBUS_TYPE_BYTE, &session->channel);
 
+	srm = session->srm;
+	append_entry(&dict, "SingleResponseMode", DBUS_TYPE_BOOLEAN, &srm);
+
 	dbus_message_iter_close_container(&iter, &dict);
 
 	return reply;
 }
 
+static void emit_property_changed(struct obc_session *session,
+					const char *name, dbus_bool_t val)
+{
+	DBusMessage *signal;
+	DBusMessageIter iter, value;
+
+	signal = dbus_message_new_signal(session->path, SESSION_INTERFACE,
+							"PropertyChanged");
+	if (signal == NULL)
+		return;
+
+	dbus_message_iter_init_append(signal, &iter);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &name);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_VARIANT,
+					DBUS_TYPE_BOOLEAN_AS_STRING, &value);
+	dbus_message_iter_append_basic(&value, DBUS_TYPE_BOOLEAN, &val);
+	dbus_message_iter_close_container(&iter, &value);
+
+	g_dbus_send_message(session->conn, signal);
+}
+
+static DBusMessage *session_set_property(DBusConnection *connection,
+				DBusMessage *message, void *user_data)
+{
+	struct obc_session *session = user_data;
+	DBusMessageIter iter, value;
+	const char *name;
+	dbus_bool_t srm;
+
+	if (!dbus_message_iter_init(message, &iter))
+		goto invalid;
+
+	if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+		goto invalid;
+
+	dbus_message_iter_get_basic(&iter, &name);
+	dbus_message_iter_next(&iter);
+
+	if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT)
+		goto invalid;
+
+	dbus_message_iter_recurse(&iter, &value);
+
+	if (!g_str_equal(name, "SingleResponseMode"))
+		goto invalid;
+
+	if (dbus_message_iter_get_arg_type(&value) != DBUS_TYPE_BOOLEAN)
+		goto invalid;
+
+	dbus_message_iter_get_basic(&value, &srm);
+
+	if (session->srm == (srm ? TRUE : FALSE))
+		return dbus_message_new_method_return(message);
+
+	session->srm = srm ? TRUE : FALSE;
+
+	if (session->obex)
+		gw_obex_set_srm(session->obex, session->srm);
+
+	emit_property_changed(session, name, srm);
+
+	return dbus_message_new_method_return(message);
+
+invalid:
+	return g_dbus_create_error(message,
+				"org.openobex.Error.InvalidArguments",
+				"Invalid arguments in method call");
+}
+
 static GDBusMethodTable session_methods[] = {
 	{ "GetProperties",	"", "a{sv}",	session_get_properties	},
+	{ "SetProperty",	"sv", "",	session_set_property	},
 	{ "AssignAgent",	"o", "",	assign_agent	},
 	{ "ReleaseAgent",	"o", "",	release_agent	},
 	{ }
 };
 
+static GDBusSignalTable session_signals[] = {
+	{ "PropertyChanged",	"sv"	},
+	{ }
+};
+
 static void session_request_reply(DBusPendingCall *call, gpointer user_data)
 {
 	struct pending_data *pending = user_data;
@@ -1302,7 +1410,8 @@ const char *obc_session_register(struct obc_session *session,
 
 	if (g_dbus_register_interface(session->conn, session->path,
 					SESSION_INTERFACE, session_methods,
-					NULL, NULL, session, destroy) == FALSE)
+					session_signals, NULL, session,
+					destroy) == FALSE)
 		goto fail;
 
 	if (session->driver->probe && session->driver->probe(session) < 0) {
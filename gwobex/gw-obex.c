@@ -29,6 +29,10 @@
 #include <errno.h>
 #include <glib.h>
 
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
 #include "log.h"
 #include "gw-obex.h"
 #include "utils.h"
@@ -282,6 +286,27 @@ void gw_obex_set_cancel_callback(GwObex *ctx, gw_obex_cancel_cb_t callback, gpoi
     GW_OBEX_UNLOCK(ctx);
 }
 
+void gw_obex_set_srm(GwObex *ctx, gboolean enable) {
+    GW_OBEX_LOCK(ctx);
+#ifdef HAVE_OBEX_SRM
+    ctx->srm_enabled = enable;
+#else
+    if (enable)
+        debug("Single Response Mode not supported by libopenobex\n");
+#endif
+    GW_OBEX_UNLOCK(ctx);
+}
+
+gboolean gw_obex_get_srm(GwObex *ctx) {
+    gboolean enabled;
+
+    GW_OBEX_LOCK(ctx);
+    enabled = ctx->srm_enabled;
+    GW_OBEX_UNLOCK(ctx);
+
+    return enabled;
+}
+
 void gw_obex_close(GwObex *ctx) {
     GW_OBEX_LOCK(ctx);
     if (ctx->xfer) {
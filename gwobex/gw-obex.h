@@ -247,6 +247,29 @@ void gw_obex_set_cancel_callback(GwObex *ctx,
                                  gw_obex_cancel_cb_t callback,
                                  gpointer data);
 
+
+/** Request Single Response Mode for subsequent get and put operations
+ *
+ * When the server accepts it, body packets are streamed without waiting
+ * for a response to each of them. Async transfers then buffer up to
+ * GW_OBEX_SRM_WINDOW packets ahead of the application. Requires a
+ * libopenobex with Single Response Mode support, otherwise the request
+ * is ignored.
+ *
+ * @param ctx    Pointer returned by gw_obex_setup()
+ * @param enable TRUE to request Single Response Mode
+ */
+void gw_obex_set_srm(GwObex *ctx, gboolean enable);
+
+
+/** Check whether Single Response Mode is requested for transfers
+ *
+ * @param ctx Pointer returned by gw_obex_setup()
+ *
+ * @returns TRUE if gw_obex_set_srm() enabled it, FALSE otherwise
+ */
+gboolean gw_obex_get_srm(GwObex *ctx);
+
 /** @} */
 
 /**
@@ -183,6 +183,53 @@ static const char *optostr(uint8_t op) {
 }
 #endif
 
+static void srm_request(GwObex *ctx, obex_object_t *object) {
+    ctx->srm = FALSE;
+
+#ifdef HAVE_OBEX_SRM
+    if (ctx->srm_enabled) {
+        obex_headerdata_t hv;
+
+        hv.bq1 = OBEX_SRM_ENABLE;
+        /* Single mode is only entered once the server agrees, see
+         * srm_check() */
+        OBEX_ObjectAddHeader(ctx->handle, object, OBEX_HDR_SRM, hv, 1,
+                             OBEX_FL_FIT_ONE_PACKET);
+    }
+#endif
+}
+
+static void srm_check(GwObex *ctx, obex_object_t *object) {
+    obex_headerdata_t hv;
+    uint8_t hi;
+    unsigned int hlen;
+
+    if (!ctx->srm_enabled || ctx->srm)
+        return;
+
+    while (OBEX_ObjectGetNextHeader(ctx->handle, object, &hi, &hv, &hlen)) {
+        if (hi == OBEX_HDR_SRM && hlen == 1 && hv.bq1 == OBEX_SRM_ENABLE) {
+            debug("Server enabled Single Response Mode\n");
+            ctx->srm = TRUE;
+#ifdef HAVE_OBEX_SRM
+            OBEX_SetResponseMode(ctx->handle, OBEX_RSP_MODE_SINGLE);
+#endif
+            break;
+        }
+    }
+
+    OBEX_ObjectReParseHeaders(ctx->handle, object);
+}
+
+static void srm_done(GwObex *ctx) {
+#ifdef HAVE_OBEX_SRM
+    if (ctx->srm)
+        OBEX_SetResponseMode(ctx->handle, OBEX_RSP_MODE_NORMAL);
+#endif
+
+    ctx->srm = FALSE;
+}
+
 static void obex_connect_done(GwObex *ctx, obex_object_t *object, int obex_rsp) {
     obex_headerdata_t hv;
     uint8_t hi;
@@ -285,6 +332,7 @@ static inline void show_headers(obex_t *handle, obex_object_t *object) {}
 static void obex_abort_done(GwObex *ctx, obex_object_t *object,
                             int obex_cmd, int obex_rsp) {
     ctx->done = TRUE;
+    srm_done(ctx);
     if (ctx->xfer)
         ctx->xfer->do_cb = TRUE;
 
@@ -305,6 +353,8 @@ static void obex_request_done(GwObex *ctx, obex_object_t *object,
 
     ctx->obex_rsp = obex_rsp;
 
+    srm_done(ctx);
+
     if (obex_rsp != OBEX_RSP_SUCCESS) {
         debug("%s command (0x%02x) failed: %s (0x%02x)\n",
                 optostr((uint8_t)obex_cmd), (uint8_t)obex_cmd,
@@ -381,6 +431,7 @@ static void obex_readstream(GwObex *ctx, obex_object_t *object) {
 
     if (ctx->xfer->counter == 0) {
         get_non_body_headers(ctx->handle, object, xfer);
+        srm_check(ctx, object);
         show_headers(ctx->handle, object);
     }
 
@@ -392,17 +443,28 @@ static void obex_readstream(GwObex *ctx, obex_object_t *object) {
 
         if (xfer->async) {
             gint free_space = xfer->buf_size - (xfer->data_start + xfer->data_length);
+            if (actual > free_space && xfer->data_start > 0) {
+                /* Move unread data to the front to make room */
+                memmove(xfer->buf, &xfer->buf[xfer->data_start], xfer->data_length);
+                xfer->data_start = 0;
+                free_space = xfer->buf_size - xfer->data_length;
+            }
+
             if (actual > free_space) {
                 /* This should never happen */
                 debug("Out of buffer space: actual=%d, free=%d\n", actual, free_space);
                 return;
             }
 
-            memcpy(&xfer->buf[xfer->data_start], buf, actual);
+            memcpy(&xfer->buf[xfer->data_start + xfer->data_length], buf, actual);
             xfer->data_length += actual;
 
-            debug("OBEX_SuspendRequest at %s:%d (%s)\n", __FILE__, __LINE__, __PRETTY_FUNCTION__);
-            OBEX_SuspendRequest(ctx->handle, object);
+            /* In Single Response Mode keep receiving while another
+             * packet still fits in the buffer */
+            if (!ctx->srm || xfer->buf_size - xfer->data_length < ctx->rx_max) {
+                debug("OBEX_SuspendRequest at %s:%d (%s)\n", __FILE__, __LINE__, __PRETTY_FUNCTION__);
+                OBEX_SuspendRequest(ctx->handle, object);
+            }
 
             xfer->do_cb = TRUE;
         }
@@ -462,7 +524,12 @@ static void obex_writestream(GwObex *ctx, obex_object_t *object) {
                 xfer->data_start += send_size;
 
             xfer->do_cb = TRUE;
-	    if (!xfer->close) {
+
+            /* In Single Response Mode keep sending while full packets
+             * are queued */
+            if (ctx->srm && xfer->data_length >= ctx->tx_max)
+                debug("Streaming %zd queued bytes\n", xfer->data_length);
+	    else if (!xfer->close) {
                 debug("OBEX_SuspendRequest at %s:%d (%s)\n", __FILE__, __LINE__, __PRETTY_FUNCTION__);
                 OBEX_SuspendRequest(ctx->handle, object);
             }
@@ -522,6 +589,8 @@ static void obex_event_handler(obex_t *handle, obex_object_t *object, int mode,
             break;
         case OBEX_EV_PROGRESS:
             debug("OBEX_EV_PROGRESS\n");
+            if (ctx->obex_op == OBEX_CMD_PUT)
+                srm_check(ctx, object);
             if (ctx->report_progress && ctx->pr_cb)
                 ctx->pr_cb(ctx, ctx->obex_op, ctx->xfer->counter, ctx->xfer->target_size, ctx->pr_data);
             break;
@@ -905,6 +974,8 @@ gboolean gw_obex_get(GwObex *ctx,
         }
     }
 
+    srm_request(ctx, object);
+
     OBEX_ObjectReadStream(ctx->handle, object, NULL);
 
     if (async) {
@@ -1071,6 +1142,8 @@ gboolean gw_obex_put(GwObex *ctx,
         ctx->xfer->target_size = GW_OBEX_UNKNOWN_LENGTH;
 
     if (ctx->xfer->stream_fd >= 0 || buf || async) {
+        srm_request(ctx, object);
+
         hv.bs = NULL;
         OBEX_ObjectAddHeader(ctx->handle, object, OBEX_HDR_BODY, hv, 0, OBEX_FL_STREAM_START);
     }
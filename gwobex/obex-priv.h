@@ -55,6 +55,16 @@
 
 #endif /* OBEX_CMD_ACTION */
 
+#ifndef OBEX_HDR_SRM
+# define OBEX_HDR_SRM         0x97
+# define OBEX_HDR_SRM_FLAGS   0x98
+#endif /* OBEX_HDR_SRM */
+
+#define OBEX_SRM_ENABLE      0x01
+
+/* How many packets async transfers buffer in Single Response Mode */
+#define GW_OBEX_SRM_WINDOW   4
+
 #define OBEX_ACTION_COPY     0x00
 #define OBEX_ACTION_MOVE     0x01
 #define OBEX_ACTION_SETPERM  0x02
@@ -163,6 +173,12 @@ struct gw_obex {
     /* How many bytes to allocate for incomming object data */
     uint16_t                 rx_max;
 
+    /* Whether Single Response Mode is requested for get and put */
+    gboolean                 srm_enabled;
+
+    /* TRUE if the server accepted Single Response Mode for this operation */
+    gboolean                 srm;
+
     /* Current object transfer handle */
     struct gw_obex_xfer     *xfer;
 };
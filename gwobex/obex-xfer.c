@@ -68,6 +68,10 @@ struct gw_obex_xfer *gw_obex_xfer_new(struct gw_obex *ctx, gboolean async, int s
     struct gw_obex_xfer *xfer;
     size_t buf_size = (ctx->obex_op == OBEX_CMD_GET) ? ctx->rx_max : ctx->tx_max;
 
+    /* Leave room for several packets in flight in Single Response Mode */
+    if (async && ctx->srm_enabled)
+        buf_size *= GW_OBEX_SRM_WINDOW;
+
     xfer = g_new0(struct gw_obex_xfer, 1);
 
     xfer->ctx         = ctx;
@@ -250,6 +254,13 @@ gboolean gw_obex_xfer_write(GwObexXfer *xfer, const char *buf, gint buf_size,
 
     free_space = xfer->buf_size - (xfer->data_start + xfer->data_length);
 
+    if (buf_size > free_space && xfer->data_start > 0) {
+        /* Move queued data to the front to make room */
+        memmove(xfer->buf, &xfer->buf[xfer->data_start], xfer->data_length);
+        xfer->data_start = 0;
+        free_space = xfer->buf_size - xfer->data_length;
+    }
+
     *bytes_written = buf_size > free_space ? free_space : buf_size;
 
     memcpy(&xfer->buf[xfer->data_start + xfer->data_length], buf, *bytes_written);
@@ -372,8 +383,12 @@ gboolean gw_obex_xfer_read(GwObexXfer *xfer, char *buf, gint buf_size,
 
     if (xfer->data_length)
         xfer->data_start += *bytes_read;
-    else {
+    else
         xfer->data_start = 0;
+
+    /* In Single Response Mode resume as soon as a packet fits again */
+    if (xfer->data_length == 0 ||
+            (ctx->srm && xfer->buf_size - xfer->data_length >= ctx->rx_max)) {
         debug("OBEX_ResumeRequest at %s:%d (%s)\n", __FILE__, __LINE__, __PRETTY_FUNCTION__);
         OBEX_ResumeRequest(ctx->handle);
     }
@@ -171,11 +171,9 @@ gboolean bmsg_add_content(struct bmsg *msg, gint32 part_id, char *encoding,
 	return TRUE;
 }
 
-static GString *parse_content(struct bmsg_content *cont)
+static void content_head(struct bmsg_content *cont, GString *buf)
 {
-	GString *buf = g_string_new("");
-
-	g_string_append_printf(buf, "BEGIN:BBODY\r\n");
+	g_string_append(buf, "BEGIN:BBODY\r\n");
 
 	if (cont->part_id != -1)
 		g_string_append_printf(buf, "PARTID:%d\r\n", cont->part_id);
@@ -190,83 +188,78 @@ static GString *parse_content(struct bmsg_content *cont)
 		g_string_append_printf(buf, "LANGUAGE:%s\r\n", cont->lang);
 
 	if (cont->len > 0)
-		g_string_append_printf(buf, "LENGTH:%d\r\n", cont->len);
+		g_string_append_printf(buf, "LENGTH:%u\r\n", cont->len);
 	else
-		g_string_append_printf(buf, "LENGTH:%d\r\n",
-							strlen(cont->content) +
-							BMESSAGE_BASE_LEN);
-
-	g_string_append_printf(buf, "BEGIN:MSG\r\n%s\r\nEND:MSG\r\n",
-								cont->content);
-	g_string_append_printf(buf, "END:BBODY\r\n");
+		g_string_append_printf(buf, "LENGTH:%" G_GSIZE_FORMAT "\r\n",
+						strlen(cont->content) +
+						BMESSAGE_BASE_LEN);
 
-	return buf;
+	g_string_append(buf, "BEGIN:MSG\r\n");
 }
 
-static GString *parse_envelope(struct bmsg *msg, unsigned num)
+/* Renders everything before the message content into head and everything
+ * after it into tail, so the content itself can be sent on as it is.
+ * Returns the content, or NULL if the message has none. */
+const char *bmsg_text_parts(struct bmsg *msg, GString *head, GString *tail)
 {
-	GString *buf;
 	struct bmsg_envelope *env;
-	GString *tmp;
+	unsigned i;
 
-	if (num >= msg->envelopes->len)
+	if (msg->envelopes->len == 0)
 		return NULL;
 
-	buf = g_string_new("");
+	/* Only the innermost envelope carries the body */
+	env = g_array_index(msg->envelopes, struct bmsg_envelope *,
+						msg->envelopes->len - 1);
+	if (env->content == NULL)
+		return NULL;
 
-	env = g_array_index(msg->envelopes, struct bmsg_envelope *, num);
+	g_string_append(head, "BEGIN:BMSG\r\n");
 
-	g_string_append_printf(buf, "BEGIN:BENV\r\n");
-	g_list_foreach(env->recipients, string_append_glist, buf);
+	g_string_append_printf(head, "VERSION:%s\r\n", msg->version);
+	g_string_append_printf(head, "STATUS:%s\r\n", msg->status);
+	g_string_append_printf(head, "TYPE:%s\r\n", msg->type);
+	g_string_append_printf(head, "FOLDER:%s\r\n", msg->folder);
 
-	tmp = parse_envelope(msg, num + 1);
-	if (tmp == NULL) {
-		if (env->content == NULL) {
-			g_string_free(buf, TRUE);
+	g_list_foreach(msg->originators, string_append_glist, head);
 
-			return NULL;
-		}
+	for (i = 0; i < msg->envelopes->len; i++) {
+		struct bmsg_envelope *tmp = g_array_index(msg->envelopes,
+						struct bmsg_envelope *, i);
 
-		tmp = parse_content(env->content);
+		g_string_append(head, "BEGIN:BENV\r\n");
+		g_list_foreach(tmp->recipients, string_append_glist, head);
 	}
 
-	g_string_append_printf(buf, "%s", tmp->str);
-	g_string_free(tmp, TRUE);
+	content_head(env->content, head);
+
+	g_string_append(tail, "\r\nEND:MSG\r\nEND:BBODY\r\n");
 
-	g_string_append_printf(buf, "END:BENV\r\n");
+	for (i = 0; i < msg->envelopes->len; i++)
+		g_string_append(tail, "END:BENV\r\n");
 
-	return buf;
+	g_string_append(tail, "END:BMSG\r\n");
+
+	return env->content->content;
 }
 
 char *bmsg_text(struct bmsg *msg)
 {
 	GString *buf = g_string_new("");
-	GString *env;
-	char *ret;
-
-	g_string_append_printf(buf, "BEGIN:BMSG\r\n");
+	GString *tail = g_string_new("");
+	const char *content;
 
-	g_string_append_printf(buf, "VERSION:%s\r\n", msg->version);
-	g_string_append_printf(buf, "STATUS:%s\r\n", msg->status);
-	g_string_append_printf(buf, "TYPE:%s\r\n", msg->type);
-	g_string_append_printf(buf, "FOLDER:%s\r\n", msg->folder);
-
-	g_list_foreach(msg->originators, string_append_glist, buf);
-
-	env = parse_envelope(msg, 0);
-	if (env == NULL) {
+	content = bmsg_text_parts(msg, buf, tail);
+	if (content == NULL) {
 		g_string_free(buf, TRUE);
+		g_string_free(tail, TRUE);
 
 		return NULL;
 	}
 
-	g_string_append_printf(buf, "%s", env->str);
-	g_string_free(env, TRUE);
-
-	g_string_append_printf(buf, "END:BMSG\r\n");
-
-	ret = g_strdup(buf->str);
-	g_string_free(buf, TRUE);
+	g_string_append(buf, content);
+	g_string_append_len(buf, tail->str, tail->len);
+	g_string_free(tail, TRUE);
 
-	return ret;
+	return g_string_free(buf, FALSE);
 }
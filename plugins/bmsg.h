@@ -85,4 +85,5 @@ gboolean bmsg_add_envelope(struct bmsg *msg);
 gboolean bmsg_add_content(struct bmsg *msg, gint32 part_id, char *encoding,
 			char *charset, char *lang, const char* content);
 struct bmsg * bmsg_parse(char *string);
+const char *bmsg_text_parts(struct bmsg *msg, GString *head, GString *tail);
 char * bmsg_text(struct bmsg *msg);
@@ -4,8 +4,7 @@
 
 #include <glib.h>
 #include <string.h>
-#include <ctype.h>
-#include <stdlib.h>
+#include <errno.h>
 
 #include "log.h"
 
@@ -47,21 +46,30 @@ static struct {
 	{ BMSG_L_HEBREW, "HEBREW" }
 };
 
-static int bmsg_parser_begin_bmsg(struct bmsg_parser *);
-static int bmsg_parser_version(struct bmsg_parser *);
-static int bmsg_parser_status(struct bmsg_parser *);
-static int bmsg_parser_type(struct bmsg_parser *);
-static int bmsg_parser_folder(struct bmsg_parser *);
-static int bmsg_parser_originator(struct bmsg_parser *);
-static int bmsg_parser_vcard(struct bmsg_parser *);
-static int bmsg_parser_begin_envelope(struct bmsg_parser *);
-static int bmsg_parser_recipient(struct bmsg_parser *);
-static int bmsg_parser_begin_body(struct bmsg_parser *);
-static int bmsg_parser_part_id(struct bmsg_parser *);
-static int bmsg_parser_encoding(struct bmsg_parser *);
-static int bmsg_parser_charset(struct bmsg_parser *);
-static int bmsg_parser_language(struct bmsg_parser *);
-static int bmsg_parser_length(struct bmsg_parser *);
+/* Longest header line kept while waiting for the rest of it */
+#define BMSG_LINE_MAX 4096
+
+/* Line handlers return 0 once the line is consumed, 1 when it belongs to
+ * the state they moved to and a negative value on error. */
+typedef int (*bmsg_action_t) (struct bmsg_parser *pd, const char *line,
+								size_t len);
+
+static int bmsg_parser_begin_bmsg(struct bmsg_parser *, const char *, size_t);
+static int bmsg_parser_version(struct bmsg_parser *, const char *, size_t);
+static int bmsg_parser_status(struct bmsg_parser *, const char *, size_t);
+static int bmsg_parser_type(struct bmsg_parser *, const char *, size_t);
+static int bmsg_parser_folder(struct bmsg_parser *, const char *, size_t);
+static int bmsg_parser_originator(struct bmsg_parser *, const char *, size_t);
+static int bmsg_parser_vcard(struct bmsg_parser *, const char *, size_t);
+static int bmsg_parser_begin_envelope(struct bmsg_parser *, const char *,
+								size_t);
+static int bmsg_parser_recipient(struct bmsg_parser *, const char *, size_t);
+static int bmsg_parser_begin_body(struct bmsg_parser *, const char *, size_t);
+static int bmsg_parser_part_id(struct bmsg_parser *, const char *, size_t);
+static int bmsg_parser_encoding(struct bmsg_parser *, const char *, size_t);
+static int bmsg_parser_charset(struct bmsg_parser *, const char *, size_t);
+static int bmsg_parser_language(struct bmsg_parser *, const char *, size_t);
+static int bmsg_parser_length(struct bmsg_parser *, const char *, size_t);
 
 enum bmsg_parser_state {
 	BMSG_STATE_BEGIN_BMSG,
@@ -83,7 +91,7 @@ enum bmsg_parser_state {
 	BMSG_STATE_NSTATES
 };
 
-int (*actions[BMSG_STATE_NSTATES])(struct bmsg_parser *) = {
+static bmsg_action_t actions[BMSG_STATE_NSTATES] = {
 	 bmsg_parser_begin_bmsg,
 	 bmsg_parser_version,
 	 bmsg_parser_status,
@@ -107,84 +115,109 @@ struct bmsg_parser {
 	enum bmsg_parser_state state;
 	enum bmsg_parser_state unwind_state;
 	gboolean finished;
-	char *input;
-	char *eol;
-	ssize_t nleft;
+	GString *partial;	/* Line split across packets */
 	struct bmsg_bmsg_vcard *vcard;
-	GRegex *vcard_re;
 };
 
-static int match_full_line(struct bmsg_parser *pd, const char *pattern)
+static gboolean match_full_line(const char *line, size_t len,
+							const char *pattern)
 {
-	size_t len;
+	return len == strlen(pattern) && memcmp(line, pattern, len) == 0;
+}
 
-	len = pd->eol - pd->input;
+/* Returns the length of the value following the pattern or -1 */
+static ssize_t match_with_param(const char *line, size_t len,
+					const char *pattern, const char **param)
+{
+	size_t plen = strlen(pattern);
 
-	if (strncmp(pattern, pd->input, len) != 0)
+	if (plen > len || memcmp(pattern, line, plen) != 0)
 		return -1;
 
-	len += 2;
-	pd->input += len;
-	pd->nleft -= len;
+	*param = line + plen;
 
-	return 0;
+	return len - plen;
 }
 
-static gboolean match_vcard_item(struct bmsg_parser *pd, const char **name,
-				size_t *nlen, const char **value, size_t *vlen)
+/* Splits "[group.]name[;params]:value", see RFC 2425 */
+static gboolean match_vcard_item(const char *line, size_t len,
+				const char **name, size_t *nlen,
+				const char **value, size_t *vlen)
 {
-	GMatchInfo *minfo = NULL;
-	size_t len;
-	gint spos, epos;
+	const char *colon, *end, *dot = NULL;
+	const char *p;
 
-	len = pd->eol - pd->input;
-	if (!g_regex_match_full(pd->vcard_re, pd->input, len, 0, 0, &minfo,
-									NULL))
+	colon = memchr(line, ':', len);
+	if (colon == NULL)
 		return FALSE;
 
-	g_match_info_fetch_pos(minfo, 1, &spos, &epos);
-	*name = pd->input + spos;
-	*nlen = epos - spos;
+	end = memchr(line, ';', colon - line);
+	if (end == NULL)
+		end = colon;
 
-	g_match_info_fetch_pos(minfo, 3, &spos, &epos);
-	*value = pd->input + spos;
-	*vlen = epos - spos;
+	for (p = line; p < end; p++) {
+		if (*p == '.')
+			dot = p;
+		else if (!g_ascii_isalnum(*p))
+			return FALSE;
+	}
 
-	g_match_info_free(minfo);
+	*name = line;
+	if (dot != NULL) {
+		if (dot == line)
+			return FALSE;
+
+		*name = dot + 1;
+	}
+
+	*nlen = end - *name;
+	if (*nlen == 0)
+		return FALSE;
+
+	for (p = *name; p < end; p++)
+		if (!g_ascii_isalpha(*p))
+			return FALSE;
 
-	len += 2;
-	pd->input += len;
-	pd->nleft -= len;
+	*value = colon + 1;
+	*vlen = line + len - *value;
 
 	return TRUE;
 }
 
-static ssize_t match_with_param(struct bmsg_parser *pd, const char *pattern,
-								char **param)
+static gboolean match_name(const char *name, size_t nlen, const char *s)
 {
-	size_t len;
-	size_t plen;
-	size_t vlen;
+	return nlen == strlen(s) && g_ascii_strncasecmp(name, s, nlen) == 0;
+}
 
-	len = pd->eol - pd->input;
-	plen = strlen(pattern);
+/* Decimal number of the whole value, without strtoul's leniency */
+static gboolean parse_number(const char *val, ssize_t len,
+							unsigned long *number)
+{
+	unsigned long n = 0;
+	ssize_t i;
 
-	if (plen > len || strncmp(pattern, pd->input, plen) != 0)
-		return -1;
+	if (len <= 0)
+		return FALSE;
+
+	for (i = 0; i < len; i++) {
+		if (!g_ascii_isdigit(val[i]))
+			return FALSE;
 
-	vlen = len - plen;
-	*param = pd->input + plen;
+		if (n > (G_MAXULONG - 9) / 10)
+			return FALSE;
+
+		n = n * 10 + (val[i] - '0');
+	}
 
-	len += 2;
-	pd->input += len;
-	pd->nleft -= len;
+	*number = n;
 
-	return vlen;
+	return TRUE;
 }
 
-static int bmsg_parser_begin_bmsg(struct bmsg_parser *pd)
+static int bmsg_parser_begin_bmsg(struct bmsg_parser *pd, const char *line,
+								size_t len)
 {
-	if (match_full_line(pd, "BEGIN:BMSG"))
+	if (!match_full_line(line, len, "BEGIN:BMSG"))
 		return -1;
 
 	pd->state = BMSG_STATE_VERSION;
@@ -192,13 +225,14 @@ static int bmsg_parser_begin_bmsg(struct bmsg_parser *pd)
 	return 0;
 }
 
-static int bmsg_parser_version(struct bmsg_parser *pd)
+static int bmsg_parser_version(struct bmsg_parser *pd, const char *line,
+								size_t len)
 {
-	char *ver;
-	ssize_t len;
+	const char *ver;
+	ssize_t vlen;
 
-	len = match_with_param(pd, "VERSION:", &ver);
-	if (len < 0 || strncmp(ver, "1.0", len) != 0)
+	vlen = match_with_param(line, len, "VERSION:", &ver);
+	if (vlen < 0 || !match_full_line(ver, vlen, "1.0"))
 		return -1;
 
 	pd->state = BMSG_STATE_STATUS;
@@ -206,20 +240,19 @@ static int bmsg_parser_version(struct bmsg_parser *pd)
 	return 0;
 }
 
-static int bmsg_parser_status(struct bmsg_parser *pd)
+static int bmsg_parser_status(struct bmsg_parser *pd, const char *line,
+								size_t len)
 {
-	char *status;
-	ssize_t len;
-
-	pd->state = BMSG_STATE_TYPE;
+	const char *status;
+	ssize_t vlen;
 
-	len = match_with_param(pd, "STATUS:", &status);
-	if (len < 0)
+	vlen = match_with_param(line, len, "STATUS:", &status);
+	if (vlen < 0)
 		return -1;
 
-	if (strncmp(status, "READ", len) == 0)
+	if (match_full_line(status, vlen, "READ"))
 		pd->bmsg->read = TRUE;
-	else if (strncmp(status, "UNREAD", len) == 0)
+	else if (match_full_line(status, vlen, "UNREAD"))
 		pd->bmsg->read = FALSE;
 	else
 		return -1;
@@ -229,22 +262,23 @@ static int bmsg_parser_status(struct bmsg_parser *pd)
 	return 0;
 }
 
-static int bmsg_parser_type(struct bmsg_parser *pd)
+static int bmsg_parser_type(struct bmsg_parser *pd, const char *line,
+								size_t len)
 {
-	char *type;
-	ssize_t len;
+	const char *type;
+	ssize_t vlen;
 
-	len = match_with_param(pd, "TYPE:", &type);
-	if (len < 0)
+	vlen = match_with_param(line, len, "TYPE:", &type);
+	if (vlen < 0)
 		return -1;
 
-	if (strncmp(type, "SMS_GSM", len) == 0)
+	if (match_full_line(type, vlen, "SMS_GSM"))
 		pd->bmsg->type = BMSG_T_SMS_GSM;
-	else if (strncmp(type, "SMS_CDMA", len) == 0)
+	else if (match_full_line(type, vlen, "SMS_CDMA"))
 		pd->bmsg->type = BMSG_T_SMS_CDMA;
-	else if (strncmp(type, "EMAIL", len) == 0)
+	else if (match_full_line(type, vlen, "EMAIL"))
 		pd->bmsg->type = BMSG_T_EMAIL;
-	else if (strncmp(type, "MMS", len) == 0)
+	else if (match_full_line(type, vlen, "MMS"))
 		pd->bmsg->type = BMSG_T_MMS;
 	else
 		return -1;
@@ -254,33 +288,36 @@ static int bmsg_parser_type(struct bmsg_parser *pd)
 	return 0;
 }
 
-static int bmsg_parser_folder(struct bmsg_parser *pd)
+static int bmsg_parser_folder(struct bmsg_parser *pd, const char *line,
+								size_t len)
 {
-	char *folder;
-	ssize_t len;
+	const char *folder;
+	ssize_t vlen;
 
-	len = match_with_param(pd, "FOLDER:", &folder);
-	if (len < 0)
+	vlen = match_with_param(line, len, "FOLDER:", &folder);
+	if (vlen < 0)
 		return -1;
 
-	pd->bmsg->folder = g_strndup(folder, len);
+	pd->bmsg->folder = g_strndup(folder, vlen);
 	pd->state = BMSG_STATE_ORIGINATOR;
 
 	return 0;
 }
 
-static int bmsg_parser_originator(struct bmsg_parser *pd)
+static int bmsg_parser_originator(struct bmsg_parser *pd, const char *line,
+								size_t len)
 {
-	if (match_full_line(pd, "BEGIN:VCARD") == 0) {
-		pd->vcard = g_new0(struct bmsg_bmsg_vcard, 1);
-		pd->bmsg->originators = g_slist_append(pd->bmsg->originators,
-								pd->vcard);
-		pd->state = BMSG_STATE_VCARD;
-		pd->unwind_state = BMSG_STATE_ORIGINATOR;
-	} else {
+	if (!match_full_line(line, len, "BEGIN:VCARD")) {
 		pd->state = BMSG_STATE_BEGIN_ENVELOPE;
+		return 1;
 	}
 
+	pd->vcard = g_new0(struct bmsg_bmsg_vcard, 1);
+	pd->bmsg->originators = g_slist_append(pd->bmsg->originators,
+								pd->vcard);
+	pd->state = BMSG_STATE_VCARD;
+	pd->unwind_state = BMSG_STATE_ORIGINATOR;
+
 	return 0;
 }
 
@@ -289,44 +326,40 @@ static int bmsg_parser_originator(struct bmsg_parser *pd)
  * better support for vCard 3.0 (e.g. quoting)
  * unfolding
  */
-static int bmsg_parser_vcard(struct bmsg_parser *pd)
+static int bmsg_parser_vcard(struct bmsg_parser *pd, const char *line,
+								size_t len)
 {
-	ssize_t len;
 	const char *name, *val;
 	size_t nlen, vlen;
 
-	if (match_full_line(pd, "END:VCARD") == 0) {
+	if (match_full_line(line, len, "END:VCARD")) {
 		pd->state = pd->unwind_state;
 		return 0;
 	}
 
-	if (!match_vcard_item(pd, &name, &nlen, &val, &vlen)) {
-		len = pd->eol - pd->input + 2;
-		pd->input += len;
-		pd->nleft -= len;
-
+	/* Lines we can't make sense of are skipped */
+	if (!match_vcard_item(line, len, &name, &nlen, &val, &vlen))
 		return 0;
-	}
 
-	if (g_ascii_strncasecmp(name, "VERSION", nlen) == 0) {
-		if (g_ascii_strncasecmp(val, "2.1", vlen) == 0)
+	if (match_name(name, nlen, "VERSION")) {
+		if (match_name(val, vlen, "2.1"))
 			pd->vcard->version = BMSG_VCARD_21;
-		else if (g_ascii_strncasecmp(val, "3.0", vlen) == 0)
+		else if (match_name(val, vlen, "3.0"))
 			pd->vcard->version = BMSG_VCARD_30;
 		else {
 			DBG("Incorrect vCard version!");
 			return -1;
 		}
-	} else if (g_ascii_strncasecmp(name, "FN", nlen) == 0) {
+	} else if (match_name(name, nlen, "FN")) {
 		if (pd->vcard->fn == NULL)
 			pd->vcard->fn = g_strndup(val, vlen);
-	} else if (g_ascii_strncasecmp(name, "N", nlen) == 0) {
+	} else if (match_name(name, nlen, "N")) {
 		if (pd->vcard->n == NULL)
 			pd->vcard->n = g_strndup(val, vlen);
-	} else if (g_ascii_strncasecmp(name, "TEL", nlen) == 0) {
+	} else if (match_name(name, nlen, "TEL")) {
 		if (pd->vcard->tel == NULL)
 			pd->vcard->tel = g_strndup(val, vlen);
-	} else if (g_ascii_strncasecmp(name, "EMAIL", nlen) == 0) {
+	} else if (match_name(name, nlen, "EMAIL")) {
 		if (pd->vcard->email == NULL)
 			pd->vcard->email = g_strndup(val, vlen);
 	}
@@ -334,15 +367,16 @@ static int bmsg_parser_vcard(struct bmsg_parser *pd)
 	return 0;
 }
 
-static int bmsg_parser_begin_envelope(struct bmsg_parser *pd)
+static int bmsg_parser_begin_envelope(struct bmsg_parser *pd,
+					const char *line, size_t len)
 {
-	if (match_full_line(pd, "BEGIN:BENV") != 0) {
+	if (!match_full_line(line, len, "BEGIN:BENV")) {
 		if (pd->bmsg->nenvelopes == 0)
 			return -1;
 
 		pd->state = BMSG_STATE_BEGIN_BODY;
 
-		return 0;
+		return 1;
 	}
 
 	if (pd->bmsg->nenvelopes >= BMSG_NENVELOPES_MAX)
@@ -354,154 +388,145 @@ static int bmsg_parser_begin_envelope(struct bmsg_parser *pd)
 	return 0;
 }
 
-static int bmsg_parser_recipient(struct bmsg_parser *pd)
+static int bmsg_parser_recipient(struct bmsg_parser *pd, const char *line,
+								size_t len)
 {
-	if (match_full_line(pd, "BEGIN:VCARD") == 0) {
-		int i;
+	int i;
 
-		pd->vcard = g_new0(struct bmsg_bmsg_vcard, 1);
-		i = pd->bmsg->nenvelopes - 1;
-		pd->bmsg->recipients[i] = g_slist_append(pd->bmsg->recipients[i],
-								pd->vcard);
-		pd->state = BMSG_STATE_VCARD;
-		pd->unwind_state = BMSG_STATE_RECIPIENT;
-	} else {
+	if (!match_full_line(line, len, "BEGIN:VCARD")) {
 		pd->state = BMSG_STATE_BEGIN_ENVELOPE;
+		return 1;
 	}
 
+	pd->vcard = g_new0(struct bmsg_bmsg_vcard, 1);
+	i = pd->bmsg->nenvelopes - 1;
+	pd->bmsg->recipients[i] = g_slist_prepend(pd->bmsg->recipients[i],
+								pd->vcard);
+	pd->state = BMSG_STATE_VCARD;
+	pd->unwind_state = BMSG_STATE_RECIPIENT;
+
 	return 0;
 }
 
-static int bmsg_parser_begin_body(struct bmsg_parser *pd)
+static int bmsg_parser_begin_body(struct bmsg_parser *pd, const char *line,
+								size_t len)
 {
-	if (match_full_line(pd, "BEGIN:BBODY") != 0)
+	int i;
+
+	if (!match_full_line(line, len, "BEGIN:BBODY"))
 		return -1;
 
+	/* Recipients are prepended as messages may have plenty of them */
+	for (i = 0; i < pd->bmsg->nenvelopes; i++)
+		pd->bmsg->recipients[i] =
+				g_slist_reverse(pd->bmsg->recipients[i]);
+
 	pd->state = BMSG_STATE_PART_ID;
 
 	return 0;
 }
 
-static int bmsg_parser_part_id(struct bmsg_parser *pd)
+static int bmsg_parser_part_id(struct bmsg_parser *pd, const char *line,
+								size_t len)
 {
-	ssize_t len;
-	char *val, *s, *e;
+	const char *val;
+	ssize_t vlen;
 	unsigned long id;
 
-	len = match_with_param(pd, "PARTID:", &val);
-	if (len < 0)
-		goto cont;
-
-	if (!isdigit(val[0]))
-		return -1;
+	pd->state = BMSG_STATE_ENCODING;
 
-	s = g_strndup(val, len);
-	id = strtoul(val, &e, 10);
-	g_free(s);
+	vlen = match_with_param(line, len, "PARTID:", &val);
+	if (vlen < 0)
+		return 1;
 
-	if (*e != '\0')
-		return -1;
-	if (id > 65535)
+	if (!parse_number(val, vlen, &id) || id > 65535)
 		return -1;
 
 	pd->bmsg->part_id = id;
 
-cont:
-	pd->state = BMSG_STATE_ENCODING;
-
 	return 0;
 }
 
-static int bmsg_parser_encoding(struct bmsg_parser *pd)
+static int bmsg_parser_encoding(struct bmsg_parser *pd, const char *line,
+								size_t len)
 {
-	ssize_t len;
-	char *val;
+	const char *val;
+	ssize_t vlen;
 	unsigned int i;
 
-	len = match_with_param(pd, "ENCODING:", &val);
-	if (len < 0)
-		goto cont;
+	pd->state = BMSG_STATE_CHARSET;
+
+	vlen = match_with_param(line, len, "ENCODING:", &val);
+	if (vlen < 0)
+		return 1;
 
 	for (i = 0; i < sizeof(bmsg_encodings)/sizeof(bmsg_encodings[0]); ++i) {
-		if (strncmp(val, bmsg_encodings[i].s, len) == 0) {
+		if (match_full_line(val, vlen, bmsg_encodings[i].s)) {
 			pd->bmsg->encoding = bmsg_encodings[i].encoding;
-			goto cont;
+			return 0;
 		}
 	}
 
 	return -1;	/* No matching encoding */
-
-cont:
-	pd->state = BMSG_STATE_CHARSET;
-
-	return 0;
 }
 
-static int bmsg_parser_charset(struct bmsg_parser *pd)
+static int bmsg_parser_charset(struct bmsg_parser *pd, const char *line,
+								size_t len)
 {
-	ssize_t len;
-	char *val;
+	const char *val;
+	ssize_t vlen;
 
-	len = match_with_param(pd, "CHARSET:", &val);
-	if (len < 0)
-		goto cont;
+	pd->state = BMSG_STATE_LANGUAGE;
 
-	if (strncmp(val, "UTF-8", len) != 0)
+	vlen = match_with_param(line, len, "CHARSET:", &val);
+	if (vlen < 0)
+		return 1;
+
+	if (!match_full_line(val, vlen, "UTF-8"))
 		return -1;
 
 	pd->bmsg->charset = BMSG_C_UTF8;
-cont:
-	pd->state = BMSG_STATE_LANGUAGE;
 
 	return 0;
 }
 
-static int bmsg_parser_language(struct bmsg_parser *pd)
+static int bmsg_parser_language(struct bmsg_parser *pd, const char *line,
+								size_t len)
 {
-	ssize_t len;
-	char *val;
+	const char *val;
+	ssize_t vlen;
 	unsigned int i;
 
-	len = match_with_param(pd, "LANGUAGE:", &val);
-	if (len < 0)
-		goto cont;
+	pd->state = BMSG_STATE_LENGTH;
+
+	vlen = match_with_param(line, len, "LANGUAGE:", &val);
+	if (vlen < 0)
+		return 1;
 
 	for (i = 0; i < sizeof(bmsg_languages)/sizeof(bmsg_languages[0]); ++i) {
-		if (strncmp(val, bmsg_languages[i].s, len) == 0) {
+		if (match_full_line(val, vlen, bmsg_languages[i].s)) {
 			pd->bmsg->language = bmsg_languages[i].language;
-			goto cont;
+			return 0;
 		}
 	}
 
 	return -1;	/* No matching language */
-
-cont:
-	pd->state = BMSG_STATE_LENGTH;
-
-	return 0;
 }
 
-static int bmsg_parser_length(struct bmsg_parser *pd)
+static int bmsg_parser_length(struct bmsg_parser *pd, const char *line,
+								size_t len)
 {
-	ssize_t len;
-	char *val, *s, *e;
+	const char *val;
+	ssize_t vlen;
 	unsigned long length;
 
-	len = match_with_param(pd, "LENGTH:", &val);
-	if (len < 0)
-		return -1;
-
-	if (!isdigit(val[0]))
+	vlen = match_with_param(line, len, "LENGTH:", &val);
+	if (vlen < 0)
 		return -1;
 
-	s = g_strndup(val, len);
-
-	length = strtoul(s, &e, 10);
-	if (*e != '\0')
+	if (!parse_number(val, vlen, &length))
 		return -1;
 
-	g_free(s);
-
 	pd->bmsg->length = length;
 	pd->state = BMSG_STATE_BEGIN_MSG;
 
@@ -548,86 +573,127 @@ void bmsg_free(struct bmsg_bmsg *bmsg)
 struct bmsg_parser *bmsg_parser_new(void)
 {
 	struct bmsg_parser *pd;
-	GError *gerror = NULL;
-	GRegex *re;
-
-	re = g_regex_new("^(?:[[:alnum:].]+\\.)?([[:alpha:]]+)"
-						"(?:;([^:]*?))?:(.*)",
-						G_REGEX_CASELESS | G_REGEX_RAW,
-						0, &gerror);
-	if (gerror != NULL) {
-		DBG("g_regex_new error: %s", gerror->message);
-		g_error_free(gerror);
-
-		return NULL;
-	}
 
 	pd = g_new0(struct bmsg_parser, 1);
 	pd->bmsg = bmsg_new();
-	pd->vcard_re = re;
+	pd->partial = g_string_new("");
 
 	return pd;
 }
 
-static char *memcrlf(char *s, size_t len)
+static const char *memcrlf(const char *s, const char *end)
 {
-	size_t i;
+	const char *cr;
+
+	while ((cr = memchr(s, '\r', end - s)) != NULL) {
+		if (cr + 1 == end)
+			return NULL;
+
+		if (cr[1] == '\n')
+			return cr;
 
-	len -= 1;
-	for (i = 0; i < len; ++i) {
-		if (s[i] == '\r' && s[i+1] == '\n')
-			return s + i;
+		s = cr + 1;
 	}
 
 	return NULL;
 }
 
-int bmsg_parser_process(struct bmsg_parser *pd, char **data, size_t len)
+static int parse_line(struct bmsg_parser *pd, const char *line, size_t len)
 {
 	int ret;
 
-	if (pd->finished)
-		return 0;
+	do {
+		ret = actions[pd->state](pd, line, len);
+	} while (ret > 0);
 
-	pd->input = *data;
-	pd->nleft = len;
+	if (ret < 0) {
+		DBG("bmsg parsing error, state %d, line: %.*s", pd->state,
+						(int) MIN(len, 40), line);
+		return ret;
+	}
 
-	for (;;) {
-		DBG("for %d %p", pd->state, actions[pd->state]);
-		if (actions[pd->state] == NULL) {
-			pd->finished = TRUE;
-			ret = 0;
-			break;
-		}
+	if (actions[pd->state] == NULL)
+		pd->finished = TRUE;
 
-		pd->eol = memcrlf(pd->input, pd->nleft);
-		if (pd->eol == NULL) {
-			ret = 1;
-			break;
-		}
+	return 0;
+}
+
+/* Takes the next line, ending in CRLF, out of the packet. Lines are parsed
+ * straight from the packet and only one split by a packet boundary is
+ * copied. Returns 1 if the packet ran out first. */
+static int next_line(struct bmsg_parser *pd, const char **pos,
+							const char *end)
+{
+	GString *partial = pd->partial;
+	const char *eol;
+	int ret;
+
+	/* The CR may have been the last byte of the previous packet */
+	if (partial->len > 0 && partial->str[partial->len - 1] == '\r' &&
+								**pos == '\n') {
+		*pos += 1;
+		g_string_truncate(partial, partial->len - 1);
+		goto parse_partial;
+	}
+
+	eol = memcrlf(*pos, end);
+	if (eol == NULL) {
+		/* Leaves room for a CR ending the packet */
+		if (partial->len + (end - *pos) > BMSG_LINE_MAX + 1)
+			goto too_long;
+
+		g_string_append_len(partial, *pos, end - *pos);
+		*pos = end;
+
+		return 1;
+	}
+
+	/* Same limit whether the line was split or not */
+	if (partial->len + (eol - *pos) > BMSG_LINE_MAX)
+		goto too_long;
 
-		ret = actions[pd->state](pd);
-		if (ret < 0) {
-			char *tmp;
+	if (partial->len == 0) {
+		ret = parse_line(pd, *pos, eol - *pos);
+		*pos = eol + 2;
 
-			tmp = pd->input;
-			if ((pd->input - *data) > 20)
-				tmp = pd->input - 20;
-			else
-				tmp = *data;
+		return ret;
+	}
+
+	g_string_append_len(partial, *pos, eol - *pos);
+	*pos = eol + 2;
+
+parse_partial:
+	ret = parse_line(pd, partial->str, partial->len);
+	g_string_truncate(partial, 0);
+
+	return ret;
+
+too_long:
+	DBG("bmsg header line too long");
+	return -EBADR;
+}
+
+/* Returns 0 when the header is complete, with *data pointing at the first
+ * byte past it, and 1 when the whole packet was consumed. */
+int bmsg_parser_process(struct bmsg_parser *pd, const char **data,
+								size_t len)
+{
+	const char *pos = *data;
+	const char *end = pos + len;
 
-			/* FIXME: no zero */
-			DBG("bmsg parsing error, state %d, context: %.40s",
-								pd->state, tmp);
+	if (pd->finished)
+		return 0;
 
+	while (pos < end && !pd->finished) {
+		if (next_line(pd, &pos, end) < 0) {
 			pd->finished = TRUE;
-			break;
+			return -EBADR;
 		}
 	}
 
-	*data = pd->input;
+	*data = pos;
 
-	return ret;
+	return pd->finished ? 0 : 1;
 }
 
 struct bmsg_bmsg *bmsg_parser_get_bmsg(struct bmsg_parser *pd)
@@ -649,7 +715,7 @@ void bmsg_parser_free(struct bmsg_parser *pd)
 		return;
 
 	bmsg_free(pd->bmsg);
-	g_regex_unref(pd->vcard_re);
+	g_string_free(pd->partial, TRUE);
 
 	g_free(pd);
 }
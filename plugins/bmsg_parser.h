@@ -86,7 +86,8 @@ struct bmsg_parser;
 struct bmsg_bmsg *bmsg_new(void);
 void bmsg_free(struct bmsg_bmsg *bmsg);
 struct bmsg_parser *bmsg_parser_new(void);
-int bmsg_parser_process(struct bmsg_parser *pd, char **data, size_t len);
+int bmsg_parser_process(struct bmsg_parser *pd, const char **data,
+								size_t len);
 struct bmsg_bmsg *bmsg_parser_get_bmsg(struct bmsg_parser *pd);
 void bmsg_parser_free(struct bmsg_parser *pd);
 size_t bmsg_parser_tail_length(struct bmsg_bmsg *bmsg);
@@ -26,6 +26,7 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -37,8 +38,10 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/sendfile.h>
+#include <sys/inotify.h>
 #include <fcntl.h>
 #include <wait.h>
+#include <inttypes.h>
 
 #include <glib.h>
 
@@ -144,20 +147,311 @@ static char *file_stat_line(char *filename, struct stat *fstat,
 	return ret;
 }
 
+/* Async I/O: each open file gets a front buffer used by the main loop
+ * and a back buffer owned by a worker thread while a job is queued */
+#define FILE_IO_THREADS 4
+#define FILE_IO_BUFFER_SIZE (64 * 1024)
+
+/* Large files are read a window at a time and sent straight out of it.
+ * Not mmap: a writer truncating the file would turn the next access into
+ * SIGBUS, while read() just comes back short. */
+#define FILE_DIRECT_THRESHOLD (1024 * 1024)
+#define FILE_DIRECT_WINDOW (256 * 1024)
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif /* FALLOC_FL_KEEP_SIZE */
+
+struct file_object {
+	int fd;
+	char *path;
+	char *tmp;		/* Temporary file renamed to path on close */
+	gboolean async;
+	gboolean writing;
+	size_t buffer_size;
+	off_t size;
+	uint8_t *window;
+	size_t window_start;
+	size_t window_len;
+	uint8_t *front;
+	size_t front_start;
+	size_t front_len;
+	uint8_t *back;		/* Owned by the worker while busy */
+	size_t back_len;
+	gboolean lent;		/* Front handed out until the next read */
+	gboolean busy;
+	gboolean waiting;	/* Caller got -EAGAIN, notify when ready */
+	gboolean drain;		/* Notify once everything is written */
+	gboolean committing;	/* Close before the final response */
+	gboolean closed;	/* By a commit, only freeing is left */
+	gboolean closing;
+	gboolean aborted;	/* Drop what was written on close */
+	gboolean eof;
+	int err;
+	int64_t expected;	/* Announced size of an incoming object */
+	int64_t accepted;
+	int64_t reserve;	/* Left for the first write job to allocate */
+	/* Job results, written by the worker */
+	gboolean job_close;
+	gboolean job_eof;
+	int job_err;
+};
+
+static GThreadPool *file_io_pool = NULL;
+
+static void file_object_free(struct file_object *object)
+{
+	g_free(object->window);
+	g_free(object->front);
+	g_free(object->back);
+	g_free(object->path);
+	g_free(object->tmp);
+	g_free(object);
+}
+
+static int file_write_all(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Publish the temporary file under its real name if it is complete, an
+ * aborted object is removed and an atomic PUT leaves the target alone */
+static int file_commit(struct file_object *object, int err)
+{
+	if (object->aborted) {
+		unlink(object->tmp ? object->tmp : object->path);
+		return -ECANCELED;
+	}
+
+	if (object->tmp == NULL)
+		return err;
+
+	if (err == 0 && (object->expected < 0 ||
+				object->accepted == object->expected)) {
+		if (rename(object->tmp, object->path) == 0)
+			return 0;
+
+		err = -errno;
+	}
+
+	unlink(object->tmp);
+
+	return err;
+}
+
+/* Reserve the whole object at once so it isn't fragmented, the file size
+ * still only grows as data is written */
+static int file_reserve(int fd, int64_t size)
+{
+#ifdef HAVE_FALLOCATE
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0 && errno == ENOSPC)
+		return -ENOSPC;
+#endif
+
+	return 0;
+}
+
+static gboolean file_io_done(void *data);
+
+static void file_io_worker(void *data, void *user_data)
+{
+	struct file_object *object = data;
+	size_t done = 0;
+	ssize_t ret;
+
+	object->job_err = 0;
+	object->job_eof = FALSE;
+
+	if (object->writing) {
+		if (object->reserve > 0 && !object->job_close)
+			object->job_err = file_reserve(object->fd,
+							object->reserve);
+		object->reserve = 0;
+
+		if (object->job_err == 0)
+			object->job_err = file_write_all(object->fd,
+						object->back, object->back_len);
+		object->back_len = 0;
+	} else if (!object->job_close) {
+		while (done < object->buffer_size) {
+			ret = read(object->fd, object->back + done,
+					object->buffer_size - done);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				object->job_err = -errno;
+				break;
+			}
+
+			if (ret == 0) {
+				object->job_eof = TRUE;
+				break;
+			}
+
+			done += ret;
+		}
+		object->back_len = done;
+	}
+
+	if (object->job_close) {
+		if (close(object->fd) < 0 && object->job_err == 0)
+			object->job_err = -errno;
+
+		/* Don't publish what an earlier job failed to write */
+		if (object->job_err == 0)
+			object->job_err = object->err;
+
+		object->job_err = file_commit(object, object->job_err);
+	}
+
+	/* Results are picked up from the main loop */
+	g_idle_add(file_io_done, object);
+}
+
+static void file_io_schedule(struct file_object *object, gboolean close)
+{
+	uint8_t *tmp;
+
+	if (object->writing) {
+		/* Hand the collected data over to the worker */
+		tmp = object->back;
+		object->back = object->front;
+		object->back_len = object->front_len;
+		object->front = tmp;
+		object->front_len = 0;
+	}
+
+	object->busy = TRUE;
+	object->job_close = close;
+
+	g_thread_pool_push(file_io_pool, object, NULL);
+}
+
+/* Make the read-ahead data current and start fetching the next chunk */
+static void file_io_read_ahead(struct file_object *object)
+{
+	uint8_t *tmp;
+
+	if (object->back_len == 0)
+		return;
+
+	tmp = object->front;
+	object->front = object->back;
+	object->front_start = 0;
+	object->front_len = object->back_len;
+	object->back = tmp;
+	object->back_len = 0;
+
+	if (!object->eof && object->err == 0)
+		file_io_schedule(object, FALSE);
+}
+
+static gboolean file_io_done(void *data)
+{
+	struct file_object *object = data;
+	int flags;
+
+	object->busy = FALSE;
+
+	if (object->job_close && (object->closing || !object->committing)) {
+		if (object->job_err < 0)
+			error("file I/O: %s (%d)", strerror(-object->job_err),
+							-object->job_err);
+		file_object_free(object);
+		return FALSE;
+	}
+
+	if (object->job_err < 0 && object->err == 0)
+		object->err = object->job_err;
+
+	if (object->job_close) {
+		object->committing = FALSE;
+		object->closed = TRUE;
+	} else if (object->closing) {
+		file_io_schedule(object, TRUE);
+		return FALSE;
+	} else if (object->writing) {
+		/* Keep writing behind while more data was collected */
+		if (object->committing && object->err == 0)
+			file_io_schedule(object, TRUE);
+		else if (object->front_len > 0 && object->err == 0)
+			file_io_schedule(object, FALSE);
+	} else {
+		object->eof = object->job_eof;
+
+		if (object->front_len == 0 && !object->lent)
+			file_io_read_ahead(object);
+	}
+
+	if (!object->waiting)
+		return FALSE;
+
+	if (object->drain && object->err == 0 &&
+				(object->busy || object->front_len > 0))
+		return FALSE;
+
+	object->waiting = FALSE;
+	object->drain = FALSE;
+
+	if (object->err < 0)
+		flags = G_IO_ERR;
+	else
+		flags = object->writing ? G_IO_OUT : G_IO_IN;
+
+	/* May close the object, so it must not be touched afterwards */
+	obex_object_set_io_flags(object, flags, object->err);
+
+	return FALSE;
+}
+
 static void *filesystem_open(const char *name, int oflag, mode_t mode,
 					void *context, size_t *size, int *err)
 {
+	struct file_object *object;
 	struct stat stats;
 	struct statvfs buf;
 	const char *root_folder;
-	char *folder;
+	char *folder, *base;
+	char *tmp = NULL;
 	gboolean root;
-	int fd = open(name, oflag, mode);
+	int fd;
 	uint64_t avail;
 
+	if (oflag != O_RDONLY && obex_option_atomic_put()) {
+		/* Hidden from listings until it is renamed on close */
+		folder = g_path_get_dirname(name);
+		base = g_path_get_basename(name);
+		tmp = g_strdup_printf("%s/.%s.XXXXXX", folder, base);
+		g_free(base);
+		g_free(folder);
+
+		fd = g_mkstemp(tmp);
+		if (fd >= 0 && fchmod(fd, mode) < 0) {
+			unlink(tmp);
+			close(fd);
+			fd = -1;
+		}
+	} else
+		fd = open(name, oflag, mode);
+
 	if (fd < 0) {
 		if (err)
 			*err = -errno;
+		g_free(tmp);
 		return NULL;
 	}
 
@@ -204,30 +498,225 @@ static void *filesystem_open(const char *name, int oflag, mode_t mode,
 		goto failed;
 	}
 
+	/* With async I/O the first write job does it, off the main loop */
+	if (file_io_pool == NULL && *size > 0 &&
+				file_reserve(fd, *size) < 0) {
+		if (err)
+			*err = -ENOSPC;
+		goto failed;
+	}
+
 done:
 	if (err)
 		*err = 0;
 
-	return GINT_TO_POINTER(fd);
+	object = g_new0(struct file_object, 1);
+	object->fd = fd;
+	object->writing = (oflag != O_RDONLY);
+	object->expected = -1;
+
+	if (object->writing) {
+		object->buffer_size = obex_option_write_buffer();
+		object->path = g_strdup(name);
+		object->tmp = tmp;
+
+		if (size)
+			object->expected = *size;
+
+		if (file_io_pool && size)
+			object->reserve = *size;
+	} else {
+		object->buffer_size = FILE_IO_BUFFER_SIZE;
+		object->size = stats.st_size;
+
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	if (file_io_pool == NULL) {
+		if (object->writing && object->buffer_size > 0)
+			object->front = g_malloc(object->buffer_size);
+
+		return object;
+	}
+
+	if (object->buffer_size == 0)
+		object->buffer_size = FILE_IO_BUFFER_SIZE;
+
+	object->async = TRUE;
+	object->front = g_malloc(object->buffer_size);
+	object->back = g_malloc(object->buffer_size);
+
+	/* Start reading ahead right away */
+	if (!object->writing)
+		file_io_schedule(object, FALSE);
+
+	return object;
 
 failed:
 	close(fd);
+	if (tmp) {
+		unlink(tmp);
+		g_free(tmp);
+	}
+
 	return NULL;
 }
 
+static int file_write_front(struct file_object *object)
+{
+	int err;
+
+	err = file_write_all(object->fd, object->front, object->front_len);
+	if (err < 0)
+		object->err = err;
+
+	object->front_len = 0;
+
+	return err;
+}
+
 static int filesystem_close(void *object)
 {
-	if (close(GPOINTER_TO_INT(object)) < 0)
+	struct file_object *file = object;
+	int err = file->err;
+
+	if (file->async) {
+		if (file->busy) {
+			file->closing = TRUE;
+			return 0;
+		}
+
+		if (file->closed) {
+			file_object_free(file);
+			return err;
+		}
+
+		/* Pending data is written and the fd closed by a worker */
+		if (file->writing) {
+			file->committing = FALSE;
+			file_io_schedule(file, TRUE);
+			return 0;
+		}
+	}
+
+	if (!file->async && file->front_len > 0 && err == 0 && !file->aborted)
+		err = file_write_front(file);
+
+	if (close(file->fd) < 0 && err == 0)
+		err = -errno;
+
+	err = file_commit(file, err);
+
+	file_object_free(file);
+
+	return err;
+}
+
+/* Refill the window from the current file position, returns the number of
+ * bytes read, 0 at the end of the file */
+static ssize_t file_fill_window(struct file_object *file)
+{
+	ssize_t ret;
+
+	if (file->window == NULL)
+		file->window = g_malloc(FILE_DIRECT_WINDOW);
+
+	file->window_start = 0;
+	file->window_len = 0;
+
+	do {
+		ret = read(file->fd, file->window, FILE_DIRECT_WINDOW);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
 		return -errno;
 
-	return 0;
+	file->window_len = ret;
+
+	return ret;
+}
+
+/* Hands out the read-ahead data in place, it stays valid until the next
+ * read since the front buffer isn't given back to the worker before */
+static ssize_t file_read_front(struct file_object *file, const void **buf,
+								size_t count)
+{
+	ssize_t ret;
+
+	file->lent = FALSE;
+
+	if (file->front_len == 0 && !file->busy)
+		file_io_read_ahead(file);
+
+	if (file->front_len > 0) {
+		ret = MIN(file->front_len, count);
+		*buf = file->front + file->front_start;
+		file->front_start += ret;
+		file->front_len -= ret;
+		file->lent = TRUE;
+
+		return ret;
+	}
+
+	if (file->err < 0)
+		return file->err;
+
+	if (file->eof && !file->busy)
+		return 0;
+
+	file->waiting = TRUE;
+
+	return -EAGAIN;
+}
+
+static ssize_t filesystem_read_direct(void *object, const void **buf,
+								size_t count)
+{
+	struct file_object *file = object;
+	ssize_t ret;
+
+	if (file->writing)
+		return -ENOTSUP;
+
+	if (file->async)
+		return file_read_front(file, buf, count);
+
+	if (file->size < FILE_DIRECT_THRESHOLD)
+		return -ENOTSUP;
+
+	if (file->window_start == file->window_len) {
+		ret = file_fill_window(file);
+		if (ret <= 0)
+			return ret;
+	}
+
+	ret = MIN(file->window_len - file->window_start, count);
+	*buf = file->window + file->window_start;
+	file->window_start += ret;
+
+	return ret;
 }
 
 static ssize_t filesystem_read(void *object, void *buf, size_t count)
 {
+	struct file_object *file = object;
+	const void *data;
 	ssize_t ret;
 
-	ret = read(GPOINTER_TO_INT(object), buf, count);
+	ret = filesystem_read_direct(object, &data, count);
+	if (ret >= 0) {
+		memcpy(buf, data, ret);
+
+		/* Copied out, the buffer can be reused right away */
+		file->lent = FALSE;
+
+		return ret;
+	}
+
+	if (ret != -ENOTSUP)
+		return ret;
+
+	ret = read(file->fd, buf, count);
 	if (ret < 0)
 		return -errno;
 
@@ -236,15 +725,93 @@ static ssize_t filesystem_read(void *object, void *buf, size_t count)
 
 static ssize_t filesystem_write(void *object, const void *buf, size_t count)
 {
+	struct file_object *file = object;
 	ssize_t ret;
+	int err;
 
-	ret = write(GPOINTER_TO_INT(object), buf, count);
-	if (ret < 0)
-		return -errno;
+	if (file->front == NULL) {
+		ret = write(file->fd, buf, count);
+		if (ret < 0)
+			return -errno;
+
+		file->accepted += ret;
+
+		return ret;
+	}
+
+	if (file->err < 0)
+		return file->err;
+
+	/* Coalesce packets into buffer sized writes */
+	ret = MIN(file->buffer_size - file->front_len, count);
+	if (ret == 0) {
+		file->waiting = TRUE;
+		return -EAGAIN;
+	}
+
+	memcpy(file->front + file->front_len, buf, ret);
+	file->front_len += ret;
+	file->accepted += ret;
+
+	if (file->front_len < file->buffer_size)
+		return ret;
+
+	if (!file->async) {
+		err = file_write_front(file);
+		if (err < 0)
+			return err;
+	} else if (!file->busy)
+		file_io_schedule(file, FALSE);
 
 	return ret;
 }
 
+static int filesystem_flush(void *object)
+{
+	struct file_object *file = object;
+
+	if (!file->writing || file->front == NULL)
+		return 0;
+
+	if (file->err < 0)
+		return file->err;
+
+	if (file->closed)
+		return 0;
+
+	/* Keep coalescing until the whole object has arrived */
+	if (file->accepted != file->expected)
+		return 0;
+
+	if (!file->async)
+		return file_write_front(file);
+
+	/* Hold the final response until the object is written, closed and
+	 * renamed into place, errors on the way are reported with G_IO_ERR */
+	file->committing = TRUE;
+	if (!file->busy)
+		file_io_schedule(file, TRUE);
+
+	file->waiting = TRUE;
+	file->drain = TRUE;
+
+	return -EAGAIN;
+}
+
+static int filesystem_abort(void *object)
+{
+	struct file_object *file = object;
+
+	if (!file->writing)
+		return 0;
+
+	DBG("%p", file);
+
+	file->aborted = TRUE;
+
+	return 0;
+}
+
 static int filesystem_rename(const char *name, const char *destname)
 {
 	int ret;
@@ -256,86 +823,268 @@ static int filesystem_rename(const char *name, const char *destname)
 		return -errno;
 	}
 
-	return ret;
-}
+	return ret;
+}
+
+enum copy_method {
+	COPY_FILE_RANGE,
+	COPY_SENDFILE,
+	COPY_READ_WRITE,
+};
+
+struct copy_object {
+	int in_fd;
+	int out_fd;
+	enum copy_method method;	/* Only touched by the copy thread */
+	char *destname;
+	off_t size;
+	off_t copied;		/* Protected by lock */
+	GMutex *lock;
+	int64_t *progress;	/* Only touched from the main loop */
+	guint progress_id;
+	volatile gint cancelled;
+	int err;
+};
+
+static void copy_object_free(struct copy_object *object)
+{
+	close(object->in_fd);
+	close(object->out_fd);
+	g_mutex_free(object->lock);
+	g_free(object->destname);
+	g_free(object);
+}
+
+/* Falls back to the next method when one isn't supported between these
+ * files, and sticks to it for the rest of the copy */
+static ssize_t copy_chunk(struct copy_object *object, size_t count)
+{
+	uint8_t buf[4096];
+	ssize_t ret;
+	int err;
+
+	switch (object->method) {
+	case COPY_FILE_RANGE:
+#ifdef HAVE_COPY_FILE_RANGE
+		ret = copy_file_range(object->in_fd, NULL, object->out_fd,
+							NULL, count, 0);
+		if (ret >= 0 || (errno != EXDEV && errno != EINVAL &&
+							errno != ENOSYS))
+			return ret;
+#endif
+		object->method = COPY_SENDFILE;
+		/* fall through */
+	case COPY_SENDFILE:
+		ret = sendfile(object->out_fd, object->in_fd, NULL, count);
+		if (ret >= 0 || (errno != EINVAL && errno != ENOSYS))
+			return ret;
+
+		object->method = COPY_READ_WRITE;
+		/* fall through */
+	case COPY_READ_WRITE:
+		break;
+	}
+
+	ret = read(object->in_fd, buf, MIN(count, sizeof(buf)));
+	if (ret <= 0)
+		return ret;
+
+	/* What was read is gone from the source, so all of it has to go out */
+	err = file_write_all(object->out_fd, buf, ret);
+	if (err < 0) {
+		errno = -err;
+		return -1;
+	}
+
+	return ret;
+}
+
+static gboolean copy_progress(void *data)
+{
+	struct copy_object *object = data;
+
+	if (g_atomic_int_get(&object->cancelled))
+		return FALSE;
+
+	g_mutex_lock(object->lock);
+	*object->progress = object->copied;
+	g_mutex_unlock(object->lock);
+
+	obex_object_set_io_flags(object, G_IO_OUT, 0);
+
+	/* The watch may have cancelled the copy */
+	if (g_atomic_int_get(&object->cancelled)) {
+		object->progress_id = 0;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean copy_done(void *data)
+{
+	struct copy_object *object = data;
+
+	if (object->progress_id > 0)
+		g_source_remove(object->progress_id);
+
+	if (object->err < 0 || g_atomic_int_get(&object->cancelled)) {
+		if (unlink(object->destname) < 0)
+			DBG("unlink(%s): %s (%d)", object->destname,
+						strerror(errno), errno);
+	}
+
+	if (!g_atomic_int_get(&object->cancelled)) {
+		*object->progress = object->copied;
+
+		if (object->err < 0)
+			obex_object_set_io_flags(object, G_IO_ERR, object->err);
+		else
+			obex_object_set_io_flags(object, G_IO_IN, 0);
+	}
+
+	copy_object_free(object);
+
+	return FALSE;
+}
+
+static void *copy_thread(void *data)
+{
+	struct copy_object *object = data;
+	off_t copied = 0;
+
+	while (copied < object->size) {
+		ssize_t ret;
+
+		if (g_atomic_int_get(&object->cancelled)) {
+			object->err = -ECANCELED;
+			break;
+		}
+
+		ret = copy_chunk(object, MIN(object->size - copied, 1 << 20));
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			object->err = -errno;
+			error("copy(%s): %s (%d)", object->destname,
+						strerror(errno), errno);
+			break;
+		}
+
+		/* Source shrunk while being copied, the target would be
+		 * truncated */
+		if (ret == 0) {
+			object->err = -EIO;
+			error("copy(%s): source truncated at %jd of %jd bytes",
+						object->destname,
+						(intmax_t) copied,
+						(intmax_t) object->size);
+			break;
+		}
+
+		copied += ret;
+
+		g_mutex_lock(object->lock);
+		object->copied = copied;
+		g_mutex_unlock(object->lock);
+	}
+
+	if (object->err == 0 && fsync(object->out_fd) < 0)
+		object->err = -errno;
+
+	g_idle_add(copy_done, object);
+
+	return NULL;
+}
+
+static void *filesystem_copy(const char *name, const char *destname,
+				size_t *size, int64_t *progress, int *err)
+{
+	struct copy_object *object;
+	struct stat st;
+	GError *gerr = NULL;
+	int in_fd, out_fd, ret;
+
+	in_fd = open(name, O_RDONLY);
+	if (in_fd < 0) {
+		ret = -errno;
+		error("open(%s): %s (%d)", name, strerror(-ret), -ret);
+		goto fail;
+	}
+
+	if (fstat(in_fd, &st) < 0) {
+		ret = -errno;
+		error("stat(%s): %s (%d)", name, strerror(-ret), -ret);
+		close(in_fd);
+		goto fail;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		ret = -EPERM;
+		close(in_fd);
+		goto fail;
+	}
+
+	out_fd = open(destname, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode);
+	if (out_fd < 0) {
+		ret = -errno;
+		error("open(%s): %s (%d)", destname, strerror(-ret), -ret);
+		close(in_fd);
+		goto fail;
+	}
+
+	object = g_new0(struct copy_object, 1);
+	object->in_fd = in_fd;
+	object->out_fd = out_fd;
+	object->destname = g_strdup(destname);
+	object->size = st.st_size;
+	object->lock = g_mutex_new();
+	object->progress = progress;
+
+	if (!g_thread_create(copy_thread, object, FALSE, &gerr)) {
+		error("%s", gerr->message);
+		g_error_free(gerr);
+		unlink(destname);
+		copy_object_free(object);
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	object->progress_id = g_timeout_add_seconds(1, copy_progress, object);
 
-static int sendfile_async(int out_fd, int in_fd, off_t *offset, size_t count)
-{
-	int pid;
+	if (size)
+		*size = st.st_size;
 
-	/* Run sendfile on child process */
-	pid = fork();
-	switch (pid) {
-		case 0:
-			break;
-		case -1:
-			error("fork() %s (%d)", strerror(errno), errno);
-			return -errno;
-		default:
-			DBG("child %d forked", pid);
-			return pid;
-	}
+	if (err)
+		*err = 0;
 
-	/* At child */
-	if (sendfile(out_fd, in_fd, offset, count) < 0)
-		error("sendfile(): %s (%d)", strerror(errno), errno);
+	return object;
 
-	close(in_fd);
-	close(out_fd);
+fail:
+	if (err)
+		*err = ret;
 
-	exit(errno);
+	return NULL;
 }
 
-static int filesystem_copy(const char *name, const char *destname)
+static int filesystem_cancel(void *object)
 {
-	void *in, *out;
-	ssize_t ret;
-	size_t size;
-	struct stat st;
-	int in_fd, out_fd, err;
-
-	in = filesystem_open(name, O_RDONLY, 0, NULL, &size, &err);
-	if (in == NULL) {
-		error("open(%s): %s (%d)", name, strerror(-err), -err);
-		return -err;
-	}
-
-	in_fd = GPOINTER_TO_INT(in);
-	ret = fstat(in_fd, &st);
-	if (ret < 0) {
-		error("stat(%s): %s (%d)", name, strerror(errno), errno);
-		return -errno;
-	}
+	struct copy_object *copy = object;
 
-	out = filesystem_open(destname, O_WRONLY | O_CREAT | O_TRUNC,
-					st.st_mode, NULL, &size, &err);
-	if (out == NULL) {
-		error("open(%s): %s (%d)", destname, strerror(-err), -err);
-		filesystem_close(in);
-		return -errno;
-	}
+	DBG("%p", copy);
 
-	out_fd = GPOINTER_TO_INT(out);
+	/* The copy thread notices and copy_done frees the object */
+	g_atomic_int_set(&copy->cancelled, 1);
 
-	/* Check if sendfile is supported */
-	ret = sendfile(out_fd, in_fd, NULL, 0);
-	if (ret < 0) {
-		ret = -errno;
-		error("sendfile: %s (%zd)", strerror(-ret), -ret);
-		goto done;
+	if (copy->progress_id > 0) {
+		g_source_remove(copy->progress_id);
+		copy->progress_id = 0;
 	}
 
-	ret = sendfile_async(out_fd, in_fd, NULL, st.st_size);
-	if (ret < 0)
-		goto done;
+	copy->progress = NULL;
 
 	return 0;
-
-done:
-	filesystem_close(in);
-	filesystem_close(out);
-
-	return ret;
 }
 
 struct capability_object {
@@ -343,7 +1092,7 @@ struct capability_object {
 	int output;
 	int err;
 	gboolean aborted;
-	GString *buffer;
+	struct string_buffer *buffer;
 };
 
 static void script_exited(GPid pid, int status, void *data)
@@ -360,7 +1109,7 @@ static void script_exited(GPid pid, int status, void *data)
 	/* free the object if aborted */
 	if (object->aborted) {
 		if (object->buffer != NULL)
-			g_string_free(object->buffer, TRUE);
+			string_buffer_free(object->buffer);
 
 		g_free(object);
 		return;
@@ -419,10 +1168,11 @@ static void *capability_open(const char *name, int oflag, mode_t mode,
 			goto fail;
 		}
 
-		object->buffer = g_string_new(buf);
+		object->buffer = string_buffer_new(g_string_new(buf));
+		g_free(buf);
 
 		if (size)
-			*size = object->buffer->len;
+			*size = object->buffer->str->len;
 
 		goto done;
 	}
@@ -461,30 +1211,337 @@ static GString *append_folder_preamble(GString *object)
 	return g_string_append(object, FL_TYPE);
 }
 
-static GString *append_listing(GString *object, const char *name,
-				gboolean pcsuite, size_t *size, int *err)
-{
-	struct stat fstat, dstat;
-	struct dirent *ep;
+/* Rendered listings are cached per directory until inotify reports a
+ * change; directories with bigger listings are always streamed */
+#define LISTING_CACHE_MAX_ENTRIES 64
+#define LISTING_CACHE_MAX_SIZE (256 * 1024)
+
+/* IN_ACCESS covers the accessed attribute of the entries */
+#define LISTING_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | \
+				IN_ACCESS | IN_MOVED_FROM | IN_MOVED_TO | \
+				IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* Changes inside a subdirectory only show up as its new modified time */
+#define LISTING_SUBDIR_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+				IN_MOVED_TO)
+
+struct listing_cache {
+	char *path;
+	GArray *wds;		/* The directory first, then subdirectories */
+	gboolean root;
+	gboolean symlinks;
+	gboolean valid;
+	GString *body;		/* Everything after the DOCTYPE */
+	unsigned int refcount;
+	unsigned long last_used;
+};
+
+struct listing_object {
 	DIR *dp;
-	gboolean root, symlinks;
+	struct stat dstat;
+	gboolean root;
+	gboolean symlinks;
+	struct string_buffer *buffer;
+	struct listing_cache *cache;
+	gboolean cached;	/* Body is served from cache */
+	GString *body;		/* Body copy while filling cache */
+	gsize offset;		/* Read position in cache->body */
+};
+
+static GHashTable *listing_cache = NULL;
+static unsigned long listing_cache_clock = 0;
+static int inotify_fd = -1;
+static guint inotify_watch = 0;
+
+static struct listing_cache *listing_cache_ref(struct listing_cache *cache)
+{
+	cache->refcount++;
+
+	return cache;
+}
+
+static void listing_cache_unref(struct listing_cache *cache)
+{
+	if (--cache->refcount > 0)
+		return;
+
+	if (cache->body)
+		g_string_free(cache->body, TRUE);
+
+	g_array_free(cache->wds, TRUE);
+	g_free(cache->path);
+	g_free(cache);
+}
+
+static void listing_cache_destroy(void *data)
+{
+	struct listing_cache *cache = data;
+
+	cache->valid = FALSE;
+	listing_cache_unref(cache);
+}
+
+static gboolean match_wd(void *key, void *value, void *user_data)
+{
+	struct listing_cache *cache = value;
+	int wd = GPOINTER_TO_INT(user_data);
+	guint i;
+
+	for (i = 0; i < cache->wds->len; i++) {
+		if (g_array_index(cache->wds, int, i) == wd)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void listing_cache_remove(struct listing_cache *cache)
+{
+	guint i;
+
+	g_hash_table_steal(listing_cache, cache->path);
+
+	/* Watches are per inode, so other entries may share them */
+	for (i = 0; i < cache->wds->len; i++) {
+		int wd = g_array_index(cache->wds, int, i);
+
+		if (g_hash_table_find(listing_cache, match_wd,
+						GINT_TO_POINTER(wd)) == NULL)
+			inotify_rm_watch(inotify_fd, wd);
+	}
+
+	listing_cache_destroy(cache);
+}
+
+static void find_oldest(void *key, void *value, void *user_data)
+{
+	struct listing_cache *cache = value;
+	struct listing_cache **oldest = user_data;
+
+	if (*oldest == NULL || cache->last_used < (*oldest)->last_used)
+		*oldest = cache;
+}
+
+static gboolean inotify_event(GIOChannel *io, GIOCondition cond,
+							void *user_data)
+{
+	char buf[4096] __attribute__ ((aligned));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *ptr;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		inotify_watch = 0;
+		return FALSE;
+	}
+
+	len = read(inotify_fd, buf, sizeof(buf));
+	if (len <= 0)
+		return TRUE;
+
+	for (ptr = buf; ptr < buf + len;
+			ptr += sizeof(struct inotify_event) + ev->len) {
+		struct listing_cache *cache;
+
+		ev = (const struct inotify_event *) ptr;
+
+		if (ev->mask & IN_Q_OVERFLOW) {
+			DBG("inotify queue overflow, dropping listing cache");
+			g_hash_table_remove_all(listing_cache);
+			continue;
+		}
+
+		/* Reading a directory only changes its own accessed time,
+		 * which its listing doesn't show; the parent gets the event
+		 * with the name set */
+		if ((ev->mask & IN_ACCESS) && ev->len == 0)
+			continue;
+
+		while ((cache = g_hash_table_find(listing_cache, match_wd,
+					GINT_TO_POINTER(ev->wd))) != NULL) {
+			DBG("%s invalidated (wd %d mask 0x%x)", cache->path,
+							ev->wd, ev->mask);
+			listing_cache_remove(cache);
+		}
+	}
+
+	return TRUE;
+}
+
+static void listing_cache_init(void)
+{
+	GIOChannel *io;
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		error("inotify_init1: %s (%d)", strerror(errno), errno);
+		return;
+	}
+
+	listing_cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+							listing_cache_destroy);
+
+	io = g_io_channel_unix_new(inotify_fd);
+	inotify_watch = g_io_add_watch(io,
+				G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+				inotify_event, NULL);
+	g_io_channel_unref(io);
+}
+
+static void listing_cache_exit(void)
+{
+	if (inotify_watch > 0) {
+		g_source_remove(inotify_watch);
+		inotify_watch = 0;
+	}
+
+	if (listing_cache) {
+		g_hash_table_destroy(listing_cache);
+		listing_cache = NULL;
+	}
+
+	if (inotify_fd >= 0) {
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+}
+
+/* Returns a cached listing, or registers a new entry to be filled by the
+ * caller when none is cached; NULL if the directory cannot be cached */
+static struct listing_cache *listing_cache_lookup(const char *name,
+					gboolean root, gboolean symlinks)
+{
+	struct listing_cache *cache, *oldest = NULL;
+	int wd;
+
+	if (listing_cache == NULL || inotify_watch == 0)
+		return NULL;
+
+	cache = g_hash_table_lookup(listing_cache, name);
+	if (cache) {
+		/* Another session is still filling it */
+		if (cache->body == NULL)
+			return NULL;
+
+		if (cache->root == root && cache->symlinks == symlinks) {
+			cache->last_used = ++listing_cache_clock;
+			return listing_cache_ref(cache);
+		}
+
+		listing_cache_remove(cache);
+	}
+
+	if (g_hash_table_size(listing_cache) >= LISTING_CACHE_MAX_ENTRIES) {
+		g_hash_table_foreach(listing_cache, find_oldest, &oldest);
+		listing_cache_remove(oldest);
+	}
+
+	/* Watch before reading so no change can slip in unnoticed */
+	wd = inotify_add_watch(inotify_fd, name, LISTING_WATCH_MASK |
+							IN_ONLYDIR);
+	if (wd < 0) {
+		DBG("inotify_add_watch(%s): %s (%d)", name, strerror(errno),
+									errno);
+		return NULL;
+	}
+
+	cache = g_new0(struct listing_cache, 1);
+	cache->path = g_strdup(name);
+	cache->wds = g_array_new(FALSE, FALSE, sizeof(int));
+	g_array_append_val(cache->wds, wd);
+	cache->root = root;
+	cache->symlinks = symlinks;
+	cache->valid = TRUE;
+	cache->refcount = 1;
+	cache->last_used = ++listing_cache_clock;
+
+	g_hash_table_insert(listing_cache, cache->path, cache);
+
+	return listing_cache_ref(cache);
+}
+
+static void listing_append(struct listing_object *listing, const char *str)
+{
+	g_string_append(listing->buffer->str, str);
+
+	if (listing->body == NULL)
+		return;
+
+	if (listing->body->len > LISTING_CACHE_MAX_SIZE) {
+		/* Too big to keep around, just stream it */
+		g_string_free(listing->body, TRUE);
+		listing->body = NULL;
+		return;
+	}
+
+	g_string_append(listing->body, str);
+}
+
+static void listing_free(struct listing_object *listing)
+{
+	if (listing->dp)
+		closedir(listing->dp);
+
+	if (listing->buffer)
+		string_buffer_free(listing->buffer);
+
+	if (listing->body)
+		g_string_free(listing->body, TRUE);
+
+	if (listing->cache) {
+		/* Drop entries that were never completely filled */
+		if (listing->cache->body == NULL && listing->cache->valid)
+			listing_cache_remove(listing->cache);
+
+		listing_cache_unref(listing->cache);
+	}
+
+	g_free(listing);
+}
+
+static void *listing_open(const char *name, gboolean pcsuite, int *err)
+{
+	struct listing_object *listing;
+	GString *object;
 	int ret;
 
-	root = g_str_equal(name, obex_option_root_folder());
+	listing = g_new0(struct listing_object, 1);
+	listing->root = g_str_equal(name, obex_option_root_folder());
+	listing->symlinks = obex_option_symlinks();
 
-	dp = opendir(name);
-	if (dp == NULL) {
+	object = g_string_new(FL_VERSION);
+	if (pcsuite)
+		object = append_pcsuite_preamble(object);
+	else
+		object = append_folder_preamble(object);
+
+	listing->buffer = string_buffer_new(object);
+
+	listing->cache = listing_cache_lookup(name, listing->root,
+							listing->symlinks);
+	if (listing->cache && listing->cache->body) {
+		DBG("%s served from listing cache", name);
+		listing->cached = TRUE;
+		goto done;
+	}
+
+	listing->dp = opendir(name);
+	if (listing->dp == NULL) {
 		if (err)
 			*err = -ENOENT;
 		goto failed;
 	}
 
-	symlinks = obex_option_symlinks();
-	if (root && symlinks)
-		ret = stat(name, &dstat);
+	if (listing->cache)
+		listing->body = g_string_new(NULL);
+
+	listing_append(listing, FL_BODY_BEGIN);
+
+	if (listing->root && listing->symlinks)
+		ret = fstat(dirfd(listing->dp), &listing->dstat);
 	else {
-		object = g_string_append(object, FL_PARENT_FOLDER_ELEMENT);
-		ret = lstat(name, &dstat);
+		listing_append(listing, FL_PARENT_FOLDER_ELEMENT);
+		ret = lstat(name, &listing->dstat);
 	}
 
 	if (ret < 0) {
@@ -493,119 +1550,227 @@ static GString *append_listing(GString *object, const char *name,
 		goto failed;
 	}
 
-	while ((ep = readdir(dp))) {
+done:
+	if (err)
+		*err = 0;
+
+	return listing;
+
+failed:
+	listing_free(listing);
+	return NULL;
+}
+
+static void listing_complete(struct listing_object *listing)
+{
+	struct listing_cache *cache = listing->cache;
+
+	closedir(listing->dp);
+	listing->dp = NULL;
+
+	listing_append(listing, FL_BODY_END);
+
+	if (cache == NULL || listing->body == NULL)
+		return;
+
+	/* Only publish if nothing changed while the directory was read */
+	if (cache->valid) {
+		cache->body = listing->body;
+		listing->body = NULL;
+	}
+}
+
+/* A subdirectory's modified time is part of the listing, so the cache
+ * entry watches it too; added before the entry is stat'ed, like the
+ * directory's own watch */
+static int listing_watch_subdir(struct listing_object *listing,
+					const struct dirent *ep, int flags)
+{
+	uint32_t mask = LISTING_SUBDIR_MASK | IN_ONLYDIR | IN_MASK_ADD;
+	char *path;
+	int wd;
+
+	if (ep->d_type != DT_DIR && ep->d_type != DT_LNK &&
+						ep->d_type != DT_UNKNOWN)
+		return 0;
+
+	if (flags & AT_SYMLINK_NOFOLLOW)
+		mask |= IN_DONT_FOLLOW;
+
+	path = g_build_filename(listing->cache->path, ep->d_name, NULL);
+	wd = inotify_add_watch(inotify_fd, path, mask);
+	if (wd < 0) {
+		int err = -errno;
+
+		if (err == -ENOTDIR) {
+			g_free(path);
+			return 0;
+		}
+
+		DBG("inotify_add_watch(%s): %s (%d)", path, strerror(-err),
+									-err);
+		g_free(path);
+		return err;
+	}
+
+	g_free(path);
+	g_array_append_val(listing->cache->wds, wd);
+
+	return 0;
+}
+
+/* Renders directory entries until count bytes are buffered or the end of
+ * the directory is reached, so only about one MTU is held in memory */
+static int listing_fill(struct listing_object *listing, size_t count)
+{
+	int flags = 0;
+
+	if (!listing->root || !listing->symlinks)
+		flags = AT_SYMLINK_NOFOLLOW;
+
+	while (listing->dp && string_buffer_len(listing->buffer) < count) {
+		struct stat fstat;
+		struct dirent *ep;
 		char *filename;
-		char *fullname;
 		char *line;
 
+		errno = 0;
+		ep = readdir(listing->dp);
+		if (ep == NULL) {
+			if (errno != 0)
+				return -errno;
+
+			listing_complete(listing);
+			break;
+		}
+
 		if (ep->d_name[0] == '.')
 			continue;
 
 		filename = g_filename_to_utf8(ep->d_name, -1, NULL, NULL, NULL);
-		if (name == NULL) {
+		if (filename == NULL) {
 			error("g_filename_to_utf8: invalid filename");
 			continue;
 		}
 
-		fullname = g_build_filename(name, ep->d_name, NULL);
-
-		if (root && symlinks)
-			ret = stat(fullname, &fstat);
-		else
-			ret = lstat(fullname, &fstat);
+		if (listing->body && listing_watch_subdir(listing, ep,
+								flags) < 0) {
+			/* Can't keep it without noticing changes in there */
+			g_string_free(listing->body, TRUE);
+			listing->body = NULL;
+		}
 
-		if (ret < 0) {
-			DBG("%s: %s(%d)", root ? "stat" : "lstat",
+		if (fstatat(dirfd(listing->dp), ep->d_name, &fstat,
+								flags) < 0) {
+			DBG("%s: %s(%d)", flags ? "lstat" : "stat",
 					strerror(errno), errno);
 			g_free(filename);
-			g_free(fullname);
 			continue;
 		}
 
-		g_free(fullname);
+		line = file_stat_line(filename, &fstat, &listing->dstat,
+						listing->root, FALSE);
+		g_free(filename);
 
-		line = file_stat_line(filename, &fstat, &dstat, root, FALSE);
-		if (line == NULL) {
-			g_free(filename);
+		if (line == NULL)
 			continue;
-		}
-
-		g_free(filename);
 
-		object = g_string_append(object, line);
+		listing_append(listing, line);
 		g_free(line);
 	}
 
-	closedir(dp);
-
-	object = g_string_append(object, FL_BODY_END);
-	if (size)
-		*size = object->len;
-
-	if (err)
-		*err = 0;
-
-	return object;
-
-failed:
-	if (dp)
-		closedir(dp);
-
-	g_string_free(object, TRUE);
-	return NULL;
+	return 0;
 }
 
 static void *folder_open(const char *name, int oflag, mode_t mode,
 					void *context, size_t *size, int *err)
 {
-	GString *object;
-
-	object = g_string_new(FL_VERSION);
-	object = append_folder_preamble(object);
-	object = g_string_append(object, FL_BODY_BEGIN);
-
-	return append_listing(object, name, FALSE, size, err);
+	return listing_open(name, FALSE, err);
 }
 
 static void *pcsuite_open(const char *name, int oflag, mode_t mode,
 					void *context, size_t *size, int *err)
 {
-	GString *object;
+	return listing_open(name, TRUE, err);
+}
 
-	object = g_string_new(FL_VERSION);
-	object = append_pcsuite_preamble(object);
-	object = g_string_append(object, FL_BODY_BEGIN);
+struct string_buffer *string_buffer_new(GString *str)
+{
+	struct string_buffer *buffer;
+
+	buffer = g_new0(struct string_buffer, 1);
+	buffer->str = str ? str : g_string_new("");
 
-	return append_listing(object, name, TRUE, size, err);
+	return buffer;
 }
 
-static int string_free(void *object)
+void string_buffer_free(struct string_buffer *buffer)
 {
-	GString *string = object;
-
-	g_string_free(string, TRUE);
+	g_string_free(buffer->str, TRUE);
+	g_free(buffer);
+}
 
-	return 0;
+gsize string_buffer_len(struct string_buffer *buffer)
+{
+	return buffer->str->len - buffer->offset;
 }
 
 ssize_t string_read(void *object, void *buf, size_t count)
 {
-	GString *string = object;
+	struct string_buffer *buffer = object;
+	GString *string = buffer->str;
 	ssize_t len;
 
-	if (string->len == 0)
+	if (buffer->offset == string->len)
 		return 0;
 
-	len = MIN(string->len, count);
-	memcpy(buf, string->str, len);
-	string = g_string_erase(string, 0, len);
+	len = MIN(string->len - buffer->offset, count);
+	memcpy(buf, string->str + buffer->offset, len);
+	buffer->offset += len;
+
+	/* Producers may keep appending while data is read, so reclaim the
+	 * consumed space only once it dominates: the bytes moved never
+	 * exceed the bytes already read, which keeps reading linear */
+	if (buffer->offset == string->len) {
+		g_string_truncate(string, 0);
+		buffer->offset = 0;
+	} else if (buffer->offset > string->len / 2) {
+		g_string_erase(string, 0, buffer->offset);
+		buffer->offset = 0;
+	}
 
 	return len;
 }
 
 static ssize_t folder_read(void *object, void *buf, size_t count)
 {
-	return string_read(object, buf, count);
+	struct listing_object *listing = object;
+	GString *body;
+	size_t len;
+	int err;
+
+	/* DOCTYPE preamble first, then either the cached or a fresh body */
+	if (listing->cached && string_buffer_len(listing->buffer) == 0) {
+		body = listing->cache->body;
+		len = MIN(body->len - listing->offset, count);
+		memcpy(buf, body->str + listing->offset, len);
+		listing->offset += len;
+
+		return len;
+	}
+
+	err = listing_fill(listing, count);
+	if (err < 0)
+		return err;
+
+	return string_read(listing->buffer, buf, count);
+}
+
+static int folder_close(void *object)
+{
+	listing_free(object);
+
+	return 0;
 }
 
 static ssize_t capability_read(void *object, void *buf, size_t count)
@@ -642,7 +1807,7 @@ static int capability_close(void *object)
 
 done:
 	if (obj->buffer != NULL)
-		g_string_free(obj->buffer, TRUE);
+		string_buffer_free(obj->buffer);
 
 	g_free(obj);
 
@@ -653,10 +1818,14 @@ static struct obex_mime_type_driver file = {
 	.open = filesystem_open,
 	.close = filesystem_close,
 	.read = filesystem_read,
+	.read_direct = filesystem_read_direct,
 	.write = filesystem_write,
+	.flush = filesystem_flush,
+	.abort = filesystem_abort,
 	.remove = remove,
 	.move = filesystem_rename,
 	.copy = filesystem_copy,
+	.cancel = filesystem_cancel,
 };
 
 static struct obex_mime_type_driver capability = {
@@ -673,7 +1842,7 @@ static struct obex_mime_type_driver folder = {
 	.target_size = TARGET_SIZE,
 	.mimetype = "x-obex/folder-listing",
 	.open = folder_open,
-	.close = string_free,
+	.close = folder_close,
 	.read = folder_read,
 };
 
@@ -684,14 +1853,26 @@ static struct obex_mime_type_driver pcsuite = {
 	.who_size = PCSUITE_WHO_SIZE,
 	.mimetype = "x-obex/folder-listing",
 	.open = pcsuite_open,
-	.close = string_free,
+	.close = folder_close,
 	.read = folder_read,
 };
 
 static int filesystem_init(void)
 {
+	GError *gerr = NULL;
 	int err;
 
+	listing_cache_init();
+
+	if (obex_option_async_io()) {
+		file_io_pool = g_thread_pool_new(file_io_worker, NULL,
+						FILE_IO_THREADS, FALSE, &gerr);
+		if (file_io_pool == NULL) {
+			error("%s", gerr->message);
+			g_error_free(gerr);
+		}
+	}
+
 	err = obex_mime_type_driver_register(&folder);
 	if (err < 0)
 		return err;
@@ -709,8 +1890,16 @@ static int filesystem_init(void)
 
 static void filesystem_exit(void)
 {
+	listing_cache_exit();
+
+	if (file_io_pool) {
+		g_thread_pool_free(file_io_pool, FALSE, TRUE);
+		file_io_pool = NULL;
+	}
+
 	obex_mime_type_driver_unregister(&folder);
 	obex_mime_type_driver_unregister(&capability);
+	obex_mime_type_driver_unregister(&pcsuite);
 	obex_mime_type_driver_unregister(&file);
 }
 
@@ -21,5 +21,13 @@
  *
  */
 
+struct string_buffer {
+	GString *str;
+	gsize offset;		/* Read cursor into str */
+};
+
+struct string_buffer *string_buffer_new(GString *str);
+void string_buffer_free(struct string_buffer *buffer);
+gsize string_buffer_len(struct string_buffer *buffer);
 ssize_t string_read(void *object, void *buf, size_t count);
 gboolean is_filename(const char *name);
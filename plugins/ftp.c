@@ -445,6 +445,8 @@ static int ftp_copy(struct ftp_session *ftp, const char *name,
 		return -EINVAL;
 
 	destination = ftp_build_filename(ftp, destname);
+	if (destination == NULL)
+		return -EPERM;
 
 	source = g_build_filename(ftp->folder, name, NULL);
 
@@ -473,6 +475,8 @@ static int ftp_move(struct ftp_session *ftp, const char *name,
 		return -EINVAL;
 
 	destination = ftp_build_filename(ftp, destname);
+	if (destination == NULL)
+		return -EPERM;
 
 	source = g_build_filename(ftp->folder, name, NULL);
 
@@ -490,8 +494,6 @@ int ftp_action(struct obex_session *os, obex_object_t *obj, void *user_data)
 	const char *name, *destname;
 	uint8_t action_id;
 
-	return -EINVAL;
-
 	name = obex_get_name(os);
 	destname = obex_get_destname(os);
 	action_id = obex_get_action_id(os);
@@ -105,7 +105,7 @@ struct irmc_session {
 	struct obex_session *os;
 	struct apparam_field *params;
 	uint16_t entries;
-	GString *buffer;
+	struct string_buffer *buffer;
 	char sn[DID_LEN];
 	char did[DID_LEN];
 	char manu[DID_LEN];
@@ -163,15 +163,15 @@ static void query_result(const char *buffer, size_t bufsize, int vcards,
 
 	/* first add a 'owner' vcard */
 	if (!irmc->buffer)
-		irmc->buffer = g_string_new(owner_vcard);
-	else
-		irmc->buffer = g_string_append(irmc->buffer, owner_vcard);
+		irmc->buffer = string_buffer_new(NULL);
+
+	g_string_append(irmc->buffer->str, owner_vcard);
 
 	/* loop around buffer and add X-IRMC-LUID attribs */
 	s = buffer;
 	while ((t = strstr(s, "UID:")) != NULL) {
 		/* add upto UID: into buffer */
-		irmc->buffer = g_string_append_len(irmc->buffer, s, t-s);
+		g_string_append_len(irmc->buffer->str, s, t-s);
 		/*
 		 * add UID: line into buffer
 		 * Not sure if UID is still needed if X-IRMC-LUID is there
@@ -179,16 +179,15 @@ static void query_result(const char *buffer, size_t bufsize, int vcards,
 		s = t;
 		t = strstr(s, "\r\n");
 		t += 2;
-		irmc->buffer = g_string_append_len(irmc->buffer, s, t-s);
+		g_string_append_len(irmc->buffer->str, s, t-s);
 		/* add X-IRMC-LUID with same number as UID */
-		irmc->buffer = g_string_append_len(irmc->buffer,
-							"X-IRMC-LUID:", 12);
+		g_string_append_len(irmc->buffer->str, "X-IRMC-LUID:", 12);
 		s += 4; /* point to uid number */
-		irmc->buffer = g_string_append_len(irmc->buffer, s, t-s);
+		g_string_append_len(irmc->buffer->str, s, t-s);
 		s = t;
 	}
 	/* add remaining bit of buffer */
-	irmc->buffer = g_string_append(irmc->buffer, s);
+	g_string_append(irmc->buffer->str, s);
 
 	obex_object_set_io_flags(irmc, G_IO_IN, 0);
 }
@@ -267,7 +266,7 @@ static void irmc_disconnect(struct obex_session *os, void *user_data)
 	}
 
 	if (irmc->buffer)
-		g_string_free(irmc->buffer, TRUE);
+		string_buffer_free(irmc->buffer);
 
 	g_free(irmc);
 }
@@ -282,9 +281,9 @@ static int irmc_chkput(struct obex_session *os, void *user_data)
 static void *irmc_open_devinfo(struct irmc_session *irmc, int *err)
 {
 	if (!irmc->buffer)
-		irmc->buffer = g_string_new("");
+		irmc->buffer = string_buffer_new(NULL);
 
-	g_string_append_printf(irmc->buffer,
+	g_string_append_printf(irmc->buffer->str,
 				"MANU:%s\r\n"
 				"MOD:%s\r\n"
 				"SN:%s\r\n"
@@ -369,9 +368,9 @@ static void *irmc_open_pb(const char *name, struct irmc_session *irmc,
 	}
 
 	if (!irmc->buffer)
-		irmc->buffer = mybuf;
+		irmc->buffer = string_buffer_new(mybuf);
 	else {
-		irmc->buffer = g_string_append(irmc->buffer, mybuf->str);
+		g_string_append(irmc->buffer->str, mybuf->str);
 		g_string_free(mybuf, TRUE);
 	}
 
@@ -391,7 +390,7 @@ static void *irmc_open_cal(const char *name, struct irmc_session *irmc,
 	DBG("unsupported, returning empty buffer");
 
 	if (!irmc->buffer)
-		irmc->buffer = g_string_new("");
+		irmc->buffer = string_buffer_new(NULL);
 
 	return irmc;
 }
@@ -403,7 +402,7 @@ static void *irmc_open_nt(const char *name, struct irmc_session *irmc,
 	DBG("unsupported, returning empty buffer");
 
 	if (!irmc->buffer)
-		irmc->buffer = g_string_new("");
+		irmc->buffer = string_buffer_new(NULL);
 
 	return irmc;
 }
@@ -450,7 +449,7 @@ static int irmc_close(void *object)
 	DBG("");
 
 	if (irmc->buffer) {
-		g_string_free(irmc->buffer, TRUE);
+		string_buffer_free(irmc->buffer);
 		irmc->buffer = NULL;
 	}
 
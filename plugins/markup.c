@@ -0,0 +1,148 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdint.h>
+#include <glib.h>
+
+#include "markup.h"
+
+/* Bytes g_markup_escape_text() doesn't copy verbatim: markup characters,
+ * C0 controls other than tab and newlines, DEL, and 0xc2 which starts
+ * the C1 controls */
+static const uint8_t markup_escape[256] = {
+	[0x01] = 1, [0x02] = 1, [0x03] = 1, [0x04] = 1,
+	[0x05] = 1, [0x06] = 1, [0x07] = 1, [0x08] = 1,
+	[0x0b] = 1, [0x0c] = 1, [0x0e] = 1, [0x0f] = 1,
+	[0x10] = 1, [0x11] = 1, [0x12] = 1, [0x13] = 1,
+	[0x14] = 1, [0x15] = 1, [0x16] = 1, [0x17] = 1,
+	[0x18] = 1, [0x19] = 1, [0x1a] = 1, [0x1b] = 1,
+	[0x1c] = 1, [0x1d] = 1, [0x1e] = 1, [0x1f] = 1,
+	['&'] = 1, ['<'] = 1, ['>'] = 1, ['\''] = 1, ['"'] = 1,
+	[0x7f] = 1, [0xc2] = 1,
+};
+
+static void append_char_ref(GString *buf, unsigned int c)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	g_string_append(buf, "&#x");
+
+	if (c > 0xf)
+		g_string_append_c(buf, hex[c >> 4]);
+
+	g_string_append_c(buf, hex[c & 0xf]);
+	g_string_append_c(buf, ';');
+}
+
+/* Byte for byte the output of g_markup_escape_text() in current GLib,
+ * without the temporary copy. Like GLib, 0xc2 without a continuation
+ * byte after it, including at the end, is copied as it is. */
+void markup_append_escaped(GString *buf, const char *s, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) s;
+	const unsigned char *end = p + len;
+	const unsigned char *run = p;
+
+	while (p < end) {
+		unsigned int c;
+
+		if (!markup_escape[*p]) {
+			p++;
+			continue;
+		}
+
+		c = *p;
+
+		/* Only U+0080 to U+009F, except U+0085, are escaped */
+		if (c == 0xc2) {
+			if (p + 1 == end || p[1] < 0x80 || p[1] > 0x9f ||
+								p[1] == 0x85) {
+				p++;
+				continue;
+			}
+
+			c = p[1];
+		}
+
+		g_string_append_len(buf, (const char *) run, p - run);
+
+		switch (c) {
+		case '&':
+			g_string_append(buf, "&amp;");
+			break;
+		case '<':
+			g_string_append(buf, "&lt;");
+			break;
+		case '>':
+			g_string_append(buf, "&gt;");
+			break;
+		case '\'':
+			g_string_append(buf, "&apos;");
+			break;
+		case '"':
+			g_string_append(buf, "&quot;");
+			break;
+		default:
+			append_char_ref(buf, c);
+			break;
+		}
+
+		p += c >= 0x80 ? 2 : 1;
+		run = p;
+	}
+
+	g_string_append_len(buf, (const char *) run, p - run);
+}
+
+/* Appends name, the escaped value and the closing quote. A NULL value
+ * comes out as "(null)", as it did through g_markup_printf_escaped(). */
+void markup_append_attribute(GString *buf, const char *name,
+							const char *value)
+{
+	if (value == NULL)
+		value = "(null)";
+
+	g_string_append(buf, name);
+	markup_append_escaped(buf, value, strlen(value));
+	g_string_append_c(buf, '"');
+}
+
+/* Length of the longest valid UTF-8 prefix of s not above len bytes */
+size_t markup_utf8_prefix(const char *s, size_t len)
+{
+	const char *end;
+	size_t l;
+
+	l = strlen(s);
+	if (l > len)
+		l = len;
+
+	g_utf8_validate(s, l, &end);
+
+	return end - s;
+}
@@ -37,14 +37,22 @@
 #include "service.h"
 #include "mimetype.h"
 #include "filesystem.h"
+#include "markup.h"
 #include "dbus.h"
 
 #include "messages.h"
 #include "bmsg_parser.h"
 
+#ifdef MNS_INPROCESS
+#include "mns.h"
+#endif
+
 /* Channel number according to bluez doc/assigned-numbers.txt */
 #define MAS_CHANNEL	16
 
+#define MNS_EVENT_DELAY		100	/* ms for a burst to settle */
+#define MNS_EVENT_BATCH		32	/* Events sent in one go */
+
 #define MAS_RECORD "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>		\
 <record>								\
   <attribute id=\"0x0001\">						\
@@ -221,7 +229,7 @@ struct mas_session {
 	void *backend_data;
 	gboolean ap_sent;
 	gboolean finished;
-	GString *buffer;
+	struct string_buffer *buffer;
 	GHashTable *inparams;
 	GHashTable *outparams;
 	DBusConnection *dbus;
@@ -235,6 +243,13 @@ struct mas_session {
 	void *request;
 	GDestroyNotify request_free;
 	GQueue *events_queue;
+	guint events_timer;
+	GTimeVal events_sent;	/* When the batch in flight went out */
+#ifdef MNS_INPROCESS
+	struct mns *mns;	/* Direct MNS session, NULL over D-Bus */
+	gboolean mns_pending;
+	gboolean mns_direct_failed;	/* Only use obex-client from now on */
+#endif
 };
 
 struct any_object {
@@ -259,6 +274,7 @@ struct folder_listing_request {
 
 struct get_message_request {
 	unsigned long flags;
+	gboolean pull;		/* Backend waits for the chunk to be sent */
 };
 
 struct message_put_request {
@@ -269,6 +285,10 @@ struct message_put_request {
 	unsigned long flags;
 	gboolean parsed;
 	size_t remaining;
+	gboolean tail_checked;
+	size_t extra;		/* Body bytes that ended up in buf */
+	size_t extra_sent;
+	gboolean body_ended;
 };
 
 static const uint8_t MAS_TARGET[TARGET_SIZE] = {
@@ -649,6 +669,11 @@ static void clear_events_queue(struct mas_session *mas)
 {
 	GList *cur;
 
+	if (mas->events_timer) {
+		g_source_remove(mas->events_timer);
+		mas->events_timer = 0;
+	}
+
 	for (cur = mas->events_queue->head; cur != NULL; cur = cur->next)
 		messages_event_unref(cur->data);
 
@@ -657,31 +682,136 @@ static void clear_events_queue(struct mas_session *mas)
 
 static void messages_event_pcn(DBusPendingCall *pc, void *user_data);
 
+static int mns_stop_session(struct mas_session *mas);
+static int mns_start_session(struct mas_session *mas);
+
+/* A connection or a batch of events is on its way to the MNS client */
+static gboolean mns_busy(struct mas_session *mas)
+{
+#ifdef MNS_INPROCESS
+	if (mas->mns_pending)
+		return TRUE;
+#endif
+
+	return mas->pending_session != NULL || mas->pending_event != NULL;
+}
+
+static gboolean mns_connected(struct mas_session *mas)
+{
+#ifdef MNS_INPROCESS
+	if (mas->mns)
+		return TRUE;
+#endif
+
+	return mas->mns_path != NULL;
+}
+
+/* Time taken by a batch to reach the MNS client, test/mns-latency
+ * collects these from the debug log */
+static void events_delivered(struct mas_session *mas, const char *route)
+{
+	GTimeVal now;
+	long usec;
+
+	g_get_current_time(&now);
+
+	usec = (now.tv_sec - mas->events_sent.tv_sec) * G_USEC_PER_SEC +
+				now.tv_usec - mas->events_sent.tv_usec;
+
+	DBG("MNS events delivered via %s in %ld us", route, usec);
+}
+
+#ifdef MNS_INPROCESS
+static void mns_direct_event_cb(struct mns *mns, GError *err,
+							void *user_data);
+
+static void send_next_event_direct(struct mas_session *mas)
+{
+	struct messages_event *event;
+	int i;
+
+	for (i = 0; i < MNS_EVENT_BATCH; i++) {
+		event = g_queue_pop_head(mas->events_queue);
+		if (event == NULL)
+			break;
+
+		mns_queue_report(mas->mns, event->type + 1, event->handle,
+					event->folder, event->old_folder, 2);
+
+		messages_event_unref(event);
+	}
+
+	if (mns_send_reports(mas->mns, 0, mns_direct_event_cb, mas) < 0) {
+		DBG("Error when sending notification!");
+		mns_stop_session(mas);
+		return;
+	}
+
+	mas->mns_pending = TRUE;
+}
+#endif
+
+/* Sends the queued events in one SendEvents call, the MNS client still
+ * needs one PUT for each as a report carries a single event */
 static void send_next_event(struct mas_session *mas)
 {
 	struct messages_event *event;
 	DBusMessage *outgoing;
+	DBusMessageIter iter, array, entry;
 	unsigned char evt;
 	unsigned char msgtype = 2;
 	unsigned char instance_id = 0;
+	int i;
+
+	if (mas->events_timer) {
+		g_source_remove(mas->events_timer);
+		mas->events_timer = 0;
+	}
 
-	event = g_queue_pop_head(mas->events_queue);
-	if (event == NULL)
+	if (g_queue_is_empty(mas->events_queue))
 		return;
 
-	evt = (unsigned char)event->type + 1;
+	g_get_current_time(&mas->events_sent);
+
+#ifdef MNS_INPROCESS
+	if (mas->mns) {
+		send_next_event_direct(mas);
+		return;
+	}
+#endif
 
 	outgoing = dbus_message_new_method_call("org.openobex.client",
-			mas->mns_path, "org.openobex.MNS", "SendEvent");
+			mas->mns_path, "org.openobex.MNS", "SendEvents");
 
-	dbus_message_append_args(outgoing,
-			DBUS_TYPE_BYTE, &instance_id,
-			DBUS_TYPE_BYTE, &evt,
-			DBUS_TYPE_STRING, &event->handle,
-			DBUS_TYPE_STRING, &event->folder,
-			DBUS_TYPE_STRING, &event->old_folder,
-			DBUS_TYPE_BYTE, &msgtype,
-			DBUS_TYPE_INVALID);
+	dbus_message_iter_init_append(outgoing, &iter);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_BYTE, &instance_id);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(ysssy)",
+								&array);
+
+	for (i = 0; i < MNS_EVENT_BATCH; i++) {
+		event = g_queue_pop_head(mas->events_queue);
+		if (event == NULL)
+			break;
+
+		evt = (unsigned char)event->type + 1;
+
+		dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT,
+								NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_BYTE, &evt);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+							&event->handle);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+							&event->folder);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+							&event->old_folder);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_BYTE,
+								&msgtype);
+		dbus_message_iter_close_container(&array, &entry);
+
+		messages_event_unref(event);
+	}
+
+	dbus_message_iter_close_container(&iter, &array);
 
 	dbus_connection_send_with_reply(mas->dbus, outgoing,
 			&mas->pending_event, -1);
@@ -690,11 +820,57 @@ static void send_next_event(struct mas_session *mas)
 
 	dbus_pending_call_set_notify(mas->pending_event,
 			messages_event_pcn, mas, NULL);
+}
 
-	messages_event_unref(event);
+static gboolean send_events_timeout(gpointer user_data)
+{
+	struct mas_session *mas = user_data;
+
+	mas->events_timer = 0;
+
+	if (mns_busy(mas))
+		return FALSE;
+
+	send_next_event(mas);
+
+	return FALSE;
 }
 
-static int mns_stop_session(struct mas_session *mas);
+/* Folds a new event into the ones not sent yet. Returns FALSE if it only
+ * repeats one of them or cancels one out. */
+static gboolean coalesce_event(struct mas_session *mas,
+					struct messages_event *event)
+{
+	GList *l;
+
+	if (event->type != MET_NEW_MESSAGE &&
+					event->type != MET_MESSAGE_DELETED)
+		return TRUE;
+
+	/* The latest event about the message decides */
+	for (l = mas->events_queue->tail; l != NULL; l = l->prev) {
+		struct messages_event *queued = l->data;
+
+		if (g_strcmp0(queued->handle, event->handle) != 0)
+			continue;
+
+		if (queued->type == event->type &&
+				g_strcmp0(queued->folder, event->folder) == 0)
+			return FALSE;
+
+		/* Never announced, the client doesn't need to hear of it */
+		if (queued->type == MET_NEW_MESSAGE &&
+					event->type == MET_MESSAGE_DELETED) {
+			messages_event_unref(queued);
+			g_queue_delete_link(mas->events_queue, l);
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+	return TRUE;
+}
 
 static void mns_start_session_pcn(DBusPendingCall *pc, void *user_data)
 {
@@ -738,6 +914,54 @@ cleanup:
 		send_next_event(mas);
 }
 
+#ifdef MNS_INPROCESS
+static void mns_direct_connect_cb(struct mns *mns, GError *err,
+							void *user_data)
+{
+	struct mas_session *mas = user_data;
+
+	mas->mns_pending = FALSE;
+
+	if (err != NULL) {
+		DBG("Error when starting session: %s", err->message);
+
+		if (mas->mns_enabled) {
+			/* obex-client may still get through */
+			mns_disconnect(mas->mns);
+			mas->mns = NULL;
+			mas->mns_direct_failed = TRUE;
+
+			mns_start_session(mas);
+			return;
+		}
+	}
+
+	if (mas->mns_enabled == FALSE)
+		mns_stop_session(mas);
+	else
+		send_next_event(mas);
+}
+
+static void mns_direct_event_cb(struct mns *mns, GError *err,
+							void *user_data)
+{
+	struct mas_session *mas = user_data;
+
+	mas->mns_pending = FALSE;
+
+	if (err != NULL) {
+		DBG("Error when sending notification: %s", err->message);
+		mas->mns_enabled = FALSE;
+	} else
+		events_delivered(mas, "direct");
+
+	if (!mas->mns_enabled)
+		mns_stop_session(mas);
+	else
+		send_next_event(mas);
+}
+#endif
+
 /* XXX: How to act when connection is unexpectedly closed.
  */
 static int mns_start_session(struct mas_session *mas)
@@ -749,12 +973,24 @@ static int mns_start_session(struct mas_session *mas)
 	DBG("");
 	mas->mns_enabled = TRUE;
 
-	if (mas->mns_path)
+	if (mns_connected(mas))
 		return 0;
 
 	if (mas->pending_session)
 		return 0;
 
+#ifdef MNS_INPROCESS
+	/* obex-client over D-Bus is the fallback */
+	if (!mas->mns_direct_failed)
+		mas->mns = mns_connect(NULL, mas->remote_addr,
+						mns_direct_connect_cb, mas);
+
+	if (mas->mns) {
+		mas->mns_pending = TRUE;
+		return 0;
+	}
+#endif
+
 	if (!mas->dbus)
 		mas->dbus = obex_dbus_get_connection();
 
@@ -822,6 +1058,19 @@ static int mns_stop_session(struct mas_session *mas)
 	clear_events_queue(mas);
 	mas->mns_enabled = FALSE;
 
+#ifdef MNS_INPROCESS
+	if (mas->mns) {
+		mns_disconnect(mas->mns);
+		mas->mns = NULL;
+		mas->mns_pending = FALSE;
+
+		if (mas->disconnected)
+			mas_clean(mas);
+
+		return 0;
+	}
+#endif
+
 	if (mas->pending_session)
 		return 0;
 
@@ -865,7 +1114,8 @@ static void messages_event_pcn(DBusPendingCall *pc, void *user_data)
 			!= DBUS_MESSAGE_TYPE_METHOD_RETURN) {
 		DBG("Error when sending notification!");
 		mas->mns_enabled = FALSE;
-	}
+	} else
+		events_delivered(mas, "D-Bus");
 
 	dbus_message_unref(incoming);
 	dbus_pending_call_unref(pc);
@@ -886,21 +1136,28 @@ static void my_messages_event_cb(void *session, struct messages_event *data, voi
 
 	DBG("");
 
-	if (!mas->mns_path) {
+	if (!mns_connected(mas)) {
 		DBG("Backend tried to pushed event, but MNS is not connected!");
 		return;
 	}
 
+	if (!coalesce_event(mas, data)) {
+		DBG("Event coalesced");
+		return;
+	}
+
 	messages_event_ref(data);
 	g_queue_push_tail(mas->events_queue, data);
 
-	if (mas->pending_session || mas->pending_event) {
+	if (mns_busy(mas)) {
 		DBG("MNS session connection or event sending in progress.");
 		return;
 	}
 
-	send_next_event(mas);
-
+	/* Gather the rest of a burst before sending */
+	if (mas->events_timer == 0)
+		mas->events_timer = g_timeout_add(MNS_EVENT_DELAY,
+						send_events_timeout, mas);
 }
 
 static int set_notification_registration(struct mas_session *mas, int state)
@@ -948,7 +1205,7 @@ static void mas_reset(struct obex_session *os, void *user_data)
 	DBG("");
 
 	if (mas->buffer) {
-		g_string_free(mas->buffer, TRUE);
+		string_buffer_free(mas->buffer);
 		mas->buffer = NULL;
 	}
 
@@ -1020,7 +1277,7 @@ static void mas_disconnect(struct obex_session *os, void *user_data)
 	mas->disconnected = TRUE;
 	clear_events_queue(mas);
 
-	if (mas->mns_enabled || mas->pending_event || mas->pending_session)
+	if (mas->mns_enabled || mns_busy(mas))
 		set_notification_registration(mas, 0);
 	else
 		mas_clean(mas);
@@ -1036,7 +1293,7 @@ static int mas_get(struct obex_session *os, obex_object_t *obj, void *user_data)
 	DBG("GET: name %s type %s mas %p",
 			name, type, mas);
 
-	mas->buffer = g_string_new("");
+	mas->buffer = string_buffer_new(NULL);
 
 	if (type == NULL)
 		return -EBADR;
@@ -1061,7 +1318,7 @@ static int mas_put(struct obex_session *os, obex_object_t *obj, void *user_data)
 
 	DBG("PUT: name %s type %s mas %p", name, type, mas);
 
-	mas->buffer = g_string_new("");
+	mas->buffer = string_buffer_new(NULL);
 
 	if (type == NULL)
 		return -EBADR;
@@ -1101,21 +1358,6 @@ static const char *yesorno(gboolean a)
 	return "no";
 }
 
-static char *trim_utf8(char *s, size_t len)
-{
-	char *end;
-	size_t l;
-
-	l = strlen(s);
-	if (l > len)
-		l = len;
-
-	g_utf8_validate(s, len, (const gchar **)&end);
-	*end = '\0';
-
-	return s;
-}
-
 static void get_messages_listing_cb(void *session, int err,
 		uint16_t size, gboolean newmsg,
 		const struct messages_message *entry,
@@ -1123,6 +1365,7 @@ static void get_messages_listing_cb(void *session, int err,
 {
 	struct mas_session *mas = user_data;
 	struct msg_listing_request *request = mas->request;
+	GString *buf = mas->buffer->str;
 	uint8_t newmsg_byte;
 	char timebuf[21];
 	char *timestr = timebuf;
@@ -1135,13 +1378,13 @@ static void get_messages_listing_cb(void *session, int err,
 
 	if (!request->nth_call) {
 		if (!request->only_count)
-			g_string_append(mas->buffer, ML_BODY_BEGIN);
+			g_string_append(buf, ML_BODY_BEGIN);
 		request->nth_call = TRUE;
 	}
 
 	if (!entry) {
 		if (!request->only_count)
-			g_string_append(mas->buffer, ML_BODY_END);
+			g_string_append(buf, ML_BODY_END);
 		mas->finished = TRUE;
 
 		newmsg_byte = newmsg ? 1 : 0;
@@ -1155,107 +1398,94 @@ static void get_messages_listing_cb(void *session, int err,
 		goto proceed;
 	}
 
-	g_string_append(mas->buffer, "<msg");
+	g_string_append(buf, "<msg");
 
-	g_string_append_escaped_printf(mas->buffer, " handle=\"%s\"",
-								entry->handle);
+	markup_append_attribute(buf, " handle=\"", entry->handle);
 
 	if (request->filter.parameter_mask & PMASK_SUBJECT &&
 			entry->mask & PMASK_SUBJECT) {
-		char *subject;
+		const char *subject = entry->subject ? entry->subject : "";
 
-		subject	= g_strdup(entry->subject);
-		trim_utf8(subject, request->subject_len);
-
-		g_string_append_escaped_printf(mas->buffer, " subject=\"%s\"",
-				subject);
-
-		g_free(subject);
+		g_string_append(buf, " subject=\"");
+		markup_append_escaped(buf, subject,
+			markup_utf8_prefix(subject, request->subject_len));
+		g_string_append_c(buf, '"');
 	}
 
 	if (request->filter.parameter_mask & PMASK_DATETIME &&
 			entry->mask & PMASK_DATETIME)
-		g_string_append_escaped_printf(mas->buffer, " datetime=\"%s\"",
-				entry->datetime);
+		markup_append_attribute(buf, " datetime=\"",
+						entry->datetime);
 
 	if (request->filter.parameter_mask & PMASK_SENDER_NAME &&
 			entry->mask & PMASK_SENDER_NAME)
-		g_string_append_escaped_printf(mas->buffer,
-						" sender_name=\"%s\"",
+		markup_append_attribute(buf, " sender_name=\"",
 						entry->sender_name);
 
 	if (request->filter.parameter_mask & PMASK_SENDER_ADDRESSING &&
 			entry->mask & PMASK_SENDER_ADDRESSING)
-		g_string_append_escaped_printf(mas->buffer,
-						" sender_addressing=\"%s\"",
+		markup_append_attribute(buf, " sender_addressing=\"",
 						entry->sender_addressing);
 
 	if (request->filter.parameter_mask & PMASK_REPLYTO_ADDRESSING &&
 			entry->mask & PMASK_REPLYTO_ADDRESSING)
-		g_string_append_escaped_printf(mas->buffer,
-						" replyto_addressing=\"%s\"",
+		markup_append_attribute(buf, " replyto_addressing=\"",
 						entry->replyto_addressing);
 
 	if (request->filter.parameter_mask & PMASK_RECIPIENT_NAME &&
 			entry->mask & PMASK_RECIPIENT_NAME)
-		g_string_append_escaped_printf(mas->buffer,
-						" recipient_name=\"%s\"",
+		markup_append_attribute(buf, " recipient_name=\"",
 						entry->recipient_name);
 
 	if (request->filter.parameter_mask & PMASK_RECIPIENT_ADDRESSING &&
 			entry->mask & PMASK_RECIPIENT_ADDRESSING)
-		g_string_append_escaped_printf(mas->buffer,
-						" recipient_addressing=\"%s\"",
+		markup_append_attribute(buf, " recipient_addressing=\"",
 						entry->recipient_addressing);
 
 	if (request->filter.parameter_mask & PMASK_TYPE &&
 			entry->mask & PMASK_TYPE)
-		g_string_append_escaped_printf(mas->buffer, " type=\"%s\"",
-				entry->type);
+		markup_append_attribute(buf, " type=\"", entry->type);
 
 	if (request->filter.parameter_mask & PMASK_RECEPTION_STATUS &&
 			entry->mask & PMASK_RECEPTION_STATUS)
-		g_string_append_escaped_printf(mas->buffer,
-						" reception_status=\"%s\"",
+		markup_append_attribute(buf, " reception_status=\"",
 						entry->reception_status);
 
 	if (request->filter.parameter_mask & PMASK_SIZE &&
 			entry->mask & PMASK_SIZE)
-		g_string_append_escaped_printf(mas->buffer, " size=\"%s\"",
-				entry->size);
+		markup_append_attribute(buf, " size=\"", entry->size);
 
 	if (request->filter.parameter_mask & PMASK_ATTACHMENT_SIZE &&
 			entry->mask & PMASK_ATTACHMENT_SIZE)
-		g_string_append_escaped_printf(mas->buffer,
-						" attachment_size=\"%s\"",
+		markup_append_attribute(buf, " attachment_size=\"",
 						entry->attachment_size);
 
 	if (request->filter.parameter_mask & PMASK_TEXT &&
 			entry->mask & PMASK_TEXT)
-		g_string_append_escaped_printf(mas->buffer, " text=\"%s\"",
-				yesorno(entry->text));
+		markup_append_attribute(buf, " text=\"",
+						yesorno(entry->text));
 
 	if (request->filter.parameter_mask & PMASK_READ &&
 			entry->mask & PMASK_READ)
-		g_string_append_escaped_printf(mas->buffer, " read=\"%s\"",
-				yesorno(entry->read));
+		markup_append_attribute(buf, " read=\"",
+						yesorno(entry->read));
 
 	if (request->filter.parameter_mask & PMASK_SENT &&
 			entry->mask & PMASK_SENT)
-		g_string_append_escaped_printf(mas->buffer, " sent=\"%s\"",
-				yesorno(entry->sent));
+		markup_append_attribute(buf, " sent=\"",
+						yesorno(entry->sent));
 
 	if (request->filter.parameter_mask & PMASK_PROTECTED &&
 			entry->mask & PMASK_PROTECTED)
-		g_string_append_escaped_printf(mas->buffer, " protected=\"%s\"",
-				yesorno(entry->protect));
+		markup_append_attribute(buf, " protected=\"",
+						yesorno(entry->protect));
 
 	if (request->filter.parameter_mask & PMASK_PRIORITY &&
 			entry->mask & PMASK_PRIORITY)
-		g_string_append_escaped_printf(mas->buffer, " priority=\"%s\"",
-				yesorno(entry->priority));
+		markup_append_attribute(buf, " priority=\"",
+						yesorno(entry->priority));
 
-	g_string_append(mas->buffer, "/>\n");
+	g_string_append(buf, "/>\n");
 
 proceed:
 	if (err != -EAGAIN)
@@ -1276,19 +1506,25 @@ static void get_message_cb(void *session, int err, gboolean fmore,
 		return;
 	}
 
+	/* Goes out with the first chunk */
+	if (request->flags & MESSAGES_FRACTION && !mas->ap_sent) {
+		fmore_byte = fmore ? 1 : 0;
+		aparams_write(mas->outparams, FRACTIONDELIVER_TAG,
+								&fmore_byte);
+	}
+
 	if (!chunk) {
 		mas->finished = TRUE;
-
-		if (request->flags & MESSAGES_FRACTION) {
-			fmore_byte = fmore ? 1 : 0;
-			aparams_write(mas->outparams, FRACTIONDELIVER_TAG,
-									&fmore);
-		}
-
 		goto proceed;
 	}
 
-	g_string_append(mas->buffer, chunk);
+	g_string_append(mas->buffer->str, chunk);
+
+	if (err == -EAGAIN) {
+		request->pull = TRUE;
+		obex_object_set_io_flags(mas, G_IO_IN, 0);
+		return;
+	}
 
 proceed:
 	if (err != -EAGAIN)
@@ -1300,6 +1536,7 @@ static void get_folder_listing_cb(void *session, int err, uint16_t size,
 {
 	struct mas_session *mas = user_data;
 	struct folder_listing_request *request = mas->request;
+	GString *buf = mas->buffer->str;
 
 	if (err < 0 && err != -EAGAIN) {
 		obex_object_set_io_flags(mas, G_IO_ERR, err);
@@ -1316,27 +1553,27 @@ static void get_folder_listing_cb(void *session, int err, uint16_t size,
 	}
 
 	if (!request->nth_call) {
-		g_string_append(mas->buffer, XML_DECL);
-		g_string_append(mas->buffer, FL_DTD);
+		g_string_append(buf, XML_DECL);
+		g_string_append(buf, FL_DTD);
 		if (!name) {
-			g_string_append(mas->buffer, FL_BODY_EMPTY);
+			g_string_append(buf, FL_BODY_EMPTY);
 			mas->finished = TRUE;
 			goto proceed;
 		}
-		g_string_append(mas->buffer, FL_BODY_BEGIN);
+		g_string_append(buf, FL_BODY_BEGIN);
 		request->nth_call = TRUE;
 	}
 
 	if (!name) {
-		g_string_append(mas->buffer, FL_BODY_END);
+		g_string_append(buf, FL_BODY_END);
 		mas->finished = TRUE;
 		goto proceed;
 	}
 
 	if (g_strcmp0(name, "..") == 0)
-		g_string_append(mas->buffer, FL_PARENT_FOLDER_ELEMENT);
+		g_string_append(buf, FL_PARENT_FOLDER_ELEMENT);
 	else
-		g_string_append_escaped_printf(mas->buffer, FL_FOLDER_ELEMENT,
+		g_string_append_escaped_printf(buf, FL_FOLDER_ELEMENT,
 									name);
 
 proceed:
@@ -1485,6 +1722,29 @@ static void push_message_cb(void *session, int err, const char *handle,
 	}
 }
 
+static int message_flush(void *obj);
+
+/* The backend drained what it had, let the stored OBEX data through */
+static void push_body_ready_cb(void *session, void *user_data)
+{
+	struct mas_session *mas = user_data;
+	struct message_put_request *request = mas->request;
+	int ret;
+
+	DBG("");
+
+	/* Stalled while flushing, nothing else is going to pick it up */
+	if (request->tail_checked) {
+		ret = message_flush(mas);
+		if (ret < 0 && ret != -EAGAIN)
+			obex_object_set_io_flags(mas, G_IO_ERR, ret);
+
+		return;
+	}
+
+	obex_object_set_io_flags(mas, G_IO_OUT, 0);
+}
+
 static void message_put_free(gpointer data)
 {
 	struct message_put_request *request = data;
@@ -1600,25 +1860,22 @@ static ssize_t message_write_header(struct mas_session *mas, const void *buf,
 								size_t count)
 {
 	struct message_put_request *request = mas->request;
-	char *pos;
+	const char *pos = buf;
 	int ret;
 	ssize_t size;
 
 	DBG("");
 
-	g_string_append_len(request->buf, buf, count);
-	pos = request->buf->str;
-
+	/* The parser keeps a line split between packets by itself */
 	ret = bmsg_parser_process(request->parser, &pos, count);
 	if (ret < 0)
 		return ret;
 
-	size = pos - request->buf->str;
-	g_string_erase(request->buf, 0, size);
-
 	if (ret > 0)
 		return count;
 
+	size = pos - (const char *) buf;
+
 	DBG("Parsing done");
 
 	request->bmsg = bmsg_parser_get_bmsg(request->parser);
@@ -1629,10 +1886,9 @@ static ssize_t message_write_header(struct mas_session *mas, const void *buf,
 	request->parsed = TRUE;
 	request->remaining = request->bmsg->length;
 
-	g_string_set_size(request->buf, 0);
-
 	ret = messages_push_message(mas->backend_data, request->bmsg,
-			request->name, MESSAGES_UTF8, push_message_cb, mas);
+			request->name, MESSAGES_UTF8, push_message_cb,
+			push_body_ready_cb, mas);
 	if (ret < 0)
 		return ret;
 
@@ -1667,6 +1923,10 @@ static int message_flush(void *obj)
 		return -EIO;
 	}
 
+	/* Called again when the backend asked us to wait */
+	if (request->tail_checked)
+		goto push;
+
 	len = bmsg_parser_tail_length(request->bmsg);
 
 	if (request->buf->len < len) {
@@ -1686,18 +1946,29 @@ static int message_flush(void *obj)
 		}
 	}
 
-	if (request->buf->len > len) {
+	request->tail_checked = TRUE;
+	request->extra = request->buf->len - len;
+
+push:
+	while (request->extra_sent < request->extra) {
 		ret = messages_push_message_body(mas->backend_data,
-						request->buf->str,
-						request->buf->len - len);
+				request->buf->str + request->extra_sent,
+				request->extra - request->extra_sent);
 		if (ret < 0)
 			return ret;
+
+		request->extra_sent += ret;
 	}
 
+	if (request->body_ended)
+		return -EAGAIN;
+
 	ret = messages_push_message_body(mas->backend_data, NULL, 0);
 	if (ret < 0)
 		return ret;
 
+	request->body_ended = TRUE;
+
 	return -EAGAIN;
 }
 
@@ -1854,7 +2125,7 @@ static ssize_t any_get_next_header(void *object, void *buf, size_t mtu,
 
 	DBG("");
 
-	if (mas->buffer->len == 0 && !mas->finished)
+	if (string_buffer_len(mas->buffer) == 0 && !mas->finished)
 		return -EAGAIN;
 
 	if (mas->ap_sent)
@@ -1868,11 +2139,13 @@ static ssize_t any_get_next_header(void *object, void *buf, size_t mtu,
 		return 0;
 	}
 
-	ret = string_read(buffer, buf, mtu);
-	if (buffer->len > 0) {
+	if (buffer->len > mtu) {
 		DBG("Application parameters header won't fit in MTU, "
 							"aborting request!");
 		ret = -EIO;
+	} else {
+		memcpy(buf, buffer->str, buffer->len);
+		ret = buffer->len;
 	}
 
 	g_string_free(buffer, TRUE);
@@ -1896,6 +2169,32 @@ static ssize_t any_read(void *obj, void *buf, size_t count)
 	return len;
 }
 
+static ssize_t message_read(void *obj, void *buf, size_t count)
+{
+	struct mas_session *mas = obj;
+	struct get_message_request *request = mas->request;
+	ssize_t len;
+	int err;
+
+	DBG("");
+
+	len = string_read(mas->buffer, buf, count);
+
+	/* Only ask for more once the previous chunk is out */
+	if (request->pull && string_buffer_len(mas->buffer) == 0) {
+		request->pull = FALSE;
+
+		err = messages_get_message_next(mas->backend_data);
+		if (err < 0)
+			return err;
+	}
+
+	if (len == 0 && !mas->finished)
+		return -EAGAIN;
+
+	return len;
+}
+
 static int any_close(void *obj)
 {
 	struct mas_session *mas = obj;
@@ -1940,7 +2239,7 @@ static struct obex_mime_type_driver mime_message = {
 	.get_next_header = any_get_next_header,
 	.open = message_open,
 	.close = any_close,
-	.read = any_read,
+	.read = message_read,
 	.write = message_write,
 	.flush = message_flush,
 };
@@ -2027,6 +2326,12 @@ static int mas_init(void)
 	if (err < 0)
 		goto failed;
 
+#ifdef MNS_INPROCESS
+	/* Without it events go through obex-client instead */
+	if (mns_init() < 0)
+		error("Unable to set up the in-process MNS client");
+#endif
+
 	return 0;
 
 failed:
@@ -2045,6 +2350,10 @@ static void mas_exit(void)
 	/* XXX: Is mas_disconnect() guaranteed before mas_exit()? */
 	/* XXX: Shall I keep waiting here for closing MNS connections? */
 
+#ifdef MNS_INPROCESS
+	mns_exit();
+#endif
+
 	obex_service_driver_unregister(&mas);
 
 	for (i = 0; map_drivers[i] != NULL; ++i)
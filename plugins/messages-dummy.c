@@ -27,22 +27,45 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "log.h"
 #include "messages.h"
 
 static char *root_folder = NULL;
+static guint64 next_handle = 1;
+
+struct push_message_data;
 
 struct session {
 	char *cwd;
 	char *cwd_absolute;
 	void *request;
+	struct push_message_data *push;
 	messages_event_cb cb;
 	void *ev_data;
 };
 
+/* Pushed messages are written out as they arrive, one file per message
+ * named after its handle */
+struct push_message_data {
+	struct session *session;
+	char *handle;
+	char *path;
+	int fd;
+	GIOChannel *io;
+	guint watch;
+	guint done;
+	messages_push_message_cb cb;
+	messages_push_body_ready_cb ready_cb;
+	void *user_data;
+};
+
+static void push_message_free(struct push_message_data *push);
+
 struct folder_listing_data {
 	struct session *session;
 	const char *name;
@@ -97,6 +120,9 @@ void messages_disconnect(void *s)
 {
 	struct session *session = s;
 
+	if (session->push)
+		push_message_free(session->push);
+
 	g_free(session->cwd);
 	g_free(session->cwd_absolute);
 	g_free(session);
@@ -112,7 +138,7 @@ static gboolean trigger(gpointer data)
 	ev.handle = "012345";
 	ev.folder = "";
 	ev.old_folder = "";
-	ev.msg_type = "";
+	ev.msg_type = BMSG_T_SMS_GSM;
 
 	if (session->cb)
 		session->cb(session, &ev, session->ev_data);
@@ -121,9 +147,7 @@ static gboolean trigger(gpointer data)
 }
 
 int messages_set_notification_registration(void *s,
-		void (*send_event)(void *session,
-			const struct messages_event *event, void *user_data),
-		void *user_data)
+		messages_event_cb send_event, void *user_data)
 {
 	struct session *session = s;
 	session->cb = send_event;
@@ -362,22 +386,167 @@ int messages_get_message(void *session,
 	return -EINVAL;
 }
 
+int messages_get_message_next(void *session)
+{
+	return -EINVAL;
+}
+
 int messages_set_message_status(void *session, const char *handle,
-		uint8_t indicator, uint8_t value)
+		uint8_t indicator, uint8_t value,
+		messages_set_message_status_cb callback,
+		void *user_data)
 {
 	return -EINVAL;
 }
 
-int messages_push_message(void *session, struct bmsg_bmsg *bmsg,
+static void push_message_free(struct push_message_data *push)
+{
+	if (push->watch > 0)
+		g_source_remove(push->watch);
+
+	if (push->done > 0)
+		g_source_remove(push->done);
+
+	if (push->io != NULL)
+		g_io_channel_unref(push->io);
+
+	if (push->fd >= 0) {
+		close(push->fd);
+		unlink(push->path);
+	}
+
+	push->session->push = NULL;
+
+	g_free(push->handle);
+	g_free(push->path);
+	g_free(push);
+}
+
+static gboolean push_message_writable(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct push_message_data *push = user_data;
+
+	push->watch = 0;
+
+	push->ready_cb(push->session, push->user_data);
+
+	return FALSE;
+}
+
+static gboolean push_message_done(gpointer user_data)
+{
+	struct push_message_data *push = user_data;
+	struct session *session = push->session;
+	messages_push_message_cb cb = push->cb;
+	void *cb_data = push->user_data;
+	char *handle;
+
+	push->done = 0;
+
+	handle = push->handle;
+	push->handle = NULL;
+	push_message_free(push);
+
+	cb(session, 0, handle, cb_data);
+
+	g_free(handle);
+
+	return FALSE;
+}
+
+int messages_push_message(void *s, struct bmsg_bmsg *bmsg,
 				const char *name, unsigned long flags,
-				messages_push_message_cb cb, void *user_data)
+				messages_push_message_cb cb,
+				messages_push_body_ready_cb ready_cb,
+				void *user_data)
 {
-	return -EINVAL;
+	struct session *session = s;
+	struct push_message_data *push;
+	char *folder;
+	int err;
+
+	if (session->push != NULL)
+		return -EBUSY;
+
+	folder = g_build_filename(session->cwd_absolute, name, NULL);
+	if (!g_file_test(folder, G_FILE_TEST_IS_DIR)) {
+		g_free(folder);
+		return -ENOENT;
+	}
+
+	push = g_new0(struct push_message_data, 1);
+	push->session = session;
+	push->cb = cb;
+	push->ready_cb = ready_cb;
+	push->user_data = user_data;
+
+	do {
+		g_free(push->handle);
+		g_free(push->path);
+
+		push->handle = g_strdup_printf("%016" G_GINT64_MODIFIER "X",
+								next_handle++);
+		push->path = g_build_filename(folder, push->handle, NULL);
+		push->fd = open(push->path, O_WRONLY | O_CREAT | O_EXCL |
+							O_NONBLOCK, 0600);
+	} while (push->fd < 0 && errno == EEXIST);
+
+	g_free(folder);
+
+	if (push->fd < 0) {
+		err = -errno;
+		DBG("open(): %d, %s", -err, strerror(-err));
+		session->push = push;
+		push_message_free(push);
+
+		return err;
+	}
+
+	session->push = push;
+
+	return 0;
 }
 
-int messages_push_message_body(void *session, const char *body, size_t len)
+int messages_push_message_body(void *s, const char *body, size_t len)
 {
-	return -EINVAL;
+	struct session *session = s;
+	struct push_message_data *push = session->push;
+	ssize_t ret;
+	int err;
+
+	if (push == NULL || push->done > 0)
+		return -EBADR;
+
+	if (len == 0) {
+		close(push->fd);
+		push->fd = -1;
+		push->done = g_idle_add(push_message_done, push);
+
+		return 0;
+	}
+
+	ret = write(push->fd, body, len);
+	if (ret >= 0)
+		return ret;
+
+	err = -errno;
+	if (err != -EAGAIN) {
+		DBG("write(): %d, %s", -err, strerror(-err));
+		push_message_free(push);
+
+		return err;
+	}
+
+	if (push->watch == 0) {
+		if (push->io == NULL)
+			push->io = g_io_channel_unix_new(push->fd);
+
+		push->watch = g_io_add_watch(push->io, G_IO_OUT,
+						push_message_writable, push);
+	}
+
+	return -EAGAIN;
 }
 
 void messages_abort(void *s)
@@ -388,4 +557,7 @@ void messages_abort(void *s)
 		g_idle_remove_by_data(session->request);
 		session->request = NULL;
 	}
+
+	if (session->push)
+		push_message_free(session->push);
 }
@@ -0,0 +1,304 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _XOPEN_SOURCE
+
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+#include "messages.h"
+#include "messages-filter.h"
+
+#define TRACKER_MESSAGE_TSTAMP_FORMAT "%Y-%m-%dT%TZ"
+#define MAP_TSTAMP_FORMAT "%Y%m%dT%H%M%S"
+
+#define MESSAGES_FILTER_NONE "FILTER (!BOUND(?msg)) . "
+
+gboolean messages_filter_match(const struct messages_message *message,
+					const struct messages_filter *filter)
+{
+	if (filter->type != 0) {
+		if (g_strcmp0(message->type, "SMS_GSM") == 0 &&
+				(filter->type & 0x01))
+			return FALSE;
+
+		if (g_strcmp0(message->type, "SMS_CDMA") == 0 &&
+				(filter->type & 0x02))
+			return FALSE;
+
+		if (g_strcmp0(message->type, "SMS_EMAIL") == 0 &&
+				(filter->type & 0x04))
+			return FALSE;
+
+		if (g_strcmp0(message->type, "SMS_MMS") == 0 &&
+				(filter->type & 0x08))
+			return FALSE;
+	}
+
+	if (filter->read_status != 0) {
+		if (filter->read_status == 0x01 && message->read != FALSE)
+			return FALSE;
+
+		if (filter->read_status == 0x02 && message->read != TRUE)
+			return FALSE;
+	}
+
+	if (filter->priority != 0) {
+		if (filter->priority == 0x01 && message->priority == FALSE)
+			return FALSE;
+
+		if (filter->priority == 0x02 && message->priority == TRUE)
+			return FALSE;
+	}
+
+	if (filter->period_begin != NULL &&
+			g_strcmp0(filter->period_begin, message->datetime) > 0)
+		return FALSE;
+
+	if (filter->period_end != NULL &&
+			g_strcmp0(filter->period_end, message->datetime) < 0)
+		return FALSE;
+
+	if (filter->originator != NULL) {
+		char *orig = g_strdup_printf("*%s*", filter->originator);
+
+		if (g_pattern_match_simple(orig,
+					message->sender_addressing != NULL ?
+					message->sender_addressing : "") == FALSE &&
+				g_pattern_match_simple(orig,
+					message->sender_name != NULL ?
+					message->sender_name : "") == FALSE) {
+			g_free(orig);
+			return FALSE;
+		}
+		g_free(orig);
+	}
+
+	if (filter->recipient != NULL) {
+		char *recip = g_strdup_printf("*%s*", filter->recipient);
+
+		if (g_pattern_match_simple(recip,
+					message->recipient_addressing != NULL ?
+					message->recipient_addressing : "") ==
+					FALSE &&
+				g_pattern_match_simple(recip,
+					message->recipient_name != NULL ?
+					message->recipient_name : "") == FALSE) {
+			g_free(recip);
+			return FALSE;
+		}
+
+		g_free(recip);
+	}
+
+	return TRUE;
+}
+
+static void append_sparql_string(GString *query, const char *str)
+{
+	g_string_append_c(query, '"');
+
+	for (; *str; str++) {
+		switch (*str) {
+		case '"':
+		case '\\':
+			g_string_append_c(query, '\\');
+			g_string_append_c(query, *str);
+			break;
+		case '\n':
+			g_string_append(query, "\\n");
+			break;
+		case '\r':
+			g_string_append(query, "\\r");
+			break;
+		case '\t':
+			g_string_append(query, "\\t");
+			break;
+		default:
+			g_string_append_c(query, *str);
+		}
+	}
+
+	g_string_append_c(query, '"');
+}
+
+/* Converts a MAP local time stamp to the UTC format used by tracker */
+static char *map2tracker_tstamp(const char *stamp)
+{
+	struct tm tm;
+	time_t time;
+	char *utc;
+
+	memset(&tm, 0, sizeof(tm));
+
+	if (strptime(stamp, MAP_TSTAMP_FORMAT, &tm) == NULL)
+		return NULL;
+
+	tm.tm_isdst = -1;
+	time = mktime(&tm);
+	if (time == (time_t) -1)
+		return NULL;
+
+	gmtime_r(&time, &tm);
+
+	utc = g_new0(char, 21); /* format: "YYYY-MM-DDTHH:MM:SSZ\0" */
+	strftime(utc, 21, TRACKER_MESSAGE_TSTAMP_FORMAT, &tm);
+
+	return utc;
+}
+
+static void append_period_rule(GString *query, const char *stamp,
+						const char *op, gboolean *exact)
+{
+	char *utc = map2tracker_tstamp(stamp);
+
+	if (utc == NULL) {
+		*exact = FALSE;
+		return;
+	}
+
+	/* Messages without a sent date are listed by reception date */
+	g_string_append_printf(query, "FILTER (COALESCE(nmo:sentDate(?msg), "
+				"nmo:receivedDate(?msg)) %s "
+				"\"%s\"^^xsd:dateTime) . ", op, utc);
+
+	g_free(utc);
+}
+
+/* messages_filter_match() matches "*party*", so these accept any message */
+gboolean messages_filter_party_any(const char *party)
+{
+	return party == NULL || party[strspn(party, "*")] == '\0';
+}
+
+static void append_party_rule(GString *query, const char *party,
+				gboolean sent, messages_filter_numbers_func
+				numbers_func, gboolean *exact)
+{
+	static const char *fields[] = {
+		"nco:nameGiven(?cont)",
+		"nco:nameFamily(?cont)",
+		NULL
+	};
+	GSList *numbers = NULL, *l;
+	int i;
+
+	if (messages_filter_party_any(party))
+		return;
+
+	/* Only the remote party of a message is matched */
+	g_string_append_printf(query, "?msg nmo:isSent %s . ",
+						sent ? "true" : "false");
+
+	/* Wildcards and names spanning given and family name can't be
+	 * expressed with fn:contains, messages_filter_match() handles them */
+	if (strpbrk(party, "*? ") != NULL) {
+		*exact = FALSE;
+		return;
+	}
+
+	/* Without ?cont, names are matched here and the query checks the
+	 * numbers of the contacts having them */
+	if (numbers_func != NULL && !numbers_func(party, &numbers)) {
+		*exact = FALSE;
+		return;
+	}
+
+	g_string_append(query, "FILTER (fn:contains(nco:phoneNumber(?phone), ");
+	append_sparql_string(query, party);
+	g_string_append_c(query, ')');
+
+	for (i = 0; numbers_func == NULL && fields[i] != NULL; i++) {
+		g_string_append_printf(query, " || fn:contains(%s, ",
+								fields[i]);
+		append_sparql_string(query, party);
+		g_string_append_c(query, ')');
+	}
+
+	for (l = numbers; l != NULL; l = l->next) {
+		g_string_append(query, l == numbers ? " || ?lphone IN (" :
+									", ");
+		append_sparql_string(query, l->data);
+
+		if (l->next == NULL)
+			g_string_append_c(query, ')');
+	}
+
+	g_slist_free(numbers);
+
+	g_string_append(query, ") . ");
+}
+
+/* Translates as much of the filter as possible to SPARQL so the store only
+ * returns matching rows. The result never excludes a message accepted by
+ * messages_filter_match(), which still runs on every returned row. If the
+ * rules match exactly the same messages, exact is set to TRUE. */
+char *messages_filter_sparql(const struct messages_filter *filter,
+				messages_filter_numbers_func numbers_func,
+				gboolean *exact)
+{
+	GString *query = g_string_new("");
+
+	*exact = TRUE;
+
+	/* Only SMS_GSM messages are stored, see pull_message_data() */
+	if (filter->type & 0x01)
+		goto none;
+
+	/* And none of them has high priority */
+	if (filter->priority == 0x01)
+		goto none;
+
+	if (filter->read_status == 0x01)
+		g_string_append(query, "?msg nmo:isRead false . ");
+	else if (filter->read_status == 0x02)
+		g_string_append(query, "?msg nmo:isRead true . ");
+
+	if (filter->period_begin != NULL)
+		append_period_rule(query, filter->period_begin, ">=", exact);
+
+	if (filter->period_end != NULL)
+		append_period_rule(query, filter->period_end, "<=", exact);
+
+	/* Received messages have no recipient and sent ones no originator */
+	if (!messages_filter_party_any(filter->originator) &&
+				!messages_filter_party_any(filter->recipient))
+		goto none;
+
+	append_party_rule(query, filter->originator, FALSE, numbers_func,
+									exact);
+	append_party_rule(query, filter->recipient, TRUE, numbers_func,
+									exact);
+
+	return g_string_free(query, FALSE);
+
+none:
+	g_string_assign(query, MESSAGES_FILTER_NONE);
+
+	return g_string_free(query, FALSE);
+}
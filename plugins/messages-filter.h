@@ -0,0 +1,37 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Message listing filters, applied to a struct messages_message and turned
+ * into SPARQL rules for the tracker backend */
+
+/* Returns the numbers of the contacts whose names contain party, or FALSE
+ * if they can't all be listed */
+typedef gboolean (*messages_filter_numbers_func) (const char *party,
+							GSList **numbers);
+
+gboolean messages_filter_match(const struct messages_message *message,
+					const struct messages_filter *filter);
+gboolean messages_filter_party_any(const char *party);
+char *messages_filter_sparql(const struct messages_filter *filter,
+				messages_filter_numbers_func numbers_func,
+				gboolean *exact);
@@ -0,0 +1,121 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+#include "messages-groups.h"
+
+struct message_groups {
+	GHashTable *msg_grp;	/* handle -> group */
+	GHashTable *grp_msgs;	/* group -> set of handles */
+};
+
+struct message_groups *message_groups_new(void)
+{
+	struct message_groups *groups = g_new0(struct message_groups, 1);
+
+	groups->msg_grp = g_hash_table_new(NULL, NULL);
+	groups->grp_msgs = g_hash_table_new_full(NULL, NULL, NULL,
+					(GDestroyNotify) g_hash_table_destroy);
+
+	return groups;
+}
+
+void message_groups_free(struct message_groups *groups)
+{
+	g_hash_table_destroy(groups->grp_msgs);
+	g_hash_table_destroy(groups->msg_grp);
+	g_free(groups);
+}
+
+void message_groups_add(struct message_groups *groups, int handle, int group)
+{
+	GHashTable *handles;
+
+	if (g_hash_table_lookup_extended(groups->msg_grp,
+					GINT_TO_POINTER(handle), NULL, NULL))
+		return;
+
+	g_hash_table_insert(groups->msg_grp, GINT_TO_POINTER(handle),
+						GINT_TO_POINTER(group));
+
+	handles = g_hash_table_lookup(groups->grp_msgs,
+						GINT_TO_POINTER(group));
+	if (handles == NULL) {
+		handles = g_hash_table_new(NULL, NULL);
+		g_hash_table_insert(groups->grp_msgs, GINT_TO_POINTER(group),
+								handles);
+	}
+
+	g_hash_table_insert(handles, GINT_TO_POINTER(handle), NULL);
+}
+
+void message_groups_remove(struct message_groups *groups, int handle)
+{
+	GHashTable *handles;
+	gpointer group;
+
+	if (!g_hash_table_lookup_extended(groups->msg_grp,
+					GINT_TO_POINTER(handle), NULL, &group))
+		return;
+
+	g_hash_table_remove(groups->msg_grp, GINT_TO_POINTER(handle));
+
+	handles = g_hash_table_lookup(groups->grp_msgs, group);
+	if (handles == NULL)
+		return;
+
+	g_hash_table_remove(handles, GINT_TO_POINTER(handle));
+
+	if (g_hash_table_size(handles) == 0)
+		g_hash_table_remove(groups->grp_msgs, group);
+}
+
+void message_groups_remove_group(struct message_groups *groups, int group,
+				message_groups_func func, void *user_data)
+{
+	GHashTable *handles;
+	GHashTableIter iter;
+	gpointer key;
+
+	handles = g_hash_table_lookup(groups->grp_msgs,
+						GINT_TO_POINTER(group));
+	if (handles == NULL)
+		return;
+
+	g_hash_table_steal(groups->grp_msgs, GINT_TO_POINTER(group));
+
+	g_hash_table_iter_init(&iter, handles);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		g_hash_table_remove(groups->msg_grp, key);
+
+		if (func != NULL)
+			func(GPOINTER_TO_INT(key), user_data);
+	}
+
+	g_hash_table_destroy(handles);
+}
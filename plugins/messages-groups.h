@@ -0,0 +1,40 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Which group each known message belongs to, indexed both ways so that
+ * listing and deleting cost O(1) per message */
+
+struct message_groups;
+
+typedef void (*message_groups_func) (int handle, void *user_data);
+
+struct message_groups *message_groups_new(void);
+void message_groups_free(struct message_groups *groups);
+
+/* Known handles keep their first group */
+void message_groups_add(struct message_groups *groups, int handle, int group);
+void message_groups_remove(struct message_groups *groups, int handle);
+
+/* Forgets the group, calling func for each message it had */
+void message_groups_remove_group(struct message_groups *groups, int group,
+				message_groups_func func, void *user_data);
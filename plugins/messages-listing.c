@@ -0,0 +1,224 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <glib.h>
+
+#include "messages.h"
+#include "messages-listing.h"
+
+static void listing_entry_free(struct listing_index *index,
+					struct listing_entry *entry)
+{
+	index->msg_free(entry->msg);
+	g_free(entry->date);
+	g_free(entry);
+}
+
+static gint listing_entry_cmp(gconstpointer a, gconstpointer b,
+							gpointer user_data)
+{
+	const struct listing_entry *ea = a, *eb = b;
+	int ret;
+
+	/* Same order as ORDER BY DESC(nmo:sentDate(?msg)) */
+	ret = strcmp(eb->date, ea->date);
+	if (ret != 0)
+		return ret;
+
+	return eb->handle - ea->handle;
+}
+
+struct listing_index *listing_index_new(GDestroyNotify msg_free)
+{
+	struct listing_index *index = g_new0(struct listing_index, 1);
+
+	index->refcount = 1;
+	index->entries = g_sequence_new(NULL);
+	index->handles = g_hash_table_new(NULL, NULL);
+	index->msg_free = msg_free;
+
+	return index;
+}
+
+struct listing_index *listing_index_ref(struct listing_index *index)
+{
+	index->refcount++;
+
+	return index;
+}
+
+void listing_index_unref(struct listing_index *index)
+{
+	GSequenceIter *iter;
+
+	if (--index->refcount > 0)
+		return;
+
+	iter = g_sequence_get_begin_iter(index->entries);
+	for (; !g_sequence_iter_is_end(iter);
+				iter = g_sequence_iter_next(iter))
+		listing_entry_free(index, g_sequence_get(iter));
+
+	g_hash_table_destroy(index->handles);
+	g_sequence_free(index->entries);
+	g_free(index);
+}
+
+unsigned int listing_index_size(struct listing_index *index)
+{
+	return g_hash_table_size(index->handles);
+}
+
+void listing_index_remove(struct listing_index *index, int handle)
+{
+	GSequenceIter *iter;
+
+	iter = g_hash_table_lookup(index->handles, GINT_TO_POINTER(handle));
+	if (iter == NULL)
+		return;
+
+	g_hash_table_remove(index->handles, GINT_TO_POINTER(handle));
+	listing_entry_free(index, g_sequence_get(iter));
+	g_sequence_remove(iter);
+}
+
+void listing_index_insert(struct listing_index *index,
+					struct messages_message *msg,
+					int handle, const char *date)
+{
+	struct listing_entry *entry;
+	GSequenceIter *iter;
+
+	listing_index_remove(index, handle);
+
+	entry = g_new0(struct listing_entry, 1);
+	entry->msg = msg;
+	entry->handle = handle;
+	entry->date = g_strdup(date);
+
+	iter = g_sequence_insert_sorted(index->entries, entry,
+						listing_entry_cmp, NULL);
+	g_hash_table_insert(index->handles, GINT_TO_POINTER(handle), iter);
+}
+
+void listing_cache_drop(struct listing_cache *cache)
+{
+	cache->changes++;
+
+	if (cache->index == NULL)
+		return;
+
+	listing_index_unref(cache->index);
+	cache->index = NULL;
+}
+
+void listing_cache_remove(struct listing_cache *cache, int handle)
+{
+	cache->changes++;
+	cache->removals++;
+
+	if (cache->index != NULL)
+		listing_index_remove(cache->index, handle);
+}
+
+void listing_cache_set_read(struct listing_cache *cache, int handle,
+							gboolean read)
+{
+	struct listing_entry *entry;
+	GSequenceIter *iter;
+
+	cache->changes++;
+
+	if (cache->index == NULL)
+		return;
+
+	iter = g_hash_table_lookup(cache->index->handles,
+					GINT_TO_POINTER(handle));
+	if (iter == NULL)
+		return;
+
+	entry = g_sequence_get(iter);
+	entry->msg->read = read;
+}
+
+gboolean listing_cache_invalidate(struct listing_cache *cache, int handle)
+{
+	cache->changes++;
+
+	if (cache->index == NULL)
+		return FALSE;
+
+	listing_index_remove(cache->index, handle);
+
+	return TRUE;
+}
+
+gboolean listing_cache_update(struct listing_cache *cache,
+				unsigned int removals,
+				struct messages_message *msg,
+				int handle, const char *date)
+{
+	if (cache->index == NULL)
+		return FALSE;
+
+	/* The message could have been deleted while it was looked up */
+	if (cache->removals != removals) {
+		listing_cache_drop(cache);
+		return FALSE;
+	}
+
+	if (listing_index_size(cache->index) >= LISTING_CACHE_MAX) {
+		cache->overflow = TRUE;
+		listing_cache_drop(cache);
+		return FALSE;
+	}
+
+	listing_index_insert(cache->index, msg, handle, date);
+
+	return TRUE;
+}
+
+gboolean listing_cache_publish(struct listing_cache *cache,
+				struct listing_index *build,
+				unsigned int changes)
+{
+	cache->building = FALSE;
+
+	if (build == NULL)
+		return FALSE;
+
+	/* Changes seen while the query ran may be missing from the rows */
+	if (cache->changes != changes || cache->index != NULL) {
+		listing_index_unref(build);
+		return FALSE;
+	}
+
+	cache->index = build;
+
+	return TRUE;
+}
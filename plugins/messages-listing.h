@@ -0,0 +1,90 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Listings of whole folders kept by the tracker backend, and the rules for
+ * keeping them valid while messages change under them */
+
+#define LISTING_CACHE_MAX 8192	/* Messages kept per cached folder */
+
+struct message_folder;
+
+struct listing_entry {
+	struct messages_message *msg;
+	int handle;
+	char *date;		/* nmo:sentDate, the sort key */
+};
+
+struct listing_index {
+	int refcount;
+	GSequence *entries;	/* Newest first */
+	GHashTable *handles;	/* handle -> GSequenceIter */
+	GDestroyNotify msg_free;
+};
+
+/* Listing of a whole folder, kept up to date from CommHistory signals so
+ * repeated listings don't have to query tracker */
+struct listing_cache {
+	const char *name;
+	struct message_folder *folder;
+	struct listing_index *index;	/* NULL until built or when stale */
+	gboolean building;
+	gboolean overflow;		/* Too big, listings use paging */
+	unsigned int changes;		/* Bumped by every change */
+	unsigned int removals;		/* Bumped by every removal */
+};
+
+struct listing_index *listing_index_new(GDestroyNotify msg_free);
+struct listing_index *listing_index_ref(struct listing_index *index);
+void listing_index_unref(struct listing_index *index);
+unsigned int listing_index_size(struct listing_index *index);
+void listing_index_remove(struct listing_index *index, int handle);
+
+/* Takes ownership of msg */
+void listing_index_insert(struct listing_index *index,
+					struct messages_message *msg,
+					int handle, const char *date);
+
+/* Rebuilt on the next listing, used when a change may have been missed */
+void listing_cache_drop(struct listing_cache *cache);
+
+void listing_cache_remove(struct listing_cache *cache, int handle);
+void listing_cache_set_read(struct listing_cache *cache, int handle,
+							gboolean read);
+
+/* The message changed and is taken out until it's looked up again, returns
+ * FALSE if there is nothing cached to put it back into */
+gboolean listing_cache_invalidate(struct listing_cache *cache, int handle);
+
+/* Puts a message looked up again back, if nothing was removed since the
+ * lookup started with the given removals count. Takes ownership of msg
+ * and returns TRUE if it was cached. */
+gboolean listing_cache_update(struct listing_cache *cache,
+				unsigned int removals,
+				struct messages_message *msg,
+				int handle, const char *date);
+
+/* Ends a build started with the given changes count, taking ownership of
+ * build, and returns TRUE if it became the cached listing */
+gboolean listing_cache_publish(struct listing_cache *cache,
+				struct listing_index *build,
+				unsigned int changes);
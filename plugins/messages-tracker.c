@@ -34,9 +34,18 @@
 #include <gdbus.h>
 #include <stdlib.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libtracker-sparql/tracker-sparql.h>
 
 #include "log.h"
 #include "messages.h"
+#include "messages-filter.h"
+#include "messages-groups.h"
+#include "messages-listing.h"
 #include "bmsg.h"
 #include "bmsg_parser.h"
 #include "messages-qt/messages-qt.h"
@@ -51,6 +60,7 @@
 #define TRACKER_MESSAGE_TSTAMP_FORMAT "%Y-%m-%dT%TZ"
 
 #define QUERY_RESPONSE_SIZE 15
+#define COUNT_RESPONSE_SIZE 2
 #define MESSAGE_HANDLE_SIZE 16
 #define MESSAGE_HANDLE_PREFIX_LEN 8
 #define MESSAGE_GRP_PREFIX_LEN 13
@@ -59,13 +69,36 @@
 
 #define STATUS_NOT_SET 0xFF
 
-#define MESSAGES_FILTER_BY_HANDLE "FILTER (xsd:string(?msg) = \"message:%s\" ) ."
+/* Matches the resource itself rather than its string form, so the store
+ * looks the message up instead of converting every IRI */
+#define MESSAGES_FILTER_BY_HANDLE "FILTER (?msg = <message:%s>) . "
 
 #define MESSAGE_STAT_EMPTY	0x01
 #define MESSAGE_STAT_READ	0x02
 #define MESSAGE_STAT_DELETED	0x04
 #define MESSAGE_STAT_SENT	0x08
 
+/* Message status shared by all sessions, kept in a memory-mapped open
+ * addressing table so it survives restarts */
+#define STATUS_STORE_FILE "message-status"
+#define STATUS_STORE_MAGIC 0x4d535453	/* "MSTS" */
+#define STATUS_STORE_VERSION 1
+#define STATUS_STORE_MIN_SIZE 1024	/* Entries, power of two */
+#define STATUS_STORE_MAX_EXCLUDED 64	/* Deleted handles put in a query */
+
+
+#define MESSAGE_CACHE_SIZE 16	/* Rendered bMessages kept around */
+#define MESSAGE_CACHE_MAX_TEXT 16384	/* Bigger ones aren't cached */
+#define MESSAGE_CHUNK_SIZE 8192	/* Bytes of bMessage handed out at once */
+#define MESSAGE_FRACTION_SIZE 65536	/* Content bytes per fraction */
+
+/* Framing of a pushed message body */
+#define MSG_BEGIN "BEGIN:MSG\r\n"
+#define MSG_BEGIN_LEN 11
+#define MSG_END "\r\nEND:MSG\r\n"
+#define MSG_END_LEN 11
+#define PUSH_BODY_PREALLOC 4096
+
 #define MESSAGE_HANDLE 0
 #define MESSAGE_SUBJECT 1
 #define MESSAGE_SDATE 2
@@ -81,24 +114,71 @@
 #define MESSAGE_SENT 12
 #define MESSAGE_CONTENT 13
 #define MESSAGE_GROUP 14
+#define MESSAGE_LOCAL_PHONE 15	/* Only used to look the contact up */
+#define MESSAGE_ROW_SIZE 16
+
+#define MESSAGE_CONTACT_COLUMNS (0x3f << MESSAGE_CONTACT_FN)
+#define MESSAGE_ALL_COLUMNS ((1 << QUERY_RESPONSE_SIZE) - 1)
+
+/* Columns every listing needs: the handle, the state mirrored in the
+ * status store, the sort key and the group */
+#define LISTING_COLUMNS ((1 << MESSAGE_HANDLE) | (1 << MESSAGE_SDATE) |	\
+			(1 << MESSAGE_CONTACT_PHONE) | (1 << MESSAGE_READ) | \
+			(1 << MESSAGE_SENT) | (1 << MESSAGE_GROUP))
 
-#define LIST_MESSAGES_QUERY						\
-"SELECT "								\
-"?msg "									\
-"nmo:messageSubject(?msg) "						\
-"nmo:sentDate(?msg) "							\
-"nmo:receivedDate(?msg) "						\
+#define COUNT_TOTAL 0
+#define COUNT_UNREAD 1
+
+/* Every number of every contact, resolved locally instead of grouping
+ * the whole address book in each message query */
+#define CONTACTS_QUERY							\
+"SELECT ?cont ?lphone "							\
 "nco:fullname(?cont) "							\
 "nco:nameGiven(?cont) "							\
 "nco:nameFamily(?cont) "						\
 "nco:nameAdditional(?cont) "						\
 "nco:nameHonorificPrefix(?cont) "					\
 "nco:nameHonorificSuffix(?cont) "					\
-"nco:phoneNumber(?phone) "						\
-"nmo:isRead(?msg) "							\
-"nmo:isSent(?msg) "							\
-"nie:plainTextContent(?msg) "						\
-"nmo:communicationChannel(?msg) "					\
+"WHERE { "								\
+	"?cont a nco:PersonContact . "					\
+	"{ "								\
+		"?cont nco:hasAffiliation ?_role . "			\
+		"?_role nco:hasPhoneNumber ?_phone . "			\
+	"} UNION { "							\
+		"?cont nco:hasPhoneNumber ?_phone "			\
+	"} "								\
+	"?_phone maemo:localPhoneNumber ?lphone . "			\
+"} "
+
+#define CONTACTS_RESPONSE_SIZE 8
+#define CONTACT_URI 0
+#define CONTACT_LOCAL_PHONE 1
+#define CONTACT_NAMES 2		/* In MESSAGE_CONTACT_FN order */
+#define CONTACT_NAMES_LEN 6
+
+#define CONTACTS_RELOAD_DELAY 2	/* Seconds */
+#define CONTACTS_RETRY_DELAY 30	/* Seconds */
+#define CONTACTS_MAX_MATCHES 64	/* Numbers put in a party rule */
+
+#define NCO_CLASS_PREFIX \
+	"http://www.semanticdesktop.org/ontologies/2007/03/22/nco#"
+
+#define LIST_MESSAGES_ORDER "} ORDER BY DESC(nmo:sentDate(?msg)) "
+
+/* A single message, the folder pattern is replaced by its handle */
+#define GET_MESSAGE_END "} LIMIT 1"
+
+/* Number of messages and how many of them are unread */
+#define COUNT_MESSAGES_SELECT "SELECT COUNT(?msg) COUNT(?unread) "
+
+#define COUNT_MESSAGES_UNREAD						\
+	"OPTIONAL { "							\
+		"?msg nmo:isRead ?unread . "				\
+		"FILTER (?unread = false) "				\
+	"} "								\
+"} "
+
+#define MESSAGES_QUERY_PATTERN						\
 "WHERE { "								\
 	"?msg a nmo:SMSMessage . "					\
 	"%s "								\
@@ -111,7 +191,10 @@
 	"	?msg nmo:isSent true "					\
 	"} "								\
 	"?msg_cont nco:hasPhoneNumber ?phone . "			\
-	"?phone maemo:localPhoneNumber ?lphone . "			\
+	"?phone maemo:localPhoneNumber ?lphone . "
+
+/* Binds ?cont to the contact owning the number, if there's only one */
+#define MESSAGES_CONTACT_PATTERN					\
 	"OPTIONAL { "							\
 		"{ SELECT ?cont ?lphone "				\
 			"count(?cont) as ?cnt "				\
@@ -126,8 +209,7 @@
 			"?_phone maemo:localPhoneNumber ?lphone. "	\
 		"} GROUP BY ?lphone } "					\
 		"FILTER(?cnt = 1) "					\
-	"} "								\
-"} ORDER BY DESC(nmo:sentDate(?msg)) "
+	"} "
 
 #define HANDLE_BY_UUID_QUERY		\
 "SELECT ?msg { "			\
@@ -150,7 +232,8 @@ struct message_folder {
 };
 
 struct push_message_request {
-	GString *body;
+	GString *body;		/* Text between BEGIN:MSG and END:MSG */
+	size_t matched;		/* Bytes of MSG_BEGIN seen so far */
 	messages_push_message_cb cb;
 	struct bmsg_bmsg *bmsg;
 	void *user_data;
@@ -167,6 +250,8 @@ struct request {
 	uint16_t max;
 	uint16_t offset;
 	uint16_t size;
+	uint16_t total;
+	char *query;		/* Page query run once the count is known */
 	void *user_data;
 	gboolean count;
 	gboolean new_message;
@@ -175,7 +260,17 @@ struct request {
 	unsigned long flags;
 	gboolean deleted;
 	void *set_status_call;
-	DBusPendingCall *pc;
+	GCancellable *canc;
+	struct listing_cache *cache;	/* Folder being cached, if any */
+	struct listing_index *build;	/* Filled while the listing runs */
+	unsigned int changes;		/* Cache changes when it started */
+	struct listing_index *snapshot;	/* Served from the cache */
+	uint8_t columns[MESSAGE_ROW_SIZE];	/* Field -> MESSAGE_* */
+	int num_columns;		/* Zero if all of them are selected */
+	struct message_stream *stream;	/* bMessage being handed out */
+	size_t fraction;		/* Content offset of the fraction */
+	int part_id;			/* Index of the fraction */
+	guint idle;
 	union {
 		messages_folder_listing_cb folder_list;
 		messages_get_messages_listing_cb messages_list;
@@ -184,6 +279,13 @@ struct request {
 	} cb;
 };
 
+struct pending_query {
+	reply_list_foreach_cb callback;
+	void *user_data;
+	GCancellable *cancellable;
+	int num_fields;
+};
+
 struct session {
 	char *cwd;
 	struct message_folder *folder;
@@ -195,25 +297,466 @@ struct session {
 	void *request_data;
 	gboolean op_in_progress;
 	GSList *mns_event_cache;
+	int fraction_handle;		/* Message being fractioned, or 0 */
+	size_t fraction_offset;		/* Where its next fraction starts */
+	int fraction_part;		/* Index of its last fraction */
+};
+
+/* bMessage handed out MESSAGE_CHUNK_SIZE bytes at a time, from its header,
+ * content and trailer, so it never has to be copied as a whole */
+struct message_stream {
+	struct bmsg *bmsg;	/* Owns the content, unless served from cache */
+	char *text;		/* Cached rendering */
+	GString *head;
+	GString *tail;
+	const char *parts[3];
+	size_t lens[3];
+	int part;
+	size_t offset;		/* Into the current part */
+	gboolean fmore;
+	char chunk[MESSAGE_CHUNK_SIZE + 1];
+};
+
+struct message_cache_entry {
+	int handle;
+	unsigned long flags;
+	gboolean read;		/* As stored in tracker */
+	int stat;		/* Read and deleted state of the text */
+	char *text;
+};
+
+struct listing_update {
+	struct listing_cache *cache;
+	unsigned int removals;
+	GCancellable *canc;
+	uint8_t columns[MESSAGE_ROW_SIZE];
+	int num_columns;
+};
+
+struct contact {
+	char *uri;		/* NULL if the number isn't unique */
+	char *names[CONTACT_NAMES_LEN];
 };
 
 static struct message_folder *folder_tree = NULL;
 static DBusConnection *session_connection = NULL;
+static TrackerSparqlConnection *connection = NULL;
 static unsigned long message_id_tracker_id;
 static GSList *mns_srv;
 static gint newmsg_watch_id, delmsg_watch_id, delgrp_watch_id;
-static GArray *msg_grp;
+static gint updmsg_watch_id;
+
+/* Only messages in the virtual deleted folder are kept in the file, the
+ * read and sent state tracker owns is remembered in memory */
+struct status_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;		/* Number of slots */
+	uint32_t used;		/* Slots with a handle */
+	uint32_t deleted;	/* Entries with MESSAGE_STAT_DELETED */
+	uint32_t reserved[3];
+};
 
-static void free_request(struct request *request)
+struct status_entry {
+	int32_t handle;		/* 0 marks a free slot */
+	uint32_t stat;
+};
+
+struct status_store {
+	char *path;		/* NULL if only kept in memory */
+	struct status_header *header;
+	struct status_entry *entries;
+	size_t length;
+	GHashTable *listed;	/* handle -> stat of messages not deleted */
+};
+
+static struct status_store store;
+static struct message_groups *msg_groups;
+
+static struct listing_cache listing_caches[] = {
+	{ "inbox" },
+	{ "sent" },
+	{ }
+};
+static gboolean listing_cache_enabled = FALSE;
+static GSList *listing_updates = NULL;
+static GQueue *message_cache = NULL;	/* Most recently used first */
+static GHashTable *contacts = NULL;	/* local number -> contact */
+static GHashTable *contacts_loading = NULL;
+static GCancellable *contacts_canc = NULL;
+static guint contacts_reload_id = 0;
+static gint contacts_watch_id;
+static gboolean contacts_failed = FALSE;	/* Rows of the load were lost */
+
+static size_t status_store_length(uint32_t size)
 {
-	g_free(request->name);
-	g_free(request->filter->period_begin);
-	g_free(request->filter->period_end);
-	g_free(request->filter->originator);
-	g_free(request->filter->recipient);
-	g_free(request->filter);
+	return sizeof(struct status_header) +
+				(size_t) size * sizeof(struct status_entry);
+}
 
-	g_free(request);
+static struct status_header *status_store_map(const char *path,
+						uint32_t size, int *fd)
+{
+	size_t length = status_store_length(size);
+	void *map;
+
+	*fd = -1;
+
+	if (path == NULL) {
+		map = mmap(NULL, length, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return map == MAP_FAILED ? NULL : map;
+	}
+
+	*fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (*fd < 0)
+		return NULL;
+
+	if (ftruncate(*fd, length) < 0)
+		goto failed;
+
+	map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (map == MAP_FAILED)
+		goto failed;
+
+	return map;
+
+failed:
+	close(*fd);
+	*fd = -1;
+
+	return NULL;
+}
+
+static uint32_t status_store_hash(struct status_header *header, int handle)
+{
+	return ((uint32_t) handle * 2654435761U) & (header->size - 1);
+}
+
+static struct status_entry *status_store_slot(struct status_header *header,
+								int handle)
+{
+	struct status_entry *entries = (struct status_entry *) (header + 1);
+	uint32_t mask = header->size - 1;
+	uint32_t i = status_store_hash(header, handle);
+
+	while (entries[i].handle != 0 && entries[i].handle != handle)
+		i = (i + 1) & mask;
+
+	return &entries[i];
+}
+
+/* Frees slot i, moving back the entries probed past it so no lookup ends
+ * early on the hole */
+static void status_store_clear_slot(uint32_t i)
+{
+	struct status_entry *entries = store.entries;
+	uint32_t mask = store.header->size - 1;
+	uint32_t j = i;
+
+	if (entries[i].stat & MESSAGE_STAT_DELETED)
+		store.header->deleted--;
+
+	store.header->used--;
+
+	while (1) {
+		uint32_t home;
+
+		entries[i].handle = 0;
+		entries[i].stat = 0;
+
+		do {
+			j = (j + 1) & mask;
+			if (entries[j].handle == 0)
+				return;
+
+			home = status_store_hash(store.header,
+							entries[j].handle);
+		} while (i <= j ? (i < home && home <= j) :
+						(i < home || home <= j));
+
+		entries[i] = entries[j];
+		i = j;
+	}
+}
+
+static void status_store_setup(struct status_header *header, size_t length,
+								int fd)
+{
+	store.header = header;
+	store.entries = (struct status_entry *) (header + 1);
+	store.length = length;
+
+	if (fd >= 0)
+		close(fd);
+}
+
+/* Moves the live entries into a table twice as big */
+static int status_store_grow(void)
+{
+	struct status_header *header;
+	struct status_entry *slot;
+	char *tmp = NULL;
+	uint32_t i;
+	int fd;
+
+	if (store.path)
+		tmp = g_strconcat(store.path, ".new", NULL);
+
+	header = status_store_map(tmp, store.header->size * 2, &fd);
+	if (header == NULL) {
+		g_free(tmp);
+		return -errno;
+	}
+
+	memset(header, 0, sizeof(*header));
+	header->magic = STATUS_STORE_MAGIC;
+	header->version = STATUS_STORE_VERSION;
+	header->size = store.header->size * 2;
+	header->deleted = store.header->deleted;
+
+	for (i = 0; i < store.header->size; i++) {
+		if (store.entries[i].handle == 0)
+			continue;
+
+		slot = status_store_slot(header, store.entries[i].handle);
+		*slot = store.entries[i];
+		header->used++;
+	}
+
+	if (tmp != NULL && rename(tmp, store.path) < 0) {
+		munmap(header, status_store_length(header->size));
+		close(fd);
+		unlink(tmp);
+		g_free(tmp);
+		return -errno;
+	}
+
+	g_free(tmp);
+
+	munmap(store.header, store.length);
+	status_store_setup(header, status_store_length(header->size), fd);
+
+	return 0;
+}
+
+/* Files written before only deleted messages were kept there hold every
+ * message ever listed */
+static void status_store_prune(void)
+{
+	uint32_t i = 0;
+
+	while (i < store.header->size) {
+		if (store.entries[i].handle != 0 &&
+			!(store.entries[i].stat & MESSAGE_STAT_DELETED)) {
+			/* Something else may have been moved in */
+			status_store_clear_slot(i);
+			continue;
+		}
+
+		i++;
+	}
+}
+
+static void status_store_open(void)
+{
+	struct status_header *header;
+	struct stat st;
+	char *dir;
+	int fd;
+
+	store.listed = g_hash_table_new(NULL, NULL);
+
+	dir = g_build_filename(g_get_user_data_dir(), "obexd", NULL);
+	if (g_mkdir_with_parents(dir, 0700) == 0)
+		store.path = g_build_filename(dir, STATUS_STORE_FILE, NULL);
+	g_free(dir);
+
+	if (store.path && stat(store.path, &st) == 0 &&
+				(size_t) st.st_size > sizeof(*header)) {
+		header = status_store_map(store.path,
+				(st.st_size - sizeof(*header)) /
+				sizeof(struct status_entry), &fd);
+		if (header && header->magic == STATUS_STORE_MAGIC &&
+				header->version == STATUS_STORE_VERSION &&
+				(size_t) st.st_size ==
+					status_store_length(header->size) &&
+				(header->size & (header->size - 1)) == 0) {
+			status_store_setup(header, st.st_size, fd);
+
+			if (header->used > header->deleted)
+				status_store_prune();
+
+			return;
+		}
+
+		if (header) {
+			munmap(header, st.st_size);
+			close(fd);
+		}
+
+		DBG("Discarding invalid %s", store.path);
+		unlink(store.path);
+	}
+
+	header = status_store_map(store.path, STATUS_STORE_MIN_SIZE, &fd);
+	if (header == NULL && store.path != NULL) {
+		error("Unable to map %s, message status won't be kept",
+								store.path);
+		g_free(store.path);
+		store.path = NULL;
+		header = status_store_map(NULL, STATUS_STORE_MIN_SIZE, &fd);
+	}
+
+	if (header == NULL)
+		return;
+
+	memset(header, 0, status_store_length(STATUS_STORE_MIN_SIZE));
+	header->magic = STATUS_STORE_MAGIC;
+	header->version = STATUS_STORE_VERSION;
+	header->size = STATUS_STORE_MIN_SIZE;
+
+	status_store_setup(header, status_store_length(header->size), fd);
+}
+
+static void status_store_close(void)
+{
+	if (store.listed)
+		g_hash_table_destroy(store.listed);
+
+	if (store.header == NULL) {
+		memset(&store, 0, sizeof(store));
+		return;
+	}
+
+	if (store.path)
+		msync(store.header, store.length, MS_ASYNC);
+
+	munmap(store.header, store.length);
+	g_free(store.path);
+
+	memset(&store, 0, sizeof(store));
+}
+
+static int status_store_get(int handle)
+{
+	struct status_entry *slot;
+
+	if (store.header == NULL || handle == 0)
+		return 0;
+
+	slot = status_store_slot(store.header, handle);
+	if (slot->handle == handle)
+		return slot->stat;
+
+	return GPOINTER_TO_INT(g_hash_table_lookup(store.listed,
+						GINT_TO_POINTER(handle)));
+}
+
+/* Drops the persistent entry of handle, if any */
+static void status_store_unpersist(int handle)
+{
+	struct status_entry *slot;
+
+	slot = status_store_slot(store.header, handle);
+	if (slot->handle == handle)
+		status_store_clear_slot(slot - store.entries);
+}
+
+static void status_store_set(int handle, int stat)
+{
+	struct status_entry *slot;
+
+	if (store.header == NULL || handle == 0)
+		return;
+
+	if (!(stat & MESSAGE_STAT_DELETED)) {
+		status_store_unpersist(handle);
+		g_hash_table_insert(store.listed, GINT_TO_POINTER(handle),
+							GINT_TO_POINTER(stat));
+		return;
+	}
+
+	g_hash_table_remove(store.listed, GINT_TO_POINTER(handle));
+
+	slot = status_store_slot(store.header, handle);
+	if (slot->handle == 0) {
+		/* Keep the load factor below 3/4 */
+		if ((store.header->used + 1) * 4 > store.header->size * 3) {
+			if (status_store_grow() < 0) {
+				error("Unable to grow the status store, "
+					"deleted state of %d not kept",
+					handle);
+				return;
+			}
+
+			slot = status_store_slot(store.header, handle);
+		}
+
+		slot->handle = handle;
+		store.header->used++;
+	}
+
+	if (!(slot->stat & MESSAGE_STAT_DELETED))
+		store.header->deleted++;
+
+	slot->stat = stat;
+}
+
+/* The message is gone from tracker, nothing to remember about it */
+static void status_store_forget(int handle)
+{
+	if (store.header == NULL || handle == 0)
+		return;
+
+	status_store_unpersist(handle);
+	g_hash_table_remove(store.listed, GINT_TO_POINTER(handle));
+}
+
+/* Rule keeping messages of the virtual deleted folder out of a query, NULL
+ * if there are too many of them */
+static char *deleted2query(void)
+{
+	GString *rule;
+	const char *sep = "";
+	uint32_t i;
+
+	if (store.header == NULL || store.header->deleted == 0)
+		return g_strdup("");
+
+	if (store.header->deleted > STATUS_STORE_MAX_EXCLUDED)
+		return NULL;
+
+	rule = g_string_new("FILTER (xsd:string(?msg) NOT IN (");
+
+	for (i = 0; i < store.header->size; i++) {
+		if (!(store.entries[i].stat & MESSAGE_STAT_DELETED))
+			continue;
+
+		g_string_append_printf(rule, "%s\"message:%d\"", sep,
+						store.entries[i].handle);
+		sep = ", ";
+	}
+
+	g_string_append(rule, ")) . ");
+
+	return g_string_free(rule, FALSE);
+}
+
+/* Sessions keep their own read status, everything else is shared */
+static int message_stat(struct session *session, int handle)
+{
+	int stat, shared;
+
+	shared = status_store_get(handle);
+
+	stat = GPOINTER_TO_INT(g_hash_table_lookup(session->msg_stat,
+						GINT_TO_POINTER(handle)));
+	if (stat == 0)
+		return shared;
+
+	return (stat & ~MESSAGE_STAT_DELETED) |
+					(shared & MESSAGE_STAT_DELETED);
 }
 
 static void free_msg_data(struct messages_message *msg)
@@ -234,6 +777,280 @@ static void free_msg_data(struct messages_message *msg)
 	g_free(msg);
 }
 
+static struct listing_cache *listing_cache_find(
+					const struct message_folder *folder)
+{
+	struct listing_cache *cache;
+
+	if (!listing_cache_enabled)
+		return NULL;
+
+	for (cache = listing_caches; cache->name != NULL; cache++) {
+		if (g_strcmp0(cache->name, folder->name) != 0)
+			continue;
+
+		return cache->overflow ? NULL : cache;
+	}
+
+	return NULL;
+}
+
+/* Rebuilt on the next listing, used when a change may have been missed */
+static void listing_caches_reset(void)
+{
+	struct listing_cache *cache;
+
+	for (cache = listing_caches; cache->name != NULL; cache++)
+		listing_cache_drop(cache);
+}
+
+static void listing_caches_remove(int handle)
+{
+	struct listing_cache *cache;
+
+	for (cache = listing_caches; cache->name != NULL; cache++)
+		listing_cache_remove(cache, handle);
+}
+
+static void listing_caches_set_read(int handle, gboolean read)
+{
+	struct listing_cache *cache;
+
+	for (cache = listing_caches; cache->name != NULL; cache++)
+		listing_cache_set_read(cache, handle, read);
+}
+
+static void message_cache_entry_free(struct message_cache_entry *entry)
+{
+	g_free(entry->text);
+	g_free(entry);
+}
+
+/* Read and deleted state a bMessage is rendered with in this session */
+static int message_render_stat(struct session *session, int handle,
+								gboolean read)
+{
+	int stat;
+
+	stat = message_stat(session, handle);
+
+	/* Only a status set during this session overrides tracker */
+	if (g_hash_table_lookup(session->msg_stat,
+					GINT_TO_POINTER(handle)) == NULL) {
+		stat &= ~MESSAGE_STAT_READ;
+		if (read)
+			stat |= MESSAGE_STAT_READ;
+	}
+
+	return stat & (MESSAGE_STAT_READ | MESSAGE_STAT_DELETED);
+}
+
+static const char *message_cache_lookup(struct session *session, int handle,
+							unsigned long flags)
+{
+	struct message_cache_entry *entry;
+	GList *l;
+
+	for (l = message_cache->head; l != NULL; l = l->next) {
+		entry = l->data;
+
+		if (entry->handle != handle || entry->flags != flags)
+			continue;
+
+		/* Rendered for a session that sees another status */
+		if (message_render_stat(session, handle, entry->read) !=
+								entry->stat)
+			return NULL;
+
+		g_queue_unlink(message_cache, l);
+		g_queue_push_head_link(message_cache, l);
+
+		return entry->text;
+	}
+
+	return NULL;
+}
+
+static void message_cache_remove(int handle)
+{
+	GList *l, *next;
+
+	for (l = message_cache->head; l != NULL; l = next) {
+		struct message_cache_entry *entry = l->data;
+
+		next = l->next;
+
+		if (entry->handle != handle)
+			continue;
+
+		message_cache_entry_free(entry);
+		g_queue_delete_link(message_cache, l);
+	}
+}
+
+static void message_cache_clear(void)
+{
+	g_queue_foreach(message_cache, (GFunc) message_cache_entry_free, NULL);
+	g_queue_clear(message_cache);
+}
+
+static void message_cache_add(int handle, unsigned long flags,
+				gboolean read, int stat, const char *text)
+{
+	struct message_cache_entry *entry;
+
+	message_cache_remove(handle);
+
+	entry = g_new0(struct message_cache_entry, 1);
+	entry->handle = handle;
+	entry->flags = flags;
+	entry->read = read;
+	entry->stat = stat;
+	entry->text = g_strdup(text);
+
+	g_queue_push_head(message_cache, entry);
+
+	if (g_queue_get_length(message_cache) > MESSAGE_CACHE_SIZE)
+		message_cache_entry_free(g_queue_pop_tail(message_cache));
+}
+
+static struct message_stream *message_stream_new(struct bmsg *bmsg,
+								gboolean fmore)
+{
+	struct message_stream *stream;
+	const char *content;
+
+	stream = g_new0(struct message_stream, 1);
+	stream->bmsg = bmsg;
+	stream->fmore = fmore;
+	stream->head = g_string_new("");
+	stream->tail = g_string_new("");
+
+	content = bmsg_text_parts(bmsg, stream->head, stream->tail);
+	if (content == NULL)
+		content = "";
+
+	stream->parts[0] = stream->head->str;
+	stream->lens[0] = stream->head->len;
+	stream->parts[1] = content;
+	stream->lens[1] = strlen(content);
+	stream->parts[2] = stream->tail->str;
+	stream->lens[2] = stream->tail->len;
+
+	return stream;
+}
+
+static struct message_stream *message_stream_new_text(const char *text)
+{
+	struct message_stream *stream;
+
+	stream = g_new0(struct message_stream, 1);
+	stream->text = g_strdup(text);
+	stream->parts[0] = stream->text;
+	stream->lens[0] = strlen(text);
+
+	return stream;
+}
+
+static size_t message_stream_len(struct message_stream *stream)
+{
+	return stream->lens[0] + stream->lens[1] + stream->lens[2];
+}
+
+/* Whole rendering, for the cache */
+static char *message_stream_text(struct message_stream *stream)
+{
+	GString *text;
+	int i;
+
+	text = g_string_sized_new(message_stream_len(stream));
+
+	for (i = 0; i < 3; i++)
+		if (stream->lens[i] > 0)
+			g_string_append_len(text, stream->parts[i],
+							stream->lens[i]);
+
+	return g_string_free(text, FALSE);
+}
+
+/* Fills the chunk buffer, returns the number of bytes put in it */
+static size_t message_stream_fill(struct message_stream *stream)
+{
+	size_t len = 0;
+
+	while (len < MESSAGE_CHUNK_SIZE && stream->part < 3) {
+		size_t n = stream->lens[stream->part] - stream->offset;
+
+		n = MIN(n, MESSAGE_CHUNK_SIZE - len);
+		if (n > 0)
+			memcpy(stream->chunk + len,
+				stream->parts[stream->part] + stream->offset,
+				n);
+
+		len += n;
+		stream->offset += n;
+
+		if (stream->offset == stream->lens[stream->part]) {
+			stream->part++;
+			stream->offset = 0;
+		}
+	}
+
+	stream->chunk[len] = '\0';
+
+	return len;
+}
+
+static void message_stream_free(struct message_stream *stream)
+{
+	if (stream->bmsg)
+		bmsg_destroy(stream->bmsg);
+
+	if (stream->head)
+		g_string_free(stream->head, TRUE);
+
+	if (stream->tail)
+		g_string_free(stream->tail, TRUE);
+
+	g_free(stream->text);
+	g_free(stream);
+}
+
+static void free_request(struct request *request)
+{
+	g_free(request->name);
+	g_free(request->query);
+
+	if (request->stream)
+		message_stream_free(request->stream);
+
+	if (request->canc)
+		g_object_unref(request->canc);
+
+	if (request->idle)
+		g_source_remove(request->idle);
+
+	if (request->snapshot)
+		listing_index_unref(request->snapshot);
+
+	/* An unfinished build can't be published */
+	if (request->cache)
+		request->cache->building = FALSE;
+
+	if (request->build)
+		listing_index_unref(request->build);
+
+	if (request->filter) {
+		g_free(request->filter->period_begin);
+		g_free(request->filter->period_end);
+		g_free(request->filter->originator);
+		g_free(request->filter->recipient);
+		g_free(request->filter);
+	}
+
+	g_free(request);
+}
+
 static struct messages_filter *copy_messages_filter(
 					const struct messages_filter *orig)
 {
@@ -255,162 +1072,433 @@ static gboolean validate_handle(const char *h)
 	while(*h && *h >= '0' && *h <= '9')
 		h++;
 
-	return *h == '\0' ? TRUE : FALSE;
+	return *h == '\0' ? TRUE : FALSE;
+}
+
+static char *fill_handle(const char *handle)
+{
+	int fill_size;
+	char *fill, *ret;
+
+	if (handle == NULL)
+		return NULL;
+
+	fill_size = MESSAGE_HANDLE_SIZE - strlen(handle);
+	fill = g_strnfill(fill_size, '0');
+	ret = g_strdup_printf("%s%s", fill, handle);
+
+	g_free(fill);
+
+	return ret;
+}
+
+static char *strip_handle(const char *handle)
+{
+	const char *ptr_new = handle;
+
+	while (*ptr_new++ == '0') ;
+
+	return g_strdup(ptr_new - 1);
+}
+
+static const char **string_array_from_cursor(TrackerSparqlCursor *cursor,
+								int array_len)
+{
+	const char **result;
+	int i;
+
+	result = g_new0(const char *, array_len);
+
+	for (i = 0; i < array_len; ++i) {
+		TrackerSparqlValueType type;
+
+		type = tracker_sparql_cursor_get_value_type(cursor, i);
+
+		if (type == TRACKER_SPARQL_VALUE_TYPE_BLANK_NODE ||
+				type == TRACKER_SPARQL_VALUE_TYPE_UNBOUND)
+			result[i] = "";
+		else
+			result[i] = tracker_sparql_cursor_get_string(cursor, i,
+									NULL);
+	}
+
+	return result;
+}
+
+static void query_cursor_next_cb(GObject *source, GAsyncResult *result,
+							gpointer user_data)
+{
+	struct pending_query *pending = user_data;
+	TrackerSparqlCursor *cursor = TRACKER_SPARQL_CURSOR(source);
+	GError *gerr = NULL;
+	const char **node;
+	gboolean success;
+
+	success = tracker_sparql_cursor_next_finish(cursor, result, &gerr);
+
+	/* The request is already gone if it was aborted */
+	if (g_cancellable_is_cancelled(pending->cancellable)) {
+		if (gerr)
+			g_error_free(gerr);
+		goto done;
+	}
+
+	if (!success) {
+		if (gerr) {
+			error("cursor_next error: %s", gerr->message);
+			g_error_free(gerr);
+
+			/* Rows may have been lost, don't cache them */
+			listing_caches_reset();
+
+			if (pending->cancellable == contacts_canc)
+				contacts_failed = TRUE;
+		}
+
+		/* May free the request or start the next query */
+		pending->callback(NULL, pending->user_data);
+		goto done;
+	}
+
+	node = string_array_from_cursor(cursor, pending->num_fields);
+	pending->callback(node, pending->user_data);
+	g_free(node);
+
+	/* One row at a time, so the listing is sent while the query runs */
+	tracker_sparql_cursor_next_async(cursor, pending->cancellable,
+					query_cursor_next_cb, pending);
+
+	return;
+
+done:
+	g_object_unref(cursor);
+	g_object_unref(pending->cancellable);
+	g_free(pending);
+}
+
+/* Returns a cancellable owned by the caller to abort the query with */
+static GCancellable *query_tracker(const char *query, int num_fields,
+					reply_list_foreach_cb callback,
+					void *user_data, int *err)
+{
+	struct pending_query *pending;
+	TrackerSparqlCursor *cursor;
+	GCancellable *cancellable;
+	GError *gerr = NULL;
+
+	if (connection == NULL)
+		connection = tracker_sparql_connection_get_direct(NULL, &gerr);
+
+	if (connection == NULL) {
+		if (gerr) {
+			error("direct-connection error: %s", gerr->message);
+			g_error_free(gerr);
+		}
+
+		if (err)
+			*err = -EPERM;
+
+		return NULL;
+	}
+
+	cancellable = g_cancellable_new();
+
+	cursor = tracker_sparql_connection_query(connection, query,
+							cancellable, &gerr);
+	if (cursor == NULL) {
+		if (gerr) {
+			error("connection_query error: %s", gerr->message);
+			g_error_free(gerr);
+		}
+
+		g_object_unref(cancellable);
+
+		if (err)
+			*err = -EPERM;
+
+		return NULL;
+	}
+
+	pending = g_new0(struct pending_query, 1);
+	pending->callback = callback;
+	pending->user_data = user_data;
+	pending->num_fields = num_fields;
+	pending->cancellable = g_object_ref(cancellable);
+
+	tracker_sparql_cursor_next_async(cursor, cancellable,
+					query_cursor_next_cb, pending);
+
+	return cancellable;
+}
+
+/* In MESSAGE_* order */
+static const char *message_columns[QUERY_RESPONSE_SIZE] = {
+	"?msg ",
+	"nmo:messageSubject(?msg) ",
+	"nmo:sentDate(?msg) ",
+	"nmo:receivedDate(?msg) ",
+	"nco:fullname(?cont) ",
+	"nco:nameGiven(?cont) ",
+	"nco:nameFamily(?cont) ",
+	"nco:nameAdditional(?cont) ",
+	"nco:nameHonorificPrefix(?cont) ",
+	"nco:nameHonorificSuffix(?cont) ",
+	"nco:phoneNumber(?phone) ",
+	"nmo:isRead(?msg) ",
+	"nmo:isSent(?msg) ",
+	"nie:plainTextContent(?msg) ",
+	"nmo:communicationChannel(?msg) ",
+};
+
+/* Message query format selecting only the given columns, map receives the
+ * MESSAGE_* index of every returned field. Once the contacts are loaded
+ * the names are looked up by expand_row() instead of joined. */
+static char *message_query_format(uint32_t columns, const char *end,
+						uint8_t *map, int *count)
+{
+	GString *query = g_string_new("SELECT ");
+	int i;
+
+	*count = 0;
+
+	for (i = 0; i < QUERY_RESPONSE_SIZE; i++) {
+		if (!(columns & (1 << i)))
+			continue;
+
+		if (contacts != NULL && (1 << i) & MESSAGE_CONTACT_COLUMNS)
+			continue;
+
+		g_string_append(query, message_columns[i]);
+		map[(*count)++] = i;
+	}
+
+	if (contacts != NULL && columns & MESSAGE_CONTACT_COLUMNS) {
+		g_string_append(query, "?lphone ");
+		map[(*count)++] = MESSAGE_LOCAL_PHONE;
+	}
+
+	g_string_append(query, MESSAGES_QUERY_PATTERN);
+
+	if (contacts == NULL && columns & MESSAGE_CONTACT_COLUMNS)
+		g_string_append(query, MESSAGES_CONTACT_PATTERN);
+
+	g_string_append(query, end);
+
+	return g_string_free(query, FALSE);
 }
 
-static char *fill_handle(const char *handle)
+static char *count_query_format(uint32_t columns)
 {
-	int fill_size;
-	char *fill, *ret;
+	GString *query = g_string_new(COUNT_MESSAGES_SELECT);
 
-	if (handle == NULL)
-		return NULL;
+	g_string_append(query, MESSAGES_QUERY_PATTERN);
 
-	fill_size = MESSAGE_HANDLE_SIZE - strlen(handle);
-	fill = g_strnfill(fill_size, '0');
-	ret = g_strdup_printf("%s%s", fill, handle);
+	if (contacts == NULL && columns & MESSAGE_CONTACT_COLUMNS)
+		g_string_append(query, MESSAGES_CONTACT_PATTERN);
 
-	g_free(fill);
+	g_string_append(query, COUNT_MESSAGES_UNREAD);
 
-	return ret;
+	return g_string_free(query, FALSE);
 }
 
-static char *strip_handle(const char *handle)
+static char *folder2query(const struct message_folder *folder,
+				const char *query, const char *user_rule)
 {
-	const char *ptr_new = handle;
+	return g_strdup_printf(query, folder->query, user_rule);
+}
 
-	while (*ptr_new++ == '0') ;
+/* Spreads a row over the MESSAGE_* indexes. Columns left out of the query
+ * read as unbound, contact names come from the local number. */
+static const char **expand_row(const char **reply, const uint8_t *columns,
+					int num_columns, const char **row)
+{
+	const struct contact *contact;
+	int i;
 
-	return g_strdup(ptr_new - 1);
+	for (i = 0; i < MESSAGE_ROW_SIZE; i++)
+		row[i] = "";
+
+	for (i = 0; i < num_columns; i++)
+		row[columns[i]] = reply[i];
+
+	if (contacts == NULL || row[MESSAGE_LOCAL_PHONE][0] == '\0')
+		return row;
+
+	contact = g_hash_table_lookup(contacts, row[MESSAGE_LOCAL_PHONE]);
+	if (contact == NULL || contact->uri == NULL)
+		return row;
+
+	for (i = 0; i < CONTACT_NAMES_LEN; i++)
+		row[MESSAGE_CONTACT_FN + i] = contact->names[i];
+
+	return row;
 }
 
-static char **string_array_from_iter(DBusMessageIter iter, int array_len)
+static void contact_free(gpointer data)
 {
-	DBusMessageIter sub;
-	char **result;
+	struct contact *contact = data;
 	int i;
 
-	if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
-		return NULL;
-
-	result = g_new0(char *, array_len + 1);
+	for (i = 0; i < CONTACT_NAMES_LEN; i++)
+		g_free(contact->names[i]);
 
-	dbus_message_iter_recurse(&iter, &sub);
+	g_free(contact->uri);
+	g_free(contact);
+}
 
-	i = 0;
-	while (dbus_message_iter_get_arg_type(&sub) != DBUS_TYPE_INVALID) {
-		char *arg;
+static gboolean contacts_reload(gpointer user_data);
 
-		if (dbus_message_iter_get_arg_type(&sub) != DBUS_TYPE_STRING) {
-			g_free(result);
+static void contacts_loaded(const char **reply, void *user_data)
+{
+	struct contact *contact;
+	gboolean reload;
+	int i;
 
-			return NULL;
-		}
+	if (reply != NULL)
+		goto add;
 
-		dbus_message_iter_get_basic(&sub, &arg);
+	g_object_unref(contacts_canc);
+	contacts_canc = NULL;
 
-		result[i++] = arg;
+	if (contacts_failed) {
+		g_hash_table_destroy(contacts_loading);
+		contacts_loading = NULL;
 
-		dbus_message_iter_next(&sub);
+		/* Keep the contacts we have until a load succeeds */
+		if (contacts_reload_id == 0)
+			contacts_reload_id = g_timeout_add_seconds(
+						CONTACTS_RETRY_DELAY,
+						contacts_reload, NULL);
+		return;
 	}
 
-	return result;
-}
+	reload = contacts != NULL;
+	if (reload)
+		g_hash_table_destroy(contacts);
 
-static void query_reply(DBusPendingCall *call, void *user_data)
-{
-	DBusMessage *reply = dbus_pending_call_steal_reply(call);
-	struct session *session = user_data;
-	DBusMessageIter iter, element;
-	DBusError derr;
+	contacts = contacts_loading;
+	contacts_loading = NULL;
 
-	dbus_error_init(&derr);
-	if (dbus_set_error_from_message(&derr, reply)) {
-		error("Replied with an error: %s, %s", derr.name, derr.message);
-		dbus_error_free(&derr);
+	DBG("%u contact numbers", g_hash_table_size(contacts));
 
-		goto done;
+	/* Names were resolved with the old contacts */
+	if (reload) {
+		listing_caches_reset();
+		message_cache_clear();
 	}
 
-	dbus_message_iter_init(reply, &iter);
+	return;
 
-	if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY) {
-		error("SparqlQuery reply is not an array");
+add:
+	contact = g_hash_table_lookup(contacts_loading,
+						reply[CONTACT_LOCAL_PHONE]);
+	if (contact != NULL) {
+		/* Like the query used to, only resolve unique numbers */
+		if (contact->uri != NULL &&
+				strcmp(contact->uri, reply[CONTACT_URI]) != 0) {
+			g_free(contact->uri);
+			contact->uri = NULL;
+		}
 
-		goto done;
+		return;
 	}
 
-	dbus_message_iter_recurse(&iter, &element);
+	contact = g_new0(struct contact, 1);
+	contact->uri = g_strdup(reply[CONTACT_URI]);
 
-	while (dbus_message_iter_get_arg_type(&element) != DBUS_TYPE_INVALID) {
-		char **node;
+	for (i = 0; i < CONTACT_NAMES_LEN; i++)
+		contact->names[i] = g_strdup(reply[CONTACT_NAMES + i]);
 
-		if (dbus_message_iter_get_arg_type(&element)
-							!= DBUS_TYPE_ARRAY) {
-			error("Element is not an array\n");
+	g_hash_table_insert(contacts_loading,
+				g_strdup(reply[CONTACT_LOCAL_PHONE]), contact);
+}
 
-			goto done;
-		}
+static void contacts_load(void)
+{
+	if (contacts_canc != NULL) {
+		g_cancellable_cancel(contacts_canc);
+		g_object_unref(contacts_canc);
+		g_hash_table_destroy(contacts_loading);
+	}
 
-		node = string_array_from_iter(element, QUERY_RESPONSE_SIZE);
+	contacts_loading = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, contact_free);
+	contacts_failed = FALSE;
 
-		if (node != NULL)
-			session->request->generate_response((const char **) node,
-								session);
+	contacts_canc = query_tracker(CONTACTS_QUERY, CONTACTS_RESPONSE_SIZE,
+					contacts_loaded, NULL, NULL);
+	if (contacts_canc != NULL)
+		return;
 
-		g_free(node);
+	g_hash_table_destroy(contacts_loading);
+	contacts_loading = NULL;
+}
 
-		dbus_message_iter_next(&element);
-	}
+static gboolean contacts_reload(gpointer user_data)
+{
+	contacts_reload_id = 0;
 
-done:
-	session->request->generate_response(NULL, session);
+	contacts_load();
 
-	dbus_message_unref(reply);
-	dbus_pending_call_unref(call);
+	return FALSE;
 }
 
-static DBusPendingCall *query_tracker(char *query, void *user_data, int *err)
+static gboolean handle_contacts_updated(DBusConnection *connection,
+					DBusMessage *msg, void *user_data)
 {
-	DBusPendingCall *call;
-	DBusMessage *msg;
+	DBusMessageIter iargs;
+	char *class;
 
-	msg = dbus_message_new_method_call(TRACKER_SERVICE,
-						TRACKER_RESOURCES_PATH,
-						TRACKER_RESOURCES_INTERFACE,
-						"SparqlQuery");
-	if (msg == NULL) {
-		if (err)
-			*err = -EPERM;
+	dbus_message_iter_init(msg, &iargs);
+	if (dbus_message_iter_get_arg_type(&iargs) != DBUS_TYPE_STRING)
+		return TRUE;
 
-		return NULL;
-	}
+	dbus_message_iter_get_basic(&iargs, &class);
+	if (!g_str_has_prefix(class, NCO_CLASS_PREFIX))
+		return TRUE;
 
-	dbus_message_append_args(msg, DBUS_TYPE_STRING, &query,
-							 DBUS_TYPE_INVALID);
+	/* Address book changes come in bursts, reload once they settle */
+	if (contacts_reload_id == 0)
+		contacts_reload_id = g_timeout_add_seconds(
+						CONTACTS_RELOAD_DELAY,
+						contacts_reload, NULL);
 
-	if (dbus_connection_send_with_reply(session_connection, msg, &call,
-								-1) == FALSE) {
-		error("Could not send dbus message");
+	return TRUE;
+}
 
-		dbus_message_unref(msg);
-		if (err)
-			*err = -EPERM;
+/* Local numbers of the contacts whose names contain party, FALSE if
+ * there are too many to put in a query */
+static gboolean contacts_matching(const char *party, GSList **numbers)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	int count = 0;
 
-		return NULL;
-	}
+	*numbers = NULL;
 
-	dbus_pending_call_set_notify(call, query_reply, user_data, NULL);
+	g_hash_table_iter_init(&iter, contacts);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		struct contact *contact = value;
+		int given = MESSAGE_CONTACT_GIVEN - MESSAGE_CONTACT_FN;
+		int family = MESSAGE_CONTACT_FAMILY - MESSAGE_CONTACT_FN;
 
-	dbus_message_unref(msg);
+		if (contact->uri == NULL)
+			continue;
 
-	return call;
-}
+		if (strstr(contact->names[given], party) == NULL &&
+				strstr(contact->names[family], party) == NULL)
+			continue;
 
-static char *folder2query(const struct message_folder *folder,
-							const char *query)
-{
-	return g_strdup_printf(query, folder->query, "");
+		if (++count > CONTACTS_MAX_MATCHES) {
+			g_slist_free(*numbers);
+			*numbers = NULL;
+			return FALSE;
+		}
+
+		*numbers = g_slist_prepend(*numbers, key);
+	}
+
+	return TRUE;
 }
 
 static struct message_folder *get_folder(const char *folder)
@@ -543,106 +1631,30 @@ static char *message2folder(const struct messages_message *data)
 	return NULL;
 }
 
-static char *path2query(const char *folder, const char *query,
-							const char *user_rule)
-{
-	if (g_str_has_suffix(folder, "telecom/msg/inbox") == TRUE)
-		return g_strdup_printf(query, "?msg nmo:isSent \"false\" ; "
-					"nmo:isDeleted \"false\" ; "
-					"nmo:isDraft \"false\". ", user_rule);
-
-	if (g_str_has_suffix(folder, "telecom/msg/sent") == TRUE)
-		return g_strdup_printf(query, "?msg nmo:isSent \"true\" ; "
-				"nmo:isDeleted \"false\" . ", user_rule);
-
-	if (g_str_has_suffix(folder, "telecom/msg/deleted") == TRUE)
-		return g_strdup_printf(query, "?msg nmo:isDeleted \"true\" . ",
-					user_rule);
-
-	if (g_str_has_suffix(folder, "telecom/msg") == TRUE)
-		return g_strdup_printf(query, "", user_rule);
-
-	return NULL;
-}
-
-static gboolean filter_message(struct messages_message *message,
-						struct messages_filter *filter)
+/* Columns needed to fill in what the client asked for and to evaluate
+ * the filter, the contact names being by far the most expensive ones */
+static uint32_t listing_columns(const struct messages_filter *filter)
 {
-	if (filter->type != 0) {
-		if (g_strcmp0(message->type, "SMS_GSM") == 0 &&
-				(filter->type & 0x01))
-			return FALSE;
-
-		if (g_strcmp0(message->type, "SMS_CDMA") == 0 &&
-				(filter->type & 0x02))
-			return FALSE;
-
-		if (g_strcmp0(message->type, "SMS_EMAIL") == 0 &&
-				(filter->type & 0x04))
-			return FALSE;
-
-		if (g_strcmp0(message->type, "SMS_MMS") == 0 &&
-				(filter->type & 0x08))
-			return FALSE;
-	}
-
-	if (filter->read_status != 0) {
-		if (filter->read_status == 0x01 && message->read != FALSE)
-			return FALSE;
-
-		if (filter->read_status == 0x02 && message->read != TRUE)
-			return FALSE;
-	}
-
-	if (filter->priority != 0) {
-		if (filter->priority == 0x01 && message->priority == FALSE)
-			return FALSE;
+	uint32_t columns = LISTING_COLUMNS;
+	uint16_t mask = filter->parameter_mask;
 
-		if (filter->priority == 0x02 && message->priority == TRUE)
-			return FALSE;
-	}
-
-	if (filter->period_begin != NULL &&
-			g_strcmp0(filter->period_begin, message->datetime) > 0)
-		return FALSE;
-
-	if (filter->period_end != NULL &&
-			g_strcmp0(filter->period_end, message->datetime) < 0)
-		return FALSE;
-
-	if (filter->originator != NULL) {
-		char *orig = g_strdup_printf("*%s*", filter->originator);
-
-		if (g_pattern_match_simple(orig,
-					message->sender_addressing != NULL ?
-					message->sender_addressing : "") == FALSE &&
-				g_pattern_match_simple(orig,
-					message->sender_name != NULL ?
-					message->sender_name : "") == FALSE) {
-			g_free(orig);
-			return FALSE;
-		}
-		g_free(orig);
-	}
+	if (mask & PMASK_SUBJECT)
+		columns |= 1 << MESSAGE_SUBJECT | 1 << MESSAGE_CONTENT;
 
-	if (filter->recipient != NULL) {
-		char *recip = g_strdup_printf("*%s*", filter->recipient);
+	if (mask & PMASK_SIZE)
+		columns |= 1 << MESSAGE_CONTENT;
 
-		if (g_pattern_match_simple(recip,
-					message->recipient_addressing != NULL ?
-					message->recipient_addressing : "") ==
-					FALSE &&
-				g_pattern_match_simple(recip,
-					message->recipient_name != NULL ?
-					message->recipient_name : "") == FALSE) {
-			g_free(recip);
-			return FALSE;
-		}
+	if (mask & PMASK_DATETIME || filter->period_begin != NULL ||
+						filter->period_end != NULL)
+		columns |= 1 << MESSAGE_RDATE;
 
-		g_free(recip);
-	}
+	if (mask & (PMASK_SENDER_NAME | PMASK_RECIPIENT_NAME) ||
+			!messages_filter_party_any(filter->originator) ||
+			!messages_filter_party_any(filter->recipient))
+		columns |= 1 << MESSAGE_CONTACT_GIVEN |
+					1 << MESSAGE_CONTACT_FAMILY;
 
-	return TRUE;
+	return columns;
 }
 
 static struct phonebook_contact *pull_message_contact(const char **reply,
@@ -760,94 +1772,339 @@ static struct messages_message *pull_message_data(const char **reply)
 	data->protect = FALSE;
 	data->mask |= PMASK_PROTECTED;
 
-	return data;
+	return data;
+}
+
+/* Counts a message of the listing and hands it out if it falls into the
+ * requested window, msg_data itself is left untouched */
+static void listing_add_message(struct session *session,
+				const struct messages_message *msg_data,
+				int ihandle)
+{
+	struct request *request = session->request;
+	struct messages_message msg = *msg_data;
+	int stat;
+
+	if (g_hash_table_lookup(session->msg_stat,
+					GINT_TO_POINTER(ihandle)) == NULL) {
+		/* Tracker is authoritative for the read and sent state, the
+		 * deleted state only lives in the status store */
+		stat = status_store_get(ihandle) & MESSAGE_STAT_DELETED;
+		stat |= MESSAGE_STAT_EMPTY;
+		if(msg.read)
+			stat |= MESSAGE_STAT_READ;
+
+		if(msg.sent)
+			stat |= MESSAGE_STAT_SENT;
+
+		status_store_set(ihandle, stat);
+	} else {
+		stat = message_stat(session, ihandle);
+		msg.read = stat & MESSAGE_STAT_READ ? TRUE : FALSE;
+	}
+
+	if (request->deleted && !(stat & MESSAGE_STAT_DELETED))
+		return;
+
+	if (!request->deleted && stat & MESSAGE_STAT_DELETED)
+		return;
+
+	/* Rows are pre-filtered by the query, this catches the rules SPARQL
+	 * can't express and read status changed during the session */
+	if (!messages_filter_match(&msg, request->filter))
+		return;
+
+	request->size++;
+
+	if (!msg.read)
+		request->new_message = TRUE;
+
+	if (request->count == TRUE)
+		return;
+
+	if (request->size > request->offset &&
+			(request->size - request->offset) <= request->max)
+		request->cb.messages_list(session, -EAGAIN, 1,
+						request->new_message, &msg,
+						request->user_data);
+}
+
+static void listing_finish(struct session *session)
+{
+	struct request *request = session->request;
+
+	/* A paged query only returned the requested window */
+	if (request->query != NULL)
+		request->size = request->total;
+
+	request->cb.messages_list(session, 0, request->size - request->offset,
+						request->new_message, NULL,
+						request->user_data);
+
+	free_request(request);
+
+	session->request = NULL;
+}
+
+static void listing_build_publish(struct request *request)
+{
+	struct listing_cache *cache = request->cache;
+
+	request->cache = NULL;
+
+	if (listing_cache_publish(cache, request->build, request->changes))
+		DBG("%s: %u messages cached", cache->name,
+					listing_index_size(cache->index));
+
+	request->build = NULL;
+}
+
+static void get_messages_listing_resp(const char **reply, void *user_data)
+{
+	struct session *session = user_data;
+	struct request *request = session->request;
+	struct messages_message *msg_data;
+	const char *row[MESSAGE_ROW_SIZE];
+	int ihandle, igrp;
+
+	DBG("reply %p", reply);
+
+	if (reply == NULL)
+		goto end;
+
+	reply = expand_row(reply, request->columns, request->num_columns, row);
+
+	msg_data = pull_message_data(reply);
+
+	ihandle = g_ascii_strtoll(msg_data->handle, NULL, 10);
+	igrp = g_ascii_strtoll(reply[MESSAGE_GROUP] + MESSAGE_GRP_PREFIX_LEN,
+								NULL, 10);
+
+	message_groups_add(msg_groups, ihandle, igrp);
+
+	listing_add_message(session, msg_data, ihandle);
+
+	if (request->build == NULL)
+		goto done;
+
+	if (listing_index_size(request->build) < LISTING_CACHE_MAX) {
+		listing_index_insert(request->build, msg_data, ihandle,
+							reply[MESSAGE_SDATE]);
+		return;
+	}
+
+	/* Too big to keep around, later listings get paged instead */
+	DBG("%s: too many messages to cache", request->cache->name);
+	request->cache->overflow = TRUE;
+	listing_index_unref(request->build);
+	request->build = NULL;
+
+done:
+	free_msg_data(msg_data);
+	return;
+
+end:
+	if (request->cache != NULL)
+		listing_build_publish(request);
+
+	listing_finish(session);
+}
+
+static gboolean listing_cache_serve(gpointer user_data)
+{
+	struct session *session = user_data;
+	struct request *request = session->request;
+	GSequenceIter *iter;
+
+	request->idle = 0;
+
+	iter = g_sequence_get_begin_iter(request->snapshot->entries);
+	for (; !g_sequence_iter_is_end(iter);
+				iter = g_sequence_iter_next(iter)) {
+		struct listing_entry *entry = g_sequence_get(iter);
+
+		listing_add_message(session, entry->msg, entry->handle);
+	}
+
+	listing_finish(session);
+
+	return FALSE;
+}
+
+static void listing_update_resp(const char **reply, void *user_data)
+{
+	struct listing_update *update = user_data;
+	struct listing_cache *cache = update->cache;
+	struct messages_message *msg_data;
+	const char *row[MESSAGE_ROW_SIZE];
+	int ihandle, igrp;
+
+	if (reply == NULL) {
+		listing_updates = g_slist_remove(listing_updates, update);
+		g_object_unref(update->canc);
+		g_free(update);
+		return;
+	}
+
+	reply = expand_row(reply, update->columns, update->num_columns, row);
+
+	msg_data = pull_message_data(reply);
+
+	ihandle = g_ascii_strtoll(msg_data->handle, NULL, 10);
+	igrp = g_ascii_strtoll(reply[MESSAGE_GROUP] + MESSAGE_GRP_PREFIX_LEN,
+								NULL, 10);
+
+	message_groups_add(msg_groups, ihandle, igrp);
+
+	if (!listing_cache_update(cache, update->removals, msg_data, ihandle,
+						reply[MESSAGE_SDATE]))
+		free_msg_data(msg_data);
+}
+
+/* Looks the message up again in every cached folder it may belong to */
+static void listing_caches_update(const char *handle)
+{
+	struct listing_cache *cache;
+	struct listing_update *update;
+	char *rule, *format, *query;
+	int ihandle;
+
+	ihandle = g_ascii_strtoll(handle, NULL, 10);
+	rule = g_strdup_printf(MESSAGES_FILTER_BY_HANDLE, handle);
+
+	for (cache = listing_caches; cache->name != NULL; cache++) {
+		if (!listing_cache_invalidate(cache, ihandle))
+			continue;
+
+		update = g_new0(struct listing_update, 1);
+		update->cache = cache;
+		update->removals = cache->removals;
+
+		format = message_query_format(MESSAGE_ALL_COLUMNS,
+						LIST_MESSAGES_ORDER,
+						update->columns,
+						&update->num_columns);
+		query = folder2query(cache->folder, format, rule);
+		update->canc = query_tracker(query, update->num_columns,
+						listing_update_resp, update,
+						NULL);
+		g_free(format);
+		g_free(query);
+
+		if (update->canc == NULL) {
+			g_free(update);
+			listing_cache_drop(cache);
+			continue;
+		}
+
+		listing_updates = g_slist_prepend(listing_updates, update);
+	}
+
+	g_free(rule);
+}
+
+static void session_query_resp(const char **reply, void *user_data)
+{
+	struct session *session = user_data;
+
+	session->request->generate_response(reply, session);
 }
 
-static void get_messages_listing_resp(const char **reply, void *user_data)
+static void get_messages_count_resp(const char **reply, void *user_data)
 {
 	struct session *session = user_data;
 	struct request *request = session->request;
-	struct messages_message *msg_data;
-	int stat, ihandle, igrp, *group;
-	unsigned i;
+	int err = 0;
 
 	DBG("reply %p", reply);
 
-	if (reply == NULL)
-		goto end;
+	if (reply != NULL) {
+		request->total = strtoul(reply[COUNT_TOTAL], NULL, 10);
+		request->new_message = strtoul(reply[COUNT_UNREAD], NULL, 10) ?
+								TRUE : FALSE;
+		return;
+	}
 
-	msg_data = pull_message_data(reply);
+	if (request->count || request->total <= request->offset)
+		goto done;
 
-	ihandle = g_ascii_strtoll(msg_data->handle, NULL, 10);
-	igrp = g_ascii_strtoll(reply[MESSAGE_GROUP] + MESSAGE_GRP_PREFIX_LEN,
-								NULL, 10);
+	/* Rows come back starting at the offset */
+	request->size = request->offset;
+	request->generate_response = get_messages_listing_resp;
+	g_object_unref(request->canc);
+	request->canc = query_tracker(request->query, request->num_columns,
+					session_query_resp, session, &err);
+	if (request->canc != NULL)
+		return;
 
-	for (i = 0; i < msg_grp->len; i++) {
-		if (ihandle == g_array_index(msg_grp, int *, i)[1])
-			goto already_exists;
-	}
+done:
+	request->cb.messages_list(session, err,
+					request->total - request->offset,
+					request->new_message, NULL,
+					request->user_data);
 
-	group = g_new0(int, 2);
-	group[0] = igrp;
-	group[1] = ihandle;
-	g_array_append_val(msg_grp, group);
+	free_request(request);
 
-already_exists:
-	stat = GPOINTER_TO_INT(g_hash_table_lookup(session->msg_stat,
-						GINT_TO_POINTER(ihandle)));
-	if (stat == 0) {
-		stat = MESSAGE_STAT_EMPTY;
-		if(msg_data->read)
-			stat |= MESSAGE_STAT_READ;
+	session->request = NULL;
+}
 
-		if(msg_data->sent)
-			stat |= MESSAGE_STAT_SENT;
+/* Hands out the next chunk of the bMessage, or ends the request once all of
+ * it is out. The transport asks for more with messages_get_message_next(). */
+static gboolean message_stream_next(gpointer user_data)
+{
+	struct session *session = user_data;
+	struct request *request = session->request;
+	struct message_stream *stream = request->stream;
 
-		g_hash_table_insert(session->msg_stat, GINT_TO_POINTER(ihandle),
-							GINT_TO_POINTER(stat));
-	} else {
-		msg_data->read = stat & MESSAGE_STAT_READ ? TRUE : FALSE;
-	}
+	request->idle = 0;
 
-	if (request->deleted && !(stat & MESSAGE_STAT_DELETED))
-		goto done;
+	if (message_stream_fill(stream) > 0) {
+		request->cb.message(session, -EAGAIN, stream->fmore,
+					stream->chunk, request->user_data);
+		return FALSE;
+	}
 
-	if (!request->deleted && stat & MESSAGE_STAT_DELETED)
-		goto done;
+	request->cb.message(session, 0, stream->fmore, NULL,
+							request->user_data);
 
-	request->size++;
+	free_request(request);
 
-	if (!msg_data->read)
-		request->new_message = TRUE;
+	session->request = NULL;
 
-	if (request->count == TRUE)
-		goto done;
+	return FALSE;
+}
 
-	if (request->size > request->offset &&
-			filter_message(msg_data, request->filter) &&
-			(request->size - request->offset) <= request->max)
-		request->cb.messages_list(session, -EAGAIN, 1,
-						request->new_message, msg_data,
-						request->user_data);
+/* Cuts the requested fraction out of content, without splitting a UTF-8
+ * sequence, and remembers where the next one starts */
+static char *message_fraction(struct session *session, int handle,
+				struct request *request, const char *content,
+				gboolean *fmore)
+{
+	size_t len, start, end;
 
-done:
-	free_msg_data(msg_data);
-	return;
+	len = strlen(content);
+	start = MIN(request->fraction, len);
+	end = start + MESSAGE_FRACTION_SIZE;
 
-end:
-	request->cb.messages_list(session, 0, request->size - request->offset,
-						request->new_message, NULL,
-						request->user_data);
+	if (end >= len) {
+		end = len;
+		*fmore = FALSE;
+	} else {
+		while (end > start + 1 && (content[end] & 0xc0) == 0x80)
+			end--;
 
-	g_free(request->filter->period_begin);
-	g_free(request->filter->period_end);
-	g_free(request->filter->originator);
-	g_free(request->filter->recipient);
-	g_free(request->filter);
+		*fmore = TRUE;
+	}
 
-	g_free(request);
+	if (*fmore) {
+		session->fraction_handle = handle;
+		session->fraction_offset = end;
+		session->fraction_part = request->part_id;
+	} else {
+		session->fraction_handle = 0;
+	}
 
-	session->request = NULL;
+	return g_strndup(content + start, end - start);
 }
 
 static void get_message_resp(const char **reply, void *s)
@@ -856,26 +2113,33 @@ static void get_message_resp(const char **reply, void *s)
 	struct request *request = session->request;
 	struct messages_message *msg_data;
 	struct bmsg *bmsg;
-	char *final_bmsg, *status, *folder, *handle;
+	char *text, *status, *folder, *handle, *fraction = NULL;
+	const char *content;
 	struct phonebook_contact *contact;
-	int err, stat, ihandle;
+	const char *row[MESSAGE_ROW_SIZE];
+	gboolean read, fmore = FALSE;
+	int stat, ihandle, part_id = -1;
 
 	DBG("reply %p", reply);
 
 	if (reply == NULL)
 		goto done;
 
+	/* The query is limited to a single row */
+	if (request->stream != NULL)
+		return;
+
+	reply = expand_row(reply, request->columns, request->num_columns, row);
+
 	msg_data = pull_message_data(reply);
 
 	contact = pull_message_contact(reply, msg_data->sent);
 
 	ihandle = g_ascii_strtoll(msg_data->handle, NULL, 10);
-	stat = GPOINTER_TO_INT(g_hash_table_lookup(session->msg_stat,
-						GINT_TO_POINTER(ihandle)));
-	if (stat & MESSAGE_STAT_READ)
-		msg_data->read = TRUE;
-	else if (stat != 0)
-		msg_data->read = FALSE;
+
+	read = msg_data->read;
+	stat = message_render_stat(session, ihandle, read);
+	msg_data->read = stat & MESSAGE_STAT_READ ? TRUE : FALSE;
 
 	status = msg_data->read ? "READ" : "UNREAD";
 
@@ -888,6 +2152,15 @@ static void get_message_resp(const char **reply, void *s)
 	g_free(msg_data->handle);
 	msg_data->handle = handle;
 
+	content = reply[MESSAGE_CONTENT];
+
+	if (request->flags & MESSAGES_FRACTION) {
+		fraction = message_fraction(session, ihandle, request, content,
+									&fmore);
+		content = fraction;
+		part_id = request->part_id;
+	}
+
 	bmsg = g_new0(struct bmsg, 1);
 	bmsg_init(bmsg, BMSG_VERSION_1_0, status, BMSG_SMS, folder);
 
@@ -899,16 +2172,22 @@ static void get_message_resp(const char **reply, void *s)
 	if (msg_data->sent)
 		bmsg_add_recipient(bmsg, contact);
 
-	bmsg_add_content(bmsg, -1, NULL, SMS_DEFAULT_CHARSET, NULL,
-						reply[MESSAGE_CONTENT]);
+	bmsg_add_content(bmsg, part_id, NULL, SMS_DEFAULT_CHARSET, NULL,
+								content);
 
-	final_bmsg = bmsg_text(bmsg);
+	request->stream = message_stream_new(bmsg, fmore);
 
-	request->cb.message(session, 0, FALSE, final_bmsg, request->user_data);
+	/* Fractions are rendered per request, big messages aren't kept */
+	if (!(request->flags & MESSAGES_FRACTION) &&
+			message_stream_len(request->stream) <=
+						MESSAGE_CACHE_MAX_TEXT) {
+		text = message_stream_text(request->stream);
+		message_cache_add(ihandle, request->flags, read, stat, text);
+		g_free(text);
+	}
 
-	bmsg_destroy(bmsg);
+	g_free(fraction);
 	g_free(folder);
-	g_free(final_bmsg);
 	free_msg_data(msg_data);
 	phonebook_contact_free(contact);
 
@@ -917,15 +2196,14 @@ static void get_message_resp(const char **reply, void *s)
 	return;
 
 done:
-	if (request->count == 0)
-		err = -ENOENT;
-	else
-		err = 0;
+	if (request->count > 0) {
+		message_stream_next(session);
+		return;
+	}
 
-	request->cb.message(session, err, FALSE, NULL, request->user_data);
+	request->cb.message(session, -ENOENT, FALSE, NULL, request->user_data);
 
-	g_free(request->name);
-	g_free(request);
+	free_request(request);
 
 	session->request = NULL;
 }
@@ -937,9 +2215,8 @@ static void session_dispatch_event(struct session *session,
 
 	if (event->type == MET_MESSAGE_DELETED) {
 		ihandle = g_ascii_strtoll(event->handle, NULL, 10);
-		if (!g_hash_table_lookup_extended(session->msg_stat,
-						GINT_TO_POINTER(ihandle),
-						NULL, (gpointer) &stat))
+		stat = message_stat(session, ihandle);
+		if (stat == 0)
 			return;
 
 		direction = DIRECTION_INBOUND;
@@ -960,12 +2237,10 @@ static void session_dispatch_event(struct session *session,
 	}
 
 	if (session->op_in_progress) {
-		struct messages_event *data;
-
-		messages_event_ref(data);
+		messages_event_ref(event);
 		session->mns_event_cache = g_slist_append(
 						session->mns_event_cache,
-						data);
+						event);
 
 		DBG("Event cached");
 	} else {
@@ -1065,6 +2340,9 @@ static gboolean handle_new_sms(DBusConnection * connection, DBusMessage * msg,
 
 		handle = g_strdup_printf("%d", ihandle);
 
+		/* Sent messages show up in the sent folder */
+		listing_caches_update(handle);
+
 		dbus_message_iter_next(&struct_arg); /* Type */
 		dbus_message_iter_next(&struct_arg); /* StartTime */
 		dbus_message_iter_next(&struct_arg); /* EndTime */
@@ -1090,23 +2368,58 @@ done:
 	return TRUE;
 }
 
-static void notify_del_sms(const char *handle)
+static gboolean handle_upd_sms(DBusConnection * connection, DBusMessage * msg,
+							void *user_data)
 {
-	unsigned i;
-	int ihandle = g_ascii_strtoll(handle, NULL, 10);
+	DBusMessageIter arg, inner_arg, struct_arg;
+	int32_t ihandle;
+	char *handle;
 
-	notify_new_sms(handle, MET_MESSAGE_DELETED);
+	DBG("");
+
+	if (!dbus_message_iter_init(msg, &arg))
+		return TRUE;
+
+	if (dbus_message_iter_get_arg_type(&arg) != DBUS_TYPE_ARRAY)
+		return TRUE;
 
-	for (i = 0; i < msg_grp->len; i++) {
-		int *data = g_array_index(msg_grp, int *, i);
+	dbus_message_iter_recurse(&arg, &inner_arg);
 
-		if (ihandle == data[1]) {
-			g_free(data);
-			msg_grp = g_array_remove_index_fast(msg_grp, i);
+	for ( ; dbus_message_iter_get_arg_type(&inner_arg) != DBUS_TYPE_INVALID;
+					dbus_message_iter_next(&inner_arg)) {
 
-			break;
-		}
+		if (dbus_message_iter_get_arg_type(&inner_arg)
+							!= DBUS_TYPE_STRUCT)
+			continue;
+
+		dbus_message_iter_recurse(&inner_arg, &struct_arg);
+
+		if (dbus_message_iter_get_arg_type(&struct_arg) !=
+							DBUS_TYPE_INT32)
+			continue;
+
+		dbus_message_iter_get_basic(&struct_arg, &ihandle);
+
+		handle = g_strdup_printf("%d", ihandle);
+
+		DBG("message updated: %s", handle);
+
+		listing_caches_update(handle);
+		message_cache_remove(ihandle);
+
+		g_free(handle);
 	}
+
+	return TRUE;
+}
+
+static void notify_del_sms(const char *handle)
+{
+	int ihandle = g_ascii_strtoll(handle, NULL, 10);
+
+	notify_new_sms(handle, MET_MESSAGE_DELETED);
+
+	message_groups_remove(msg_groups, ihandle);
 }
 
 static gboolean handle_del_sms(DBusConnection * connection, DBusMessage * msg,
@@ -1130,13 +2443,33 @@ static gboolean handle_del_sms(DBusConnection * connection, DBusMessage * msg,
 
 	DBG("message deleted: %s", handle);
 
+	listing_caches_remove(ihandle);
+	message_cache_remove(ihandle);
+
 	notify_del_sms(handle);
 
+	status_store_forget(ihandle);
+
 	g_free(handle);
 
 	return TRUE;
 }
 
+static void group_message_deleted(int ihandle, void *user_data)
+{
+	char *handle = g_strdup_printf("%d", ihandle);
+
+	DBG("message deleted: %s", handle);
+
+	notify_new_sms(handle, MET_MESSAGE_DELETED);
+
+	listing_caches_remove(ihandle);
+	message_cache_remove(ihandle);
+	status_store_forget(ihandle);
+
+	g_free(handle);
+}
+
 static gboolean handle_del_grp(DBusConnection * connection, DBusMessage * msg,
 							void *user_data)
 {
@@ -1155,7 +2488,6 @@ static gboolean handle_del_grp(DBusConnection * connection, DBusMessage * msg,
 	for ( ; dbus_message_iter_get_arg_type(&array) != DBUS_TYPE_INVALID;
 					dbus_message_iter_next(&array)) {
 		int32_t grp;
-		unsigned i;
 
 		if (dbus_message_iter_get_arg_type(&array) != DBUS_TYPE_INT32)
 			return TRUE;
@@ -1164,24 +2496,8 @@ static gboolean handle_del_grp(DBusConnection * connection, DBusMessage * msg,
 
 		DBG("Group deleted: %d, searching for messages", grp);
 
-		for (i = 0; i < msg_grp->len; i++) {
-			int *data = g_array_index(msg_grp, int *, i);
-
-			if (grp == data[0]) {
-				char *handle = g_strdup_printf("%d", data[1]);
-
-				DBG("message deleted: %s", handle);
-
-				notify_new_sms(handle, MET_MESSAGE_DELETED);
-
-				g_free(data);
-				msg_grp = g_array_remove_index_fast(msg_grp, i);
-				/* last element becomes i-th */
-				i--;
-
-				g_free(handle);
-			}
-		}
+		message_groups_remove_group(msg_groups, grp,
+						group_message_deleted, NULL);
 	}
 
 	return TRUE;
@@ -1256,27 +2572,117 @@ int messages_init(void)
 	if (retrieve_message_id_tracker_id() < 0)
 		return -1;
 
-	msg_grp = g_array_new(FALSE, FALSE, sizeof(int *));
+	status_store_open();
+
+	message_cache = g_queue_new();
+
+	msg_groups = message_groups_new();
 
 	messages_qt_init();
 
 	create_folder_tree();
 
+	/* Watched all the time, the listing caches depend on them */
+	newmsg_watch_id = g_dbus_add_signal_watch(session_connection,
+						NULL, NULL,
+						"com.nokia.commhistory",
+						"eventsAdded",
+						handle_new_sms, NULL, NULL);
+	updmsg_watch_id = g_dbus_add_signal_watch(session_connection,
+						NULL, NULL,
+						"com.nokia.commhistory",
+						"eventsUpdated",
+						handle_upd_sms, NULL, NULL);
+	delmsg_watch_id = g_dbus_add_signal_watch(session_connection,
+						NULL, NULL,
+						"com.nokia.commhistory",
+						"eventDeleted",
+						handle_del_sms, NULL, NULL);
+	delgrp_watch_id = g_dbus_add_signal_watch(session_connection,
+						NULL, NULL,
+						"com.nokia.commhistory",
+						"groupsDeleted",
+						handle_del_grp, NULL, NULL);
+
+	if (newmsg_watch_id == 0 || updmsg_watch_id == 0 ||
+				delmsg_watch_id == 0 || delgrp_watch_id == 0)
+		error("Unable to watch CommHistory, listings are not cached");
+	else
+		listing_cache_enabled = TRUE;
+
+	/* Until the contacts are loaded the queries resolve names */
+	contacts_watch_id = g_dbus_add_signal_watch(session_connection,
+						NULL, NULL,
+						TRACKER_RESOURCES_INTERFACE,
+						"GraphUpdated",
+						handle_contacts_updated,
+						NULL, NULL);
+	if (contacts_watch_id != 0)
+		contacts_load();
+	else
+		error("Unable to watch contacts, tracker resolves names");
+
 	return 0;
 }
 
 void messages_exit(void)
 {
-	unsigned i;
+	GSList *l;
+
+	g_dbus_remove_watch(session_connection, newmsg_watch_id);
+	g_dbus_remove_watch(session_connection, updmsg_watch_id);
+	g_dbus_remove_watch(session_connection, delmsg_watch_id);
+	g_dbus_remove_watch(session_connection, delgrp_watch_id);
+	g_dbus_remove_watch(session_connection, contacts_watch_id);
+
+	if (contacts_reload_id != 0) {
+		g_source_remove(contacts_reload_id);
+		contacts_reload_id = 0;
+	}
+
+	if (contacts_canc != NULL) {
+		g_cancellable_cancel(contacts_canc);
+		g_object_unref(contacts_canc);
+		contacts_canc = NULL;
+		g_hash_table_destroy(contacts_loading);
+		contacts_loading = NULL;
+	}
+
+	if (contacts != NULL) {
+		g_hash_table_destroy(contacts);
+		contacts = NULL;
+	}
+
+	for (l = listing_updates; l != NULL; l = l->next) {
+		struct listing_update *update = l->data;
+
+		g_cancellable_cancel(update->canc);
+		g_object_unref(update->canc);
+		g_free(update);
+	}
+
+	g_slist_free(listing_updates);
+	listing_updates = NULL;
+
+	listing_caches_reset();
+	listing_cache_enabled = FALSE;
+
+	message_cache_clear();
+	g_queue_free(message_cache);
+	message_cache = NULL;
 
 	destroy_folder_tree(folder_tree);
 
 	dbus_connection_unref(session_connection);
 
-	for (i = 0; i < msg_grp->len; i++)
-		g_free(g_array_index(msg_grp, int *, i));
+	if (connection != NULL) {
+		g_object_unref(connection);
+		connection = NULL;
+	}
+
+	message_groups_free(msg_groups);
 
-	g_array_free(msg_grp, TRUE);
+	status_store_close();
 
 	messages_qt_exit();
 }
@@ -1317,29 +2723,6 @@ int messages_set_notification_registration(void *s, messages_event_cb cb,
 		if (g_slist_find(mns_srv, session) != NULL)
 			return 0;
 
-		if (g_slist_length(mns_srv) == 0) {
-			newmsg_watch_id = g_dbus_add_signal_watch(
-							session_connection,
-							NULL, NULL,
-							"com.nokia.commhistory",
-							"eventsAdded",
-							handle_new_sms,
-							NULL, NULL);
-			delmsg_watch_id = g_dbus_add_signal_watch(
-							session_connection,
-							NULL, NULL,
-							"com.nokia.commhistory",
-							"eventDeleted",
-							handle_del_sms,
-							NULL, NULL);
-			delgrp_watch_id = g_dbus_add_signal_watch(
-							session_connection,
-							NULL, NULL,
-							"com.nokia.commhistory",
-							"groupsDeleted",
-							handle_del_grp,
-							NULL, NULL);
-		}
 		if (newmsg_watch_id == 0 || delmsg_watch_id == 0 ||
 							delgrp_watch_id == 0)
 			return -EIO;
@@ -1350,15 +2733,6 @@ int messages_set_notification_registration(void *s, messages_event_cb cb,
 		mns_srv = g_slist_prepend(mns_srv, session);
 	} else {
 		mns_srv = g_slist_remove(mns_srv, session);
-
-		if (g_slist_length(mns_srv) == 0) {
-			g_dbus_remove_watch(session_connection,
-							newmsg_watch_id);
-			g_dbus_remove_watch(session_connection,
-							delmsg_watch_id);
-			g_dbus_remove_watch(session_connection,
-							delgrp_watch_id);
-		}
 	}
 
 	return 0;
@@ -1470,9 +2844,13 @@ int messages_get_messages_listing(void *s, const char *name,
 {
 	struct session *session = s;
 	struct request *request;
-	char *path, *query;
+	char *path, *query, *user_rule, *deleted_rule, *rule, *format;
 	struct message_folder *folder = NULL;
-	int err = 0;
+	struct listing_cache *cache;
+	messages_filter_numbers_func numbers = NULL;
+	uint32_t columns;
+	gboolean exact;
+	int fields, err = 0;
 
 	if (name == NULL || strlen(name) == 0) {
 		path = g_strdup(session->cwd);
@@ -1493,9 +2871,21 @@ int messages_get_messages_listing(void *s, const char *name,
 	if (folder == NULL)
 		return -EBADR;
 
-	query = folder2query(folder, LIST_MESSAGES_QUERY);
-	if (query == NULL)
-		return -ENOENT;
+	/* Once the contacts are cached, names are matched against them */
+	if (contacts != NULL)
+		numbers = contacts_matching;
+
+	/* Read status changed in this session isn't in tracker, so the rows
+	 * are read filtered and counted in C with the session's view */
+	if (filter->read_status != 0 &&
+				g_hash_table_size(session->msg_stat) > 0) {
+		struct messages_filter any_read = *filter;
+
+		any_read.read_status = 0;
+		user_rule = messages_filter_sparql(&any_read, numbers, &exact);
+		exact = FALSE;
+	} else
+		user_rule = messages_filter_sparql(filter, numbers, &exact);
 
 	request = g_new0(struct request, 1);
 
@@ -1515,7 +2905,84 @@ int messages_get_messages_listing(void *s, const char *name,
 		request->count = TRUE;
 	}
 
-	request->pc = query_tracker(query, session, &err);
+	cache = listing_cache_find(folder);
+
+	if (cache != NULL && cache->index != NULL) {
+		DBG("%s: listing from cache", cache->name);
+
+		request->snapshot = listing_index_ref(cache->index);
+		request->idle = g_idle_add(listing_cache_serve, session);
+
+		g_free(user_rule);
+
+		return 0;
+	}
+
+	if (cache != NULL && !cache->building) {
+		/* List the whole folder once and keep it for later */
+		format = message_query_format(MESSAGE_ALL_COLUMNS,
+						LIST_MESSAGES_ORDER,
+						request->columns,
+						&request->num_columns);
+		query = folder2query(folder, format, "");
+		g_free(format);
+
+		cache->folder = folder;
+		cache->building = TRUE;
+
+		request->cache = cache;
+		request->build = listing_index_new(
+					(GDestroyNotify) free_msg_data);
+		request->changes = cache->changes;
+
+		g_free(user_rule);
+
+		goto done;
+	}
+
+	columns = listing_columns(request->filter);
+	format = message_query_format(columns, LIST_MESSAGES_ORDER,
+							request->columns,
+							&request->num_columns);
+
+	query = folder2query(folder, format, user_rule);
+
+	/* The virtual deleted folder is only known locally, so its rows
+	 * have to be counted here unless the query can leave them out */
+	deleted_rule = deleted2query();
+	if (exact && !request->deleted && deleted_rule != NULL) {
+		rule = g_strconcat(user_rule, deleted_rule, NULL);
+
+		g_free(query);
+		query = folder2query(folder, format, rule);
+		request->query = g_strdup_printf("%s LIMIT %u OFFSET %u",
+						query, request->max,
+						request->offset);
+		request->generate_response = get_messages_count_resp;
+
+		g_free(format);
+		format = count_query_format(columns);
+
+		g_free(query);
+		query = folder2query(folder, format, rule);
+
+		g_free(rule);
+	}
+
+	g_free(format);
+	g_free(deleted_rule);
+	g_free(user_rule);
+
+done:
+	fields = request->query != NULL ? COUNT_RESPONSE_SIZE :
+							request->num_columns;
+
+	request->canc = query_tracker(query, fields, session_query_resp,
+							session, &err);
+	if (request->canc == NULL) {
+		free_request(request);
+		session->request = NULL;
+	}
 
 	g_free(query);
 
@@ -1527,23 +2994,22 @@ int messages_get_message(void *s, const char *h, unsigned long flags,
 {
 	struct session *session = s;
 	struct request *request;
-	int err = 0;
-	char *handle, *query_handle, *query;
+	const char *text;
+	int err = 0, ihandle;
+	char *handle, *query_handle, *format, *query = NULL;
 
 	if (!validate_handle(h))
 		return -ENOENT;
 
 	handle = strip_handle(h);
 	query_handle = g_strdup_printf(MESSAGES_FILTER_BY_HANDLE, handle);
-	query = path2query("telecom/msg", LIST_MESSAGES_QUERY, query_handle);
 
-	if (query == NULL) {
-		err = -ENOENT;
-
-		goto failed;
-	}
+	ihandle = g_ascii_strtoll(handle, NULL, 10);
 
-	if (flags & MESSAGES_FRACTION && flags & MESSAGES_NEXT) {
+	/* Only the message fractioned last has a next fraction */
+	if (flags & MESSAGES_FRACTION && flags & MESSAGES_NEXT &&
+				(session->fraction_handle == 0 ||
+				session->fraction_handle != ihandle)) {
 		err = -EBADR;
 
 		goto failed;
@@ -1557,9 +3023,34 @@ int messages_get_message(void *s, const char *h, unsigned long flags,
 	request->generate_response = get_message_resp;
 	request->user_data = user_data;
 
+	if (flags & MESSAGES_FRACTION && flags & MESSAGES_NEXT) {
+		request->fraction = session->fraction_offset;
+		request->part_id = session->fraction_part + 1;
+	}
+
 	session->request = request;
 
-	request->pc = query_tracker(query, session, &err);
+	text = NULL;
+	if (!(flags & MESSAGES_FRACTION))
+		text = message_cache_lookup(session, ihandle, flags);
+
+	if (text != NULL) {
+		DBG("message %s from cache", handle);
+
+		request->stream = message_stream_new_text(text);
+		request->idle = g_idle_add(message_stream_next, session);
+
+		goto failed;
+	}
+
+	format = message_query_format(MESSAGE_ALL_COLUMNS, GET_MESSAGE_END,
+							request->columns,
+							&request->num_columns);
+	query = g_strdup_printf(format, query_handle, "");
+	g_free(format);
+
+	request->canc = query_tracker(query, request->num_columns,
+					session_query_resp, session, &err);
 
 failed:
 	g_free(query_handle);
@@ -1569,6 +3060,20 @@ failed:
 	return err;
 }
 
+int messages_get_message_next(void *s)
+{
+	struct session *session = s;
+	struct request *request = session->request;
+
+	if (request == NULL || request->stream == NULL)
+		return -EINVAL;
+
+	if (request->idle == 0)
+		request->idle = g_idle_add(message_stream_next, session);
+
+	return 0;
+}
+
 static void messages_qt_callback(int err, void *user_data)
 {
 	struct session *session = user_data;
@@ -1590,13 +3095,7 @@ int messages_set_message_status(void *s, const char *handle, uint8_t indicator,
 	int ret, ihandle, stat;
 
 	ihandle = g_ascii_strtoll(handle, NULL, 10);
-	stat = GPOINTER_TO_INT(g_hash_table_lookup(session->msg_stat,
-						GINT_TO_POINTER(ihandle)));
-	if (stat == 0) {
-		stat = MESSAGE_STAT_EMPTY;
-		g_hash_table_insert(session->msg_stat, GINT_TO_POINTER(ihandle),
-							GINT_TO_POINTER(stat));
-	}
+	stat = message_stat(session, ihandle) | MESSAGE_STAT_EMPTY;
 
 	request = g_new0(struct request, 1);
 	request->cb.status = callback;
@@ -1616,6 +3115,13 @@ int messages_set_message_status(void *s, const char *handle, uint8_t indicator,
 		else if(value == 0)
 			stat &= ~MESSAGE_STAT_READ;
 
+		listing_caches_set_read(ihandle, value & 0x01);
+		message_cache_remove(ihandle);
+
+		/* Copy on write, other sessions keep following tracker */
+		g_hash_table_insert(session->msg_stat, GINT_TO_POINTER(ihandle),
+							GINT_TO_POINTER(stat));
+
 		break;
 	case 0x1:
 		session->op_in_progress = TRUE;
@@ -1636,6 +3142,10 @@ int messages_set_message_status(void *s, const char *handle, uint8_t indicator,
 		else if(value == 0)
 			stat &= ~MESSAGE_STAT_DELETED;
 
+		/* The deleted folder is shared by all sessions */
+		status_store_set(ihandle, stat);
+		message_cache_remove(ihandle);
+
 		break;
 	default:
 		g_free(request);
@@ -1643,9 +3153,6 @@ int messages_set_message_status(void *s, const char *handle, uint8_t indicator,
 		return -EBADR;
 	}
 
-	g_hash_table_insert(session->msg_stat, GINT_TO_POINTER(ihandle),
-							GINT_TO_POINTER(stat));
-
 	return 0;
 }
 
@@ -2004,9 +3511,10 @@ static int store_sms(struct session *session, const char *recipient,
 }
 
 int messages_push_message(void *s, struct bmsg_bmsg *bmsg, const char *name,
-						unsigned long flags,
-						messages_push_message_cb cb,
-						void *user_data)
+					unsigned long flags,
+					messages_push_message_cb cb,
+					messages_push_body_ready_cb ready_cb,
+					void *user_data)
 {
 	struct session *session = s;
 	struct push_message_request *request;
@@ -2038,29 +3546,49 @@ int messages_push_message(void *s, struct bmsg_bmsg *bmsg, const char *name,
 
 	request->bmsg = bmsg;
 	request->cb = cb;
-	request->body = g_string_new("");
 	request->user_data = user_data;
 
+	/* Sized up front so that typical bodies never have to grow */
+	request->body = g_string_sized_new(MIN(bmsg->length,
+							PUSH_BODY_PREALLOC));
+
 	request->name = g_build_filename(session->cwd, name, NULL);
 	DBG("Push destination: %s", request->name);
 
 	return 0;
 }
 
-static int prepare_body(GString *body)
+/* Strips "BEGIN:MSG\r\n" off the front as the chunks come in */
+static ssize_t append_body(struct push_message_request *request,
+					const char *body, size_t len)
 {
-	if (body->len < MSG_BLOCK_OVERHEAD)
-		return -EBADR;
+	size_t n;
+
+	n = MIN(len, MSG_BEGIN_LEN - request->matched);
+	if (n > 0) {
+		if (memcmp(body, MSG_BEGIN + request->matched, n) != 0)
+			return -EBADR;
+
+		request->matched += n;
+	}
+
+	g_string_append_len(request->body, body + n, len - n);
+
+	return len;
+}
+
+/* Drops the trailing "\r\nEND:MSG\r\n" */
+static int finish_body(GString *body)
+{
+	size_t len = MSG_END_LEN;
 
-	if (!g_str_has_prefix(body->str, "BEGIN:MSG\r\n"))
+	if (body->len < len)
 		return -EBADR;
 
-	if (!g_str_has_prefix(body->str + body->len - 11, "\r\nEND:MSG\r\n"))
+	if (memcmp(body->str + body->len - len, MSG_END, len) != 0)
 		return -EBADR;
 
-	g_string_erase(body, 0, 11);
-	g_string_set_size(body, body->len - 10);
-	body->str[body->len - 1] = '\0';
+	g_string_truncate(body, body->len - len);
 
 	return 0;
 }
@@ -2073,8 +3601,16 @@ int messages_push_message_body(void *s, const char *body, size_t len)
 	int env, ret;
 
 	if (len > 0) {
-		g_string_append_len(request->body, body, len);
-		return len;
+		ret = append_body(request, body, len);
+		if (ret < 0)
+			push_message_finalize(session);
+
+		return ret;
+	}
+
+	if (request->matched < MSG_BEGIN_LEN) {
+		ret = -EBADR;
+		goto failed;
 	}
 
 	env = request->bmsg->nenvelopes - 1;
@@ -2096,7 +3632,7 @@ int messages_push_message_body(void *s, const char *body, size_t len)
 		goto failed;
 	}
 
-	ret = prepare_body(request->body);
+	ret = finish_body(request->body);
 	if (ret < 0)
 		goto failed;
 
@@ -2128,9 +3664,14 @@ void messages_abort(void *s)
 	if (session->abort_request != NULL)
 		session->abort_request(session);
 
-	if (session->request != NULL && session->request->pc != NULL) {
-		dbus_pending_call_cancel(session->request->pc);
+	if (session->request != NULL && (session->request->canc != NULL ||
+					session->request->idle != 0 ||
+					session->request->stream != NULL)) {
+		if (session->request->canc != NULL)
+			g_cancellable_cancel(session->request->canc);
+
 		free_request(session->request);
+		session->request = NULL;
 	}
 
 	session->abort_request = NULL;
@@ -271,7 +271,10 @@ int messages_get_messages_listing(void *session,
  * fmore: Indicates whether next fraction is available.
  * chunk: chunk of bMessage body
  *
- * Callback allows for returning bMessage in chunks.
+ * Callback allows for returning bMessage in chunks. A backend that bounds the
+ * memory used per message calls it with err == -EAGAIN for each chunk and
+ * then waits for messages_get_message_next() before producing the next one.
+ * The final call has chunk set to NULL.
  */
 typedef void (*messages_get_message_cb)(void *session, int err, gboolean fmore,
 	const char *chunk, void *user_data);
@@ -282,6 +285,10 @@ int messages_get_message(void *session,
 		messages_get_message_cb callback,
 		void *user_data);
 
+/* Asks the backend for the next chunk of the message being retrieved, once
+ * the previous one has been sent. */
+int messages_get_message_next(void *session);
+
 typedef void (*messages_set_message_status_cb)(void *session, int err,
 		void *user_data);
 
@@ -290,12 +297,38 @@ int messages_set_message_status(void *session, const char *handle,
 		messages_set_message_status_cb callback,
 		void *user_data);
 
+/* Pushes a message, see MAP specification, ch. 5.8.
+ *
+ * session: Backend session.
+ * bmsg: Parsed bMessage header, owned by the caller until cb is called.
+ * name: Name of the destination folder.
+ * flags: or-ed mask of MESSAGES_UTF8, MESSAGES_TRANSPARENT and
+ *	MESSAGES_RETRY.
+ * cb: Called with the handle of the new message, or with an error, once the
+ *	whole body is in.
+ * ready_cb: Called once when the backend can take more of the body after
+ *	messages_push_message_body() returned -EAGAIN, and never otherwise.
+ *
+ * The body follows through messages_push_message_body(), starting from
+ * "BEGIN:MSG" and LENGTH bytes long. A chunk of zero length ends it.
+ * Returns the number of bytes taken, possibly fewer than len, or -EAGAIN if
+ * none can be taken right now. Backends are expected to consume chunks as
+ * they come rather than keeping the whole body around.
+ *
+ * A backend that can always take a chunk whole may never return -EAGAIN,
+ * and then never calls ready_cb. The tracker backend is one: it gathers
+ * the text in memory until the body ends.
+ */
 typedef void(*messages_push_message_cb)(void *session, int err,
 					const char *handle, void *user_data);
 
+typedef void (*messages_push_body_ready_cb)(void *session, void *user_data);
+
 int messages_push_message(void *session, struct bmsg_bmsg *bmsg,
 				const char *name, unsigned long flags,
-				messages_push_message_cb cb, void *user_data);
+				messages_push_message_cb cb,
+				messages_push_body_ready_cb ready_cb,
+				void *user_data);
 
 int messages_push_message_body(void *session, const char *body, size_t len);
 
@@ -146,7 +146,7 @@ struct pbap_session {
 };
 
 struct pbap_object {
-	GString *buffer;
+	struct string_buffer *buffer;
 	GByteArray *aparams;
 	gboolean firstpacket;
 	gboolean lastpart;
@@ -309,10 +309,9 @@ static void query_result(const char *buffer, size_t bufsize, int vcards,
 	}
 
 	if (!pbap->obj->buffer)
-		pbap->obj->buffer = g_string_new_len(buffer, bufsize);
-	else
-		pbap->obj->buffer = g_string_append_len(pbap->obj->buffer,
-							buffer,	bufsize);
+		pbap->obj->buffer = string_buffer_new(NULL);
+
+	g_string_append_len(pbap->obj->buffer->str, buffer, bufsize);
 
 	if (missed > 0)	{
 		DBG("missed %d", missed);
@@ -468,19 +467,20 @@ static int generate_response(void *user_data)
 	/* Computing offset considering first entry of the phonebook */
 	l = g_slist_nth(sorted, pbap->params->liststartoffset);
 
-	pbap->obj->buffer = g_string_new(VCARD_LISTING_BEGIN);
+	pbap->obj->buffer = string_buffer_new(NULL);
+	g_string_append(pbap->obj->buffer->str, VCARD_LISTING_BEGIN);
+
 	for (; l && max; l = l->next, max--) {
 		const struct cache_entry *entry = l->data;
 		char *escaped_name = g_markup_escape_text(entry->name, -1);
 
-		g_string_append_printf(pbap->obj->buffer,
+		g_string_append_printf(pbap->obj->buffer->str,
 			VCARD_LISTING_ELEMENT, entry->handle, escaped_name);
 
 		g_free(escaped_name);
 	}
 
-	pbap->obj->buffer = g_string_append(pbap->obj->buffer,
-							VCARD_LISTING_END);
+	g_string_append(pbap->obj->buffer->str, VCARD_LISTING_END);
 	g_slist_free(sorted);
 
 	return 0;
@@ -834,7 +834,7 @@ static int vobject_close(void *object)
 		obj->session->obj = NULL;
 
 	if (obj->buffer)
-		g_string_free(obj->buffer, TRUE);
+		string_buffer_free(obj->buffer);
 
 	if (obj->aparams)
 		g_byte_array_free(obj->aparams, TRUE);
@@ -1369,7 +1369,8 @@ done:
 
 int phonebook_init(void)
 {
-	g_thread_init(NULL);
+	if (g_thread_supported() == FALSE)
+		g_thread_init(NULL);
 	g_type_init();
 
 	return 0;
@@ -95,7 +95,7 @@ struct synce_context {
 	char *conn_obj;
 	unsigned int reply_watch;
 	unsigned int abort_watch;
-	GString *buffer;
+	struct string_buffer *buffer;
 	int lasterr;
 	char *id;
 };
@@ -132,7 +132,10 @@ static gboolean reply_signal(DBusConnection *conn, DBusMessage *msg,
 	dbus_message_iter_recurse(&iter, &array_iter);
 	dbus_message_iter_get_fixed_array(&array_iter, &value, &length);
 
-	context->buffer = g_string_new_len(value, length);
+	if (context->buffer)
+		string_buffer_free(context->buffer);
+
+	context->buffer = string_buffer_new(g_string_new_len(value, length));
 	obex_object_set_io_flags(context, G_IO_IN, 0);
 	context->lasterr = 0;
 
@@ -323,6 +326,9 @@ failed:
 	context->conn_obj = NULL;
 
 done:
+	if (context->buffer)
+		string_buffer_free(context->buffer);
+
 	dbus_connection_unref(context->dbus_conn);
 	g_free(context);
 	return 0;
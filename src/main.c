@@ -80,6 +80,9 @@ static char *option_noplugin = NULL;
 
 static gboolean option_autoaccept = FALSE;
 static gboolean option_symlinks = FALSE;
+static gboolean option_async_io = FALSE;
+static gboolean option_atomic_put = FALSE;
+static int option_write_buffer = 64;
 
 static gboolean parse_debug(const char *key, const char *value,
 				gpointer user_data, GError **error)
@@ -108,6 +111,14 @@ static GOptionEntry options[] = {
 				"Root folder setup script", "SCRIPT" },
 	{ "symlinks", 'l', 0, G_OPTION_ARG_NONE, &option_symlinks,
 				"Enable symlinks on root folder" },
+	{ "async-io", 0, 0, G_OPTION_ARG_NONE, &option_async_io,
+				"Do file reads and writes in worker threads" },
+	{ "write-buffer", 0, 0, G_OPTION_ARG_INT, &option_write_buffer,
+				"Coalesce received data into writes of SIZE "
+				"kilobytes, 0 to disable", "SIZE" },
+	{ "atomic-put", 0, 0, G_OPTION_ARG_NONE, &option_atomic_put,
+				"Receive files into a temporary file and "
+				"rename it once complete" },
 	{ "capability", 'c', 0, G_OPTION_ARG_STRING, &option_capability,
 				"Specify capability file, use '!' mark for "
 				"scripts", "FILE" },
@@ -130,6 +141,24 @@ gboolean obex_option_symlinks(void)
 	return option_symlinks;
 }
 
+gboolean obex_option_async_io(void)
+{
+	return option_async_io;
+}
+
+gboolean obex_option_atomic_put(void)
+{
+	return option_atomic_put;
+}
+
+size_t obex_option_write_buffer(void)
+{
+	if (option_write_buffer <= 0)
+		return 0;
+
+	return (size_t) option_write_buffer * 1024;
+}
+
 static gboolean is_dir(const char *dir) {
 	struct stat st;
 
@@ -657,7 +657,7 @@ void manager_emit_transfer_progress(struct obex_session *os)
 
 void manager_emit_transfer_completed(struct obex_session *os)
 {
-	if (os->object)
+	if (os->object || os->copy)
 		emit_transfer_completed(os->cid, !os->aborted);
 }
 
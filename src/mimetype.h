@@ -36,9 +36,13 @@ struct obex_mime_type_driver {
 	ssize_t (*get_next_header)(void *object, void *buf, size_t mtu,
 								uint8_t *hi);
 	ssize_t (*read) (void *object, void *buf, size_t count);
+	ssize_t (*read_direct) (void *object, const void **buf, size_t count);
 	ssize_t (*write) (void *object, const void *buf, size_t count);
 	int (*flush) (void *object);
-	int (*copy) (const char *name, const char *destname);
+	int (*abort) (void *object);
+	void *(*copy) (const char *name, const char *destname, size_t *size,
+				int64_t *progress, int *err);
+	int (*cancel) (void *object);
 	int (*move) (const char *name, const char *destname);
 	int (*remove) (const char *name);
 	int (*set_io_watch) (void *object, obex_object_io_func func,
@@ -35,10 +35,14 @@ struct obex_session {
 	char *path;
 	time_t time;
 	uint8_t *buf;
+	uint8_t *ring;		/* PUT body staging buffer */
+	size_t ring_size;
+	size_t ring_start;
 	int64_t pending;
 	int64_t offset;
 	int64_t size;
 	void *object;
+	void *copy;		/* In-flight ACTION copy */
 	gboolean aborted;
 	struct obex_service_driver *service;
 	void *service_data;
@@ -50,6 +54,8 @@ struct obex_session {
 	gboolean stream_open;
 	gboolean stream_suspended;
 	gboolean headers_sent;
+	uint8_t srm;
+	gboolean srm_wait;
 };
 
 int obex_session_start(GIOChannel *io, uint16_t tx_mtu, uint16_t rx_mtu,
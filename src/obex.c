@@ -59,10 +59,37 @@
 #define OBEX_HDR_PERMISSIONS 0xD6
 #endif /* OBEX_CMD_ACTION */
 
+#ifndef OBEX_HDR_SRM
+#define OBEX_HDR_SRM 0x97
+#define OBEX_HDR_SRM_FLAGS 0x98
+#endif /* OBEX_HDR_SRM */
+
+/* Single Response Mode header values */
+#define SRM_DISABLE 0x00
+#define SRM_ENABLE 0x01
+#define SRM_INDICATE 0x02
+
+/* Single Response Mode Parameters header values */
+#define SRMP_NEXT 0x00
+#define SRMP_WAIT 0x01
+#define SRMP_NEXT_WAIT 0x02
+
+/* Single Response Mode state of the current operation */
+enum {
+	SRM_STATE_DISABLED,
+	SRM_STATE_REQUESTED,
+	SRM_STATE_ENABLED,
+};
+
 /* Default MTU's */
 #define DEFAULT_RX_MTU 32767
 #define DEFAULT_TX_MTU 32767
 
+/* PUT body staging: packets buffered while the driver is busy and the
+ * upper bound for bodies received before the driver object is open */
+#define STAGING_PACKETS 4
+#define STAGING_MAX_SIZE (4 * 1024 * 1024)
+
 /* Challenge request */
 #define NONCE_TAG 0x00
 #define OPTIONS_TAG 0x01 /* Optional */
@@ -261,6 +288,10 @@ static void os_set_response(obex_object_t *obj, int err)
 		rsp = OBEX_RSP_PRECONDITION_FAILED;
 		lastrsp = OBEX_RSP_PRECONDITION_FAILED;
 		break;
+	case -EFBIG:
+		rsp = OBEX_RSP_REQ_ENTITY_TOO_LARGE;
+		lastrsp = OBEX_RSP_REQ_ENTITY_TOO_LARGE;
+		break;
 	default:
 		rsp = OBEX_RSP_INTERNAL_SERVER_ERROR;
 		lastrsp = OBEX_RSP_INTERNAL_SERVER_ERROR;
@@ -271,24 +302,110 @@ static void os_set_response(obex_object_t *obj, int err)
 	OBEX_ObjectSetRsp(obj, rsp, lastrsp);
 }
 
-static void os_session_mark_aborted(struct obex_session *os)
+static void os_srm_parse(struct obex_session *os, uint8_t hi, uint8_t value)
+{
+	switch (hi) {
+	case OBEX_HDR_SRM:
+		DBG("OBEX_HDR_SRM: 0x%02x", value);
+		/* Invalid or unexpected values shall be ignored */
+		if (value == SRM_ENABLE && os->srm == SRM_STATE_DISABLED)
+			os->srm = SRM_STATE_REQUESTED;
+		break;
+	case OBEX_HDR_SRM_FLAGS:
+		/* Waits requested by the client are honoured by openobex */
+		DBG("OBEX_HDR_SRM_FLAGS: 0x%02x", value);
+		break;
+	}
+}
+
+static void os_srm_setup(struct obex_session *os, obex_t *obex,
+							obex_object_t *obj)
 {
-	/* the session was already cancelled/aborted or size in unknown */
-	if (os->aborted || os->size == OBJECT_SIZE_UNKNOWN)
+	if (os->srm != SRM_STATE_REQUESTED)
 		return;
 
+#ifdef HAVE_OBEX_SRM
+	{
+		obex_headerdata_t hd;
+
+		hd.bq1 = SRM_ENABLE;
+		if (OBEX_ObjectAddHeader(obex, obj, OBEX_HDR_SRM, hd, 1,
+						OBEX_FL_FIT_ONE_PACKET) < 0) {
+			os->srm = SRM_STATE_DISABLED;
+			return;
+		}
+	}
+
+	OBEX_SetResponseMode(obex, OBEX_RSP_MODE_SINGLE);
+	os->srm = SRM_STATE_ENABLED;
+
+	DBG("Single Response Mode enabled");
+#else
+	/* Not answering the SRM header keeps the client in normal mode */
+	os->srm = SRM_STATE_DISABLED;
+#endif
+}
+
+static void os_srm_reset(struct obex_session *os)
+{
+#ifdef HAVE_OBEX_SRM
+	if (os->srm == SRM_STATE_ENABLED)
+		OBEX_SetResponseMode(os->obex, OBEX_RSP_MODE_NORMAL);
+#endif
+
+	os->srm = SRM_STATE_DISABLED;
+	os->srm_wait = FALSE;
+}
+
+static void os_session_mark_aborted(struct obex_session *os, gboolean done)
+{
+	/* the session was already cancelled/aborted */
+	if (os->aborted)
+		return;
+
+	/* Without a size only the final response tells the object is whole */
+	if (os->size == OBJECT_SIZE_UNKNOWN) {
+		os->aborted = !done;
+		return;
+	}
+
 	os->aborted = (os->size != os->offset);
 }
 
-static void os_reset_session(struct obex_session *os)
+static void os_copy_cancel(struct obex_session *os)
 {
-	os_session_mark_aborted(os);
+	os->driver->set_io_watch(os->copy, NULL, NULL);
+	os->driver->cancel(os->copy);
+
+	os->aborted = TRUE;
+	manager_emit_transfer_completed(os);
+	manager_unregister_transfer(os);
+
+	os->copy = NULL;
+}
+
+static void os_reset_session(struct obex_session *os, gboolean done)
+{
+	gboolean discard;
+
+	if (os->copy)
+		os_copy_cancel(os);
+
+	os_session_mark_aborted(os, done);
 
 	if (os->object) {
+		discard = (os->aborted && os->cmd == OBEX_CMD_PUT);
+
+		/* Drivers that can abort clean up after themselves, e.g. an
+		 * atomic PUT must not touch the file it was going to replace */
+		if (discard && os->driver->abort) {
+			os->driver->abort(os->object);
+			discard = FALSE;
+		}
+
 		os->driver->set_io_watch(os->object, NULL, NULL);
 		os->driver->close(os->object);
-		if (os->aborted && os->cmd == OBEX_CMD_PUT && os->path &&
-				os->driver->remove)
+		if (discard && os->path && os->driver->remove)
 			os->driver->remove(os->path);
 	}
 
@@ -307,6 +424,10 @@ static void os_reset_session(struct obex_session *os)
 		g_free(os->buf);
 		os->buf = NULL;
 	}
+	if (os->ring) {
+		g_free(os->ring);
+		os->ring = NULL;
+	}
 	if (os->path) {
 		g_free(os->path);
 		os->path = NULL;
@@ -316,12 +437,16 @@ static void os_reset_session(struct obex_session *os)
 	os->obj = NULL;
 	os->driver = NULL;
 	os->aborted = FALSE;
+	os->ring_size = 0;
+	os->ring_start = 0;
 	os->pending = 0;
 	os->offset = 0;
 	os->size = OBJECT_SIZE_DELETE;
 	os->headers_sent = FALSE;
 	os->stream_open = FALSE;
 	os->stream_suspended = FALSE;
+
+	os_srm_reset(os);
 }
 
 static void obex_session_free(struct obex_session *os)
@@ -560,11 +685,106 @@ static gboolean chk_cid(obex_t *obex, obex_object_t *obj, uint32_t cid)
 	return ret;
 }
 
+static int ring_resize(struct obex_session *os, size_t size)
+{
+	uint8_t *ring;
+	size_t tail;
+
+	if (size > STAGING_MAX_SIZE) {
+		error("PUT staging buffer limit reached (%" PRId64 " bytes)",
+								os->pending);
+		return -EFBIG;
+	}
+
+	ring = g_try_malloc(size);
+	if (ring == NULL)
+		return -ENOMEM;
+
+	/* Unwrap the stored data so it starts at the beginning */
+	if (os->pending > 0) {
+		tail = MIN((size_t) os->pending, os->ring_size - os->ring_start);
+		memcpy(ring, os->ring + os->ring_start, tail);
+		memcpy(ring + tail, os->ring, os->pending - tail);
+	}
+
+	g_free(os->ring);
+	os->ring = ring;
+	os->ring_size = size;
+	os->ring_start = 0;
+
+	return 0;
+}
+
+static int ring_push(struct obex_session *os, const uint8_t *buffer,
+								size_t size)
+{
+	size_t end, tail;
+	int err;
+
+	if (os->ring == NULL || os->pending + size > os->ring_size) {
+		size_t new_size = os->ring_size ? os->ring_size * 2 :
+					(size_t) os->rx_mtu * STAGING_PACKETS;
+
+		while (new_size < os->pending + size)
+			new_size *= 2;
+
+		err = ring_resize(os, new_size);
+		if (err < 0)
+			return err;
+	}
+
+	end = (os->ring_start + os->pending) % os->ring_size;
+	tail = MIN(size, os->ring_size - end);
+
+	memcpy(os->ring + end, buffer, tail);
+	memcpy(os->ring, buffer + tail, size - tail);
+	os->pending += size;
+
+	return 0;
+}
+
+/* Hands over what the driver couldn't take earlier, oldest data first */
+static int obex_write_pending(struct obex_session *os)
+{
+	if (os->aborted)
+		return -EPERM;
+
+	while (os->pending > 0) {
+		size_t len;
+		ssize_t w;
+
+		len = MIN((size_t) os->pending, os->ring_size - os->ring_start);
+
+		w = os->driver->write(os->object, os->ring + os->ring_start,
+									len);
+		if (w == -EINTR)
+			continue;
+
+		if (w == 0)
+			return -EAGAIN;
+
+		if (w < 0)
+			return w;
+
+		os->ring_start = (os->ring_start + w) % os->ring_size;
+		os->offset += w;
+		os->pending -= w;
+	}
+
+	os->ring_start = 0;
+
+	/* Flush on EOS */
+	if (os->driver->flush)
+		return os->driver->flush(os->object);
+
+	return 0;
+}
+
 static int obex_read_stream(struct obex_session *os, obex_t *obex,
 						obex_object_t *obj)
 {
 	int size;
-	ssize_t len = 0;
+	int err;
 	const uint8_t *buffer;
 
 	DBG("name=%s type=%s rx_mtu=%d file=%p",
@@ -578,10 +798,6 @@ static int obex_read_stream(struct obex_session *os, obex_t *obex,
 	if (os->size == OBJECT_SIZE_DELETE)
 		os->size = OBJECT_SIZE_UNKNOWN;
 
-	/* If there's something to write and we are able to write it */
-	if (os->pending > 0 && os->driver && os->object)
-		goto write;
-
 	size = OBEX_ObjectReadStream(obex, obj, &buffer);
 	if (size < 0) {
 		error("Error on OBEX stream");
@@ -593,35 +809,52 @@ static int obex_read_stream(struct obex_session *os, obex_t *obex,
 		return -EIO;
 	}
 
-	os->buf = g_realloc(os->buf, os->pending + size);
-	memcpy(os->buf + os->pending, buffer, size);
-	os->pending += size;
-
 	/* only write if both object and driver are valid */
 	if (os->object == NULL || os->driver == NULL) {
+		err = ring_push(os, buffer, size);
+		if (err < 0)
+			return err;
+
 		DBG("Stored %" PRIu64 " bytes into temporary buffer",
 								os->pending);
 		return 0;
 	}
 
-write:
-	while (os->pending > 0) {
+	/* Whatever is still queued has to reach the driver first */
+	if (os->pending > 0) {
+		err = ring_push(os, buffer, size);
+		if (err < 0)
+			return err;
+
+		return obex_write_pending(os);
+	}
+
+	/* Common case: nothing queued, hand the packet straight over */
+	while (size > 0) {
 		ssize_t w;
 
-		w = os->driver->write(os->object, os->buf + len,
-					os->pending);
-		if (w < 0) {
-			if (w == -EINTR)
-				continue;
-			else {
-				memmove(os->buf, os->buf + len, os->pending);
-				return w;
-			}
-		}
+		w = os->driver->write(os->object, buffer, size);
+		if (w == -EINTR)
+			continue;
 
-		len += w;
+		if (w == -EAGAIN || w == 0)
+			break;
+
+		if (w < 0)
+			return w;
+
+		buffer += w;
+		size -= w;
 		os->offset += w;
-		os->pending -= w;
+	}
+
+	if (size > 0) {
+		/* Driver is busy: keep the rest until it is writable again */
+		err = ring_push(os, buffer, size);
+		if (err < 0)
+			return err;
+
+		return -EAGAIN;
 	}
 
 	/* Flush on EOS */
@@ -635,7 +868,8 @@ static int obex_write_stream(struct obex_session *os,
 			obex_t *obex, obex_object_t *obj)
 {
 	obex_headerdata_t hd;
-	ssize_t len;
+	const void *data = NULL;
+	ssize_t len = -ENOTSUP;
 
 	DBG("name=%s type=%s tx_mtu=%d file=%p",
 		os->name ? os->name : "", os->type ? os->type : "",
@@ -647,7 +881,16 @@ static int obex_write_stream(struct obex_session *os,
 	if (os->object == NULL)
 		return -EIO;
 
-	len = os->driver->read(os->object, os->buf, os->tx_mtu);
+	/* Drivers may hand out memory that stays valid until the next read,
+	 * which saves copying the body into os->buf */
+	if (os->driver->read_direct)
+		len = os->driver->read_direct(os->object, &data, os->tx_mtu);
+
+	if (len == -ENOTSUP) {
+		data = os->buf;
+		len = os->driver->read(os->object, os->buf, os->tx_mtu);
+	}
+
 	if (len < 0) {
 		error("read(): %s (%zd)", strerror(-len), -len);
 		if (len == -EAGAIN)
@@ -675,9 +918,10 @@ static int obex_write_stream(struct obex_session *os,
 						OBEX_FL_STREAM_DATAEND);
 		g_free(os->buf);
 		os->buf = NULL;
+		data = NULL;
 	}
 
-	hd.bs = os->buf;
+	hd.bs = data;
 	OBEX_ObjectAddHeader(obex, obj, OBEX_HDR_BODY, hd, len,
 						OBEX_FL_STREAM_DATA);
 
@@ -745,7 +989,7 @@ static gboolean handle_async_io(void *object, int flags, int err,
 	if (flags & (G_IO_IN | G_IO_PRI))
 		ret = obex_write(os, os->obex, os->obj);
 	else if ((flags & G_IO_OUT) && os->pending > 0)
-		ret = obex_read_stream(os, os->obex, os->obj);
+		ret = obex_write_pending(os);
 
 proceed:
 	os->stream_suspended = FALSE;
@@ -753,15 +997,48 @@ proceed:
 	if (ret == -EAGAIN) {
 		return TRUE;
 	} else if (ret < 0) {
+		os->aborted = TRUE;
 		os_set_response(os->obj, ret);
 		OBEX_CancelRequest(os->obex, TRUE);
-	} else {
+	} else if (os->srm_wait) {
+		/* Not suspended: the response to the packet the client sends
+		 * next goes without SRMP, which lets it stream again */
+		os->srm_wait = FALSE;
+	} else
 		OBEX_ResumeRequest(os->obex);
-	}
 
 	return os->stream_suspended;
 }
 
+static void os_suspend_request(struct obex_session *os, obex_t *obex,
+							obex_object_t *obj)
+{
+	obex_headerdata_t hd;
+
+	os->obj = obj;
+
+	/* With SRM active the client doesn't wait for our responses, and one
+	 * held back by a suspended request would carry SRMP only once the
+	 * backend caught up.  While the body isn't complete the data is in
+	 * the ring already, so answer this packet right away with SRMP wait:
+	 * the client then waits for the response to its next packet, which
+	 * gets suspended if the backend is still busy by then. */
+	if (os->srm == SRM_STATE_ENABLED && os->cmd == OBEX_CMD_PUT &&
+				!os->srm_wait && os->pending > 0 &&
+				os->size != OBJECT_SIZE_UNKNOWN &&
+				os->offset + os->pending < os->size) {
+		hd.bq1 = SRMP_WAIT;
+		OBEX_ObjectAddHeader(obex, obj, OBEX_HDR_SRM_FLAGS, hd, 1,
+						OBEX_FL_FIT_ONE_PACKET);
+		os->srm_wait = TRUE;
+	} else {
+		os->srm_wait = FALSE;
+		OBEX_SuspendRequest(obex, obj);
+	}
+
+	os->driver->set_io_watch(os->object, handle_async_io, os);
+}
+
 static void cmd_get(struct obex_session *os, obex_t *obex, obex_object_t *obj)
 {
 	obex_headerdata_t hd;
@@ -827,6 +1104,13 @@ static void cmd_get(struct obex_session *os, obex_t *obex, obex_object_t *obj)
 						os->service->who,
 						os->service->who_size);
 			break;
+		case OBEX_HDR_SRM:
+		case OBEX_HDR_SRM_FLAGS:
+			if (hlen != 1)
+				break;
+
+			os_srm_parse(os, hi, hd.bq1);
+			break;
 		}
 	}
 
@@ -849,6 +1133,8 @@ static void cmd_get(struct obex_session *os, obex_t *obex, obex_object_t *obj)
 	if (err < 0)
 		goto done;
 
+	os_srm_setup(os, obex, obj);
+
 	if (os->size != OBJECT_SIZE_UNKNOWN && os->size < UINT32_MAX) {
 		hd.bq4 = os->size;
 		OBEX_ObjectAddHeader(obex, obj,
@@ -867,9 +1153,7 @@ static void cmd_get(struct obex_session *os, obex_t *obex, obex_object_t *obj)
 	 * if no data available to send. */
 	err = obex_write(os, obex, obj);
 	if (err == -EAGAIN) {
-		OBEX_SuspendRequest(obex, obj);
-		os->obj = obj;
-		os->driver->set_io_watch(os->object, handle_async_io, os);
+		os_suspend_request(os, obex, obj);
 		return;
 	}
 
@@ -966,20 +1250,14 @@ int obex_put_stream_start(struct obex_session *os, const char *filename)
 
 	os->path = g_strdup(filename);
 
-	if (!os->buf) {
+	if (os->pending == 0) {
 		DBG("PUT request checked, no buffered data");
 		return 0;
 	}
 
-	if (os->pending == 0)
-		return 0;
-
-	err = obex_read_stream(os, os->obex, os->obj);
+	err = obex_write_pending(os);
 	if (err == -EAGAIN) {
-		OBEX_SuspendRequest(os->obex, os->obj);
-		os->driver->set_io_watch(os->object, handle_async_io,
-								os);
-
+		os_suspend_request(os, os->obex, os->obj);
 		return 0;
 	}
 
@@ -1062,6 +1340,13 @@ static gboolean check_put(obex_t *obex, obex_object_t *obj)
 		case OBEX_HDR_TIME:
 			os->time = parse_iso8610((const char *) hd.bs, hlen);
 			break;
+		case OBEX_HDR_SRM:
+		case OBEX_HDR_SRM_FLAGS:
+			if (hlen != 1)
+				break;
+
+			os_srm_parse(os, hi, hd.bq1);
+			break;
 		}
 	}
 
@@ -1097,9 +1382,8 @@ static gboolean check_put(obex_t *obex, obex_object_t *obj)
 					OBEX_RSP_BAD_REQUEST);
 		return FALSE;
 	case -EAGAIN:
-		OBEX_SuspendRequest(obex, obj);
-		os->obj = obj;
-		os->driver->set_io_watch(os->object, handle_async_io, os);
+		os_srm_setup(os, obex, obj);
+		os_suspend_request(os, obex, obj);
 		return TRUE;
 	default:
 		DBG("Unhandled chkput error: %d", ret);
@@ -1115,6 +1399,7 @@ static gboolean check_put(obex_t *obex, obex_object_t *obj)
 	}
 
 done:
+	os_srm_setup(os, obex, obj);
 	os->checked = TRUE;
 
 	return TRUE;
@@ -1156,12 +1441,15 @@ static void cmd_put(struct obex_session *os, obex_t *obex, obex_object_t *obj)
 
 	/* Flush immediatly since there is nothing to write so the driver
 	   has a chance to do something before we reply */
-	if (os->object && os->driver && os->driver->flush &&
-					os->driver->flush(os->object) > 0) {
-		OBEX_SuspendRequest(obex, obj);
-		os->obj = obj;
-		os->driver->set_io_watch(os->object, handle_async_io, os);
-	}
+	if (os->object == NULL || os->driver == NULL ||
+						os->driver->flush == NULL)
+		return;
+
+	err = os->driver->flush(os->object);
+	if (err == -EAGAIN)
+		os_suspend_request(os, obex, obj);
+	else if (err < 0)
+		os_set_response(obj, err);
 }
 
 static void cmd_action(struct obex_session *os, obex_t *obex,
@@ -1254,7 +1542,12 @@ static void cmd_action(struct obex_session *os, obex_t *obex,
 	}
 
 	err = os->service->action(os, obj, os->service_data);
-	if (err < 0) {
+	if (err == -EAGAIN) {
+		/* Reply once the copy finishes, see handle_copy_io */
+		OBEX_SuspendRequest(obex, obj);
+		os->obj = obj;
+		return;
+	} else if (err < 0) {
 		os_set_response(obj, err);
 		return;
 	}
@@ -1279,7 +1572,7 @@ static void obex_event_cb(obex_t *obex, obex_object_t *obj, int mode,
 		break;
 	case OBEX_EV_ABORT:
 		os->aborted = TRUE;
-		os_reset_session(os);
+		os_reset_session(os, FALSE);
 		OBEX_ObjectSetRsp(obj, OBEX_RSP_SUCCESS, OBEX_RSP_SUCCESS);
 		break;
 	case OBEX_EV_REQDONE:
@@ -1293,7 +1586,7 @@ static void obex_event_cb(obex_t *obex, obex_object_t *obj, int mode,
 		case OBEX_CMD_GET:
 		case OBEX_CMD_SETPATH:
 		default:
-			os_reset_session(os);
+			os_reset_session(os, TRUE);
 			break;
 		}
 		break;
@@ -1356,22 +1649,29 @@ static void obex_event_cb(obex_t *obex, obex_object_t *obj, int mode,
 	case OBEX_EV_STREAMAVAIL:
 		err = obex_read_stream(os, obex, obj);
 		if (err == -EAGAIN) {
-			OBEX_SuspendRequest(obex, obj);
-			os->obj = obj;
-			os->driver->set_io_watch(os->object, handle_async_io,
-									os);
-		} else if (err < 0)
+			os_suspend_request(os, obex, obj);
+			break;
+		}
+
+		if (err < 0) {
+			/* Whatever was stored so far must not be kept */
+			os->aborted = TRUE;
 			os_set_response(obj, err);
+		}
+
+		/* Caught up before the watch fired: this response goes
+		 * without SRMP, so the client streams again */
+		if (os->srm_wait) {
+			os->srm_wait = FALSE;
+			os->driver->set_io_watch(os->object, NULL, NULL);
+		}
 
 		break;
 	case OBEX_EV_STREAMEMPTY:
 		err = obex_write_stream(os, obex, obj);
 		if (err == -EAGAIN) {
-			OBEX_SuspendRequest(obex, obj);
 			os->stream_suspended = TRUE;
-			os->obj = obj;
-			os->driver->set_io_watch(os->object, handle_async_io,
-									os);
+			os_suspend_request(os, obex, obj);
 		} else if (err < 0)
 			os_set_response(obj, err);
 
@@ -1398,7 +1698,7 @@ static void obex_handle_destroy(void *user_data)
 
 	os = OBEX_GetUserData(obex);
 
-	os_reset_session(os);
+	os_reset_session(os, FALSE);
 
 	if (os->service && os->service->disconnect)
 		os->service->disconnect(os, os->service_data);
@@ -1535,15 +1835,62 @@ int obex_remove(struct obex_session *os, const char *path)
 	return os->driver->remove(path);
 }
 
+static gboolean handle_copy_io(void *object, int flags, int err,
+							void *user_data)
+{
+	struct obex_session *os = user_data;
+
+	if (flags & G_IO_OUT) {
+		if (!os->aborted) {
+			manager_emit_transfer_progress(os);
+			return TRUE;
+		}
+
+		DBG("copy cancelled");
+		os_copy_cancel(os);
+		err = -ECANCELED;
+		goto done;
+	}
+
+	manager_emit_transfer_progress(os);
+
+	os->aborted = (err < 0);
+	manager_emit_transfer_completed(os);
+	manager_unregister_transfer(os);
+
+	os->copy = NULL;
+
+done:
+	os_set_response(os->obj, err);
+	OBEX_ResumeRequest(os->obex);
+
+	return FALSE;
+}
+
 int obex_copy(struct obex_session *os, const char *source,
 						const char *destination)
 {
+	size_t size = 0;
+	int err;
+
 	if (os->driver == NULL || os->driver->copy == NULL)
 		return -EINVAL;
 
 	DBG("%s %s", source, destination);
 
-	return os->driver->copy(source, destination);
+	os->offset = 0;
+	os->copy = os->driver->copy(source, destination, &size, &os->offset,
+									&err);
+	if (os->copy == NULL)
+		return err;
+
+	os->size = size;
+	os->driver->set_io_watch(os->copy, handle_copy_io, os);
+
+	manager_register_transfer(os);
+	manager_emit_transfer_started(os);
+
+	return -EAGAIN;
 }
 
 int obex_move(struct obex_session *os, const char *source,
@@ -70,6 +70,9 @@ int obex_aparam_write(struct obex_session *os, obex_object_t *obj,
 
 const char *obex_option_root_folder(void);
 gboolean obex_option_symlinks(void);
+gboolean obex_option_async_io(void);
+gboolean obex_option_atomic_put(void);
+size_t obex_option_write_buffer(void);
 int obex_name_write(struct obex_session *os,
 		obex_object_t *obj, const char *name);
 
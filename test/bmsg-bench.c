@@ -0,0 +1,127 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Throughput of the bMessage header parser on a pushed message with many
+ * recipients, fed in OBEX packets the way message_write_header() gets
+ * them.
+ *
+ * Usage: bmsg-bench [recipients] [packet size] [rounds]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+
+#include "bmsg_parser.h"
+
+static GString *build_message(int recipients)
+{
+	GString *msg = g_string_new("BEGIN:BMSG\r\nVERSION:1.0\r\n"
+				"STATUS:UNREAD\r\nTYPE:EMAIL\r\n"
+				"FOLDER:telecom/msg/outbox\r\n"
+				"BEGIN:VCARD\r\nVERSION:2.1\r\nN:Me\r\n"
+				"EMAIL:me@example.com\r\nEND:VCARD\r\n"
+				"BEGIN:BENV\r\n");
+	int i;
+
+	for (i = 0; i < recipients; i++)
+		g_string_append_printf(msg, "BEGIN:VCARD\r\nVERSION:3.0\r\n"
+				"item1.N;CHARSET=UTF-8:Recipient;Number %d\r\n"
+				"FN:Recipient Number %d\r\n"
+				"TEL;TYPE=CELL:+358%07d\r\n"
+				"item1.EMAIL;TYPE=INTERNET:r%d@example.com\r\n"
+				"END:VCARD\r\n", i, i, i, i);
+
+	g_string_append(msg, "BEGIN:BBODY\r\nPARTID:1\r\nENCODING:8BIT\r\n"
+				"CHARSET:UTF-8\r\nLENGTH:27\r\n"
+				"BEGIN:MSG\r\nHello\r\nEND:MSG\r\n"
+				"END:BBODY\r\nEND:BENV\r\nEND:BMSG\r\n");
+
+	return msg;
+}
+
+static size_t parse(GString *msg, size_t packet)
+{
+	struct bmsg_parser *pd = bmsg_parser_new();
+	const char *pos = msg->str;
+	size_t off = 0;
+	int ret = 1;
+
+	while (ret == 1 && off < msg->len) {
+		size_t n = MIN(packet, msg->len - off);
+
+		ret = bmsg_parser_process(pd, &pos, n);
+		off = pos - msg->str;
+	}
+
+	if (ret != 0) {
+		fprintf(stderr, "Parsing failed (%d)\n", ret);
+		exit(1);
+	}
+
+	bmsg_free(bmsg_parser_get_bmsg(pd));
+	bmsg_parser_free(pd);
+
+	return off;
+}
+
+int main(int argc, char *argv[])
+{
+	int recipients = argc > 1 ? atoi(argv[1]) : 2000;
+	size_t packet = argc > 2 ? strtoul(argv[2], NULL, 10) : 32767;
+	int rounds = argc > 3 ? atoi(argv[3]) : 100;
+	GString *msg;
+	GTimer *timer;
+	size_t header = 0;
+	double elapsed;
+	int i;
+
+	if (recipients < 0 || packet == 0 || rounds <= 0) {
+		fprintf(stderr, "usage: %s [recipients] [packet size] "
+						"[rounds]\n", argv[0]);
+		return 1;
+	}
+
+	msg = build_message(recipients);
+
+	timer = g_timer_new();
+
+	for (i = 0; i < rounds; i++)
+		header = parse(msg, packet);
+
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	printf("%d recipients, %zu byte header, %zu byte packets\n",
+						recipients, header, packet);
+	printf("%.3f ms per message, %.1f MB/s\n", elapsed * 1e3 / rounds,
+				header * (double) rounds / elapsed / 1e6);
+
+	g_string_free(msg, TRUE);
+
+	return 0;
+}
@@ -0,0 +1,443 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Pushed bMessage headers arrive in OBEX packets of any size, so every
+ * input must parse the same however it is split. The seeds are in
+ * test/bmsg-corpus, and corrupted copies of them make up the fuzz run.
+ *
+ * Most useful when built with -fsanitize=address,undefined in CFLAGS.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+
+#include "bmsg_parser.h"
+
+#ifndef CORPUSDIR
+#define CORPUSDIR "test/bmsg-corpus"
+#endif
+
+#define FUZZ_ROUNDS 20000
+
+/* Same as in bmsg_parser.c */
+#define BMSG_LINE_MAX 4096
+
+struct sample {
+	char *name;
+	char *data;
+	gsize len;
+};
+
+static GSList *corpus = NULL;
+
+struct result {
+	int ret;
+	size_t header;		/* Bytes taken by the parser */
+	char *desc;		/* NULL unless ret == 0 */
+};
+
+static void append_vcards(GString *desc, const char *what, GSList *list)
+{
+	for (; list; list = list->next) {
+		struct bmsg_bmsg_vcard *vc = list->data;
+
+		g_string_append_printf(desc, "%s %d n=%s fn=%s tel=%s "
+					"email=%s\n", what, vc->version,
+					vc->n ? vc->n : "-",
+					vc->fn ? vc->fn : "-",
+					vc->tel ? vc->tel : "-",
+					vc->email ? vc->email : "-");
+	}
+}
+
+static char *describe(struct bmsg_bmsg *bmsg)
+{
+	GString *desc = g_string_new("");
+	int i;
+
+	g_string_append_printf(desc, "read=%d type=%d folder=%s\n",
+					bmsg->read, bmsg->type, bmsg->folder);
+
+	append_vcards(desc, "originator", bmsg->originators);
+
+	for (i = 0; i < bmsg->nenvelopes; i++) {
+		g_string_append_printf(desc, "envelope %d\n", i);
+		append_vcards(desc, "recipient", bmsg->recipients[i]);
+	}
+
+	g_string_append_printf(desc, "part_id=%ld encoding=%d charset=%d "
+				"language=%d length=%zu\n", bmsg->part_id,
+				bmsg->encoding, bmsg->charset,
+				bmsg->language, bmsg->length);
+
+	return g_string_free(desc, FALSE);
+}
+
+/* Feeds data in packets of chunk bytes, or random sizes when it is 0 */
+static void parse(const char *data, size_t len, size_t chunk,
+							struct result *res)
+{
+	struct bmsg_parser *pd = bmsg_parser_new();
+	size_t off = 0;
+
+	res->ret = 1;
+	res->desc = NULL;
+
+	while (off < len) {
+		size_t n = chunk ? chunk : (size_t) g_random_int_range(1, 65);
+		const char *pos = data + off;
+
+		if (n > len - off)
+			n = len - off;
+
+		res->ret = bmsg_parser_process(pd, &pos, n);
+		g_assert(res->ret == 0 || res->ret == 1 || res->ret == -EBADR);
+		g_assert(pos >= data + off && pos <= data + off + n);
+
+		if (res->ret < 0)
+			break;
+
+		off = pos - data;
+
+		if (res->ret == 0)
+			break;
+	}
+
+	res->header = off;
+
+	if (res->ret == 0) {
+		struct bmsg_bmsg *bmsg = bmsg_parser_get_bmsg(pd);
+
+		g_assert(bmsg != NULL);
+		res->desc = describe(bmsg);
+		bmsg_free(bmsg);
+	} else if (res->ret == 1)
+		g_assert(bmsg_parser_get_bmsg(pd) == NULL);
+
+	bmsg_parser_free(pd);
+}
+
+static void check_same(const struct result *a, const struct result *b)
+{
+	g_assert_cmpint(a->ret, ==, b->ret);
+
+	if (a->ret != 0)
+		return;
+
+	g_assert_cmpuint(a->header, ==, b->header);
+	g_assert_cmpstr(a->desc, ==, b->desc);
+}
+
+static void check_splits(const char *data, size_t len, size_t max,
+								int random)
+{
+	struct result whole, split;
+	size_t chunk;
+	int i;
+
+	parse(data, len, len, &whole);
+
+	for (chunk = 1; chunk <= max; chunk++) {
+		parse(data, len, chunk, &split);
+		check_same(&whole, &split);
+		g_free(split.desc);
+	}
+
+	for (i = 0; i < random; i++) {
+		parse(data, len, 0, &split);
+		check_same(&whole, &split);
+		g_free(split.desc);
+	}
+
+	g_free(whole.desc);
+}
+
+static GString *build_message(int recipients)
+{
+	GString *msg = g_string_new("BEGIN:BMSG\r\nVERSION:1.0\r\n"
+				"STATUS:UNREAD\r\nTYPE:SMS_GSM\r\n"
+				"FOLDER:telecom/msg/outbox\r\n"
+				"BEGIN:VCARD\r\nVERSION:2.1\r\nN:Me\r\n"
+				"TEL:+1\r\nEND:VCARD\r\nBEGIN:BENV\r\n");
+	int i;
+
+	for (i = 0; i < recipients; i++)
+		g_string_append_printf(msg, "BEGIN:VCARD\r\nVERSION:3.0\r\n"
+				"item1.N;CHARSET=UTF-8:Name %d\r\n"
+				"FN:Full %d\r\nTEL;TYPE=CELL:+358%07d\r\n"
+				"X-junk\r\nEMAIL:a%d@b.c\r\nEND:VCARD\r\n",
+				i, i, i, i);
+
+	g_string_append(msg, "BEGIN:BBODY\r\nPARTID:12\r\n"
+				"ENCODING:G-7BIT\r\nCHARSET:UTF-8\r\n"
+				"LANGUAGE:FRENCH\r\nLENGTH:24\r\n"
+				"BEGIN:MSG\r\nhi\r\nEND:MSG\r\n"
+				"END:BBODY\r\nEND:BENV\r\nEND:BMSG\r\n");
+
+	return msg;
+}
+
+static void test_fields(void)
+{
+	GString *msg = build_message(50);
+	struct bmsg_parser *pd = bmsg_parser_new();
+	struct bmsg_bmsg *bmsg;
+	struct bmsg_bmsg_vcard *vc;
+	const char *pos = msg->str;
+	GSList *l;
+	int i;
+
+	g_assert_cmpint(bmsg_parser_process(pd, &pos, msg->len), ==, 0);
+	g_assert(g_str_has_prefix(pos, "BEGIN:MSG\r\n"));
+
+	bmsg = bmsg_parser_get_bmsg(pd);
+	g_assert(bmsg != NULL);
+
+	g_assert(!bmsg->read);
+	g_assert_cmpint(bmsg->type, ==, BMSG_T_SMS_GSM);
+	g_assert_cmpstr(bmsg->folder, ==, "telecom/msg/outbox");
+	g_assert_cmpint(bmsg->nenvelopes, ==, 1);
+	g_assert_cmpint(bmsg->part_id, ==, 12);
+	g_assert_cmpint(bmsg->encoding, ==, BMSG_E_G_7BIT);
+	g_assert_cmpint(bmsg->charset, ==, BMSG_C_UTF8);
+	g_assert_cmpint(bmsg->language, ==, BMSG_L_FRENCH);
+	g_assert_cmpuint(bmsg->length, ==, 24);
+
+	g_assert_cmpuint(g_slist_length(bmsg->originators), ==, 1);
+	vc = bmsg->originators->data;
+	g_assert_cmpint(vc->version, ==, BMSG_VCARD_21);
+	g_assert_cmpstr(vc->n, ==, "Me");
+	g_assert_cmpstr(vc->tel, ==, "+1");
+
+	/* In the order they were sent */
+	for (l = bmsg->recipients[0], i = 0; l; l = l->next, i++) {
+		char *expected;
+
+		vc = l->data;
+		g_assert_cmpint(vc->version, ==, BMSG_VCARD_30);
+
+		expected = g_strdup_printf("Name %d", i);
+		g_assert_cmpstr(vc->n, ==, expected);
+		g_free(expected);
+
+		expected = g_strdup_printf("a%d@b.c", i);
+		g_assert_cmpstr(vc->email, ==, expected);
+		g_free(expected);
+	}
+
+	g_assert_cmpint(i, ==, 50);
+
+	bmsg_free(bmsg);
+	bmsg_parser_free(pd);
+	g_string_free(msg, TRUE);
+}
+
+static void test_invalid(void)
+{
+	static const char *invalid[] = {
+		"BEGIN:BMSG\r\nVERSION:2.0\r\n",
+		"BEGIN:BMSG\r\nVERSION:1.0\r\nSTATUS:UNREADX\r\n",
+		"BEGIN:BMSG\r\nVERSION:1.0\r\nSTATUS:READ\r\nTYPE:FAX\r\n",
+		"BEGIN:BMSG\r\nVERSION:1.0\r\nSTATUS:READ\r\nTYPE:MMS\r\n"
+			"FOLDER:\r\nBEGIN:BBODY\r\n",
+		"BEGIN:BMSG\r\nVERSION:1.0\r\nSTATUS:READ\r\nTYPE:MMS\r\n"
+			"FOLDER:\r\nBEGIN:BENV\r\nBEGIN:BENV\r\n"
+			"BEGIN:BENV\r\nBEGIN:BENV\r\n",
+		"BEGIN:BMSG\r\nVERSION:1.0\r\nSTATUS:READ\r\nTYPE:MMS\r\n"
+			"FOLDER:\r\nBEGIN:BENV\r\nBEGIN:BBODY\r\n"
+			"PARTID:65536\r\n",
+		"BEGIN:BMSG\r\nVERSION:1.0\r\nSTATUS:READ\r\nTYPE:MMS\r\n"
+			"FOLDER:\r\nBEGIN:BENV\r\nBEGIN:BBODY\r\n"
+			"LENGTH:12a\r\n",
+		"BEGIN:BMSG\r\nVERSION:1.0\r\nSTATUS:READ\r\nTYPE:MMS\r\n"
+			"FOLDER:\r\nBEGIN:VCARD\r\nVERSION:4.0\r\n",
+	};
+	struct result res;
+	GString *line;
+	gsize start;
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(invalid); i++) {
+		parse(invalid[i], strlen(invalid[i]), strlen(invalid[i]),
+									&res);
+		g_assert_cmpint(res.ret, ==, -EBADR);
+
+		check_splits(invalid[i], strlen(invalid[i]), 16, 10);
+	}
+
+	/* Lines up to BMSG_LINE_MAX are fine, split or not */
+	for (i = BMSG_LINE_MAX - 1; i <= BMSG_LINE_MAX + 2; i++) {
+		line = g_string_new("BEGIN:BMSG\r\nVERSION:1.0\r\n"
+					"STATUS:READ\r\nTYPE:MMS\r\n");
+		start = line->len;
+
+		g_string_append(line, "FOLDER:");
+		while (line->len - start < i)
+			g_string_append_c(line, 'x');
+		g_string_append(line, "\r\n");
+
+		parse(line->str, line->len, line->len, &res);
+		g_assert_cmpint(res.ret, ==, i > BMSG_LINE_MAX ? -EBADR : 1);
+
+		check_splits(line->str, line->len, 40, 50);
+		check_splits(line->str, line->len - 1, 40, 50);
+
+		g_string_free(line, TRUE);
+	}
+}
+
+static void load_corpus(void)
+{
+	GError *err = NULL;
+	const char *name;
+	GDir *dir;
+
+	dir = g_dir_open(CORPUSDIR, 0, &err);
+	if (dir == NULL)
+		g_error("%s", err->message);
+
+	while ((name = g_dir_read_name(dir)) != NULL) {
+		struct sample *sample;
+		char *path;
+
+		if (!g_str_has_suffix(name, ".bmsg"))
+			continue;
+
+		sample = g_new0(struct sample, 1);
+		sample->name = g_strdup(name);
+
+		path = g_build_filename(CORPUSDIR, name, NULL);
+		if (!g_file_get_contents(path, &sample->data, &sample->len,
+									&err))
+			g_error("%s", err->message);
+		g_free(path);
+
+		corpus = g_slist_prepend(corpus, sample);
+	}
+
+	g_dir_close(dir);
+
+	if (corpus == NULL)
+		g_error("No samples in %s", CORPUSDIR);
+}
+
+/* Every sample is valid: the header ends right before the message */
+static void test_corpus(void)
+{
+	GSList *l;
+
+	for (l = corpus; l; l = l->next) {
+		struct sample *sample = l->data;
+		struct result res;
+
+		if (g_test_verbose())
+			g_print("%s\n", sample->name);
+
+		parse(sample->data, sample->len, sample->len, &res);
+		g_assert_cmpint(res.ret, ==, 0);
+		g_assert(g_str_has_prefix(sample->data + res.header,
+							"BEGIN:MSG\r\n"));
+		g_free(res.desc);
+
+		check_splits(sample->data, sample->len, 300, 50);
+	}
+}
+
+static void corrupt(GString *data)
+{
+	static const char bytes[] = "\r\n:;.\0\xff";
+	int i, n = g_random_int_range(1, 5);
+
+	for (i = 0; i < n && data->len > 0; i++) {
+		gsize pos = g_random_int_range(0, data->len);
+		gsize src, len;
+		char *copy;
+
+		switch (g_random_int_range(0, 5)) {
+		case 0:
+			data->str[pos] = g_random_int_range(0, 256);
+			break;
+		case 1:
+			data->str[pos] = bytes[g_random_int_range(0,
+							sizeof(bytes) - 1)];
+			break;
+		case 2:
+			len = g_random_int_range(1, 64);
+			g_string_erase(data, pos, MIN(len, data->len - pos));
+			break;
+		case 3:
+			/* Repeats a piece of the message somewhere else */
+			src = g_random_int_range(0, data->len);
+			len = MIN((gsize) g_random_int_range(1, 64),
+							data->len - src);
+			copy = g_memdup(data->str + src, len);
+			g_string_insert_len(data, pos, copy, len);
+			g_free(copy);
+			break;
+		case 4:
+			g_string_truncate(data, pos);
+			break;
+		}
+	}
+}
+
+static void test_fuzz(void)
+{
+	guint n = g_slist_length(corpus);
+	int i;
+
+	for (i = 0; i < FUZZ_ROUNDS; i++) {
+		struct sample *sample = g_slist_nth_data(corpus,
+						g_random_int_range(0, n));
+		GString *data = g_string_new_len(sample->data, sample->len);
+		char *copy;
+
+		corrupt(data);
+
+		/* Out of the GString slack, so overreads show under ASan */
+		copy = g_memdup(data->str, data->len);
+		check_splits(copy, data->len, 0, 4);
+		g_free(copy);
+
+		g_string_free(data, TRUE);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	load_corpus();
+
+	g_test_add_func("/bmsg/fields", test_fields);
+	g_test_add_func("/bmsg/invalid", test_invalid);
+	g_test_add_func("/bmsg/corpus", test_corpus);
+	g_test_add_func("/bmsg/fuzz", test_fuzz);
+
+	return g_test_run();
+}
@@ -0,0 +1,82 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* The parts of src/main.c and src/obex.c that plugins and src/mimetype.c
+ * link against, so test programs can drive a mime type driver directly */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <glib.h>
+
+#include <openobex/obex.h>
+
+#include "obex.h"
+#include "core.h"
+
+const char *test_option_root = "/tmp";
+gboolean test_option_symlinks = FALSE;
+gboolean test_option_async_io = FALSE;
+gboolean test_option_atomic_put = FALSE;
+size_t test_option_write_buffer = 64 * 1024;
+
+const char *obex_option_root_folder(void)
+{
+	return test_option_root;
+}
+
+gboolean obex_option_symlinks(void)
+{
+	return test_option_symlinks;
+}
+
+gboolean obex_option_async_io(void)
+{
+	return test_option_async_io;
+}
+
+gboolean obex_option_atomic_put(void)
+{
+	return test_option_atomic_put;
+}
+
+size_t obex_option_write_buffer(void)
+{
+	return test_option_write_buffer;
+}
+
+int memncmp0(const void *a, size_t na, const void *b, size_t nb)
+{
+	if (na != nb)
+		return na - nb;
+
+	if (a == NULL)
+		return -(a != b);
+
+	if (b == NULL)
+		return a != b;
+
+	return memcmp(a, b, na);
+}
@@ -0,0 +1,220 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* The message group index against the linear msg_grp array it replaced,
+ * on the tracker backend's workload: listing every message twice, deleting
+ * some one by one and then deleting every group.
+ *
+ * Usage: groups-bench [messages] [groups]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+
+#include "messages-groups.h"
+
+/* The array the index replaced, as messages-tracker.c used it */
+
+static void *array_new(void)
+{
+	return g_array_new(FALSE, FALSE, sizeof(int *));
+}
+
+static void array_add(void *index, int handle, int igrp)
+{
+	GArray *msg_grp = index;
+	int *group;
+	unsigned i;
+
+	for (i = 0; i < msg_grp->len; i++) {
+		if (handle == g_array_index(msg_grp, int *, i)[1])
+			return;
+	}
+
+	group = g_new0(int, 2);
+	group[0] = igrp;
+	group[1] = handle;
+	g_array_append_val(msg_grp, group);
+}
+
+static void array_remove(void *index, int handle)
+{
+	GArray *msg_grp = index;
+	unsigned i;
+
+	for (i = 0; i < msg_grp->len; i++) {
+		int *data = g_array_index(msg_grp, int *, i);
+
+		if (handle == data[1]) {
+			g_free(data);
+			g_array_remove_index_fast(msg_grp, i);
+			break;
+		}
+	}
+}
+
+static void array_remove_group(void *index, int grp,
+				message_groups_func func, void *user_data)
+{
+	GArray *msg_grp = index;
+	unsigned i;
+
+	for (i = 0; i < msg_grp->len; i++) {
+		int *data = g_array_index(msg_grp, int *, i);
+
+		if (grp == data[0]) {
+			func(data[1], user_data);
+
+			g_free(data);
+			g_array_remove_index_fast(msg_grp, i);
+			/* last element becomes i-th */
+			i--;
+		}
+	}
+}
+
+static void array_free(void *index)
+{
+	GArray *msg_grp = index;
+	unsigned i;
+
+	for (i = 0; i < msg_grp->len; i++)
+		g_free(g_array_index(msg_grp, int *, i));
+
+	g_array_free(msg_grp, TRUE);
+}
+
+static void *hash_new(void)
+{
+	return message_groups_new();
+}
+
+static void hash_add(void *index, int handle, int group)
+{
+	message_groups_add(index, handle, group);
+}
+
+static void hash_remove(void *index, int handle)
+{
+	message_groups_remove(index, handle);
+}
+
+static void hash_remove_group(void *index, int group,
+				message_groups_func func, void *user_data)
+{
+	message_groups_remove_group(index, group, func, user_data);
+}
+
+static void hash_free(void *index)
+{
+	message_groups_free(index);
+}
+
+struct index {
+	const char *name;
+	void *(*new) (void);
+	void (*add) (void *index, int handle, int group);
+	void (*remove) (void *index, int handle);
+	void (*remove_group) (void *index, int group,
+				message_groups_func func, void *user_data);
+	void (*free) (void *index);
+};
+
+static const struct index indexes[] = {
+	{ "array", array_new, array_add, array_remove, array_remove_group,
+		array_free },
+	{ "hash", hash_new, hash_add, hash_remove, hash_remove_group,
+		hash_free },
+};
+
+static void count_deleted(int handle, void *user_data)
+{
+	long *sum = user_data;
+
+	*sum += handle;
+}
+
+static void run(const struct index *index, int messages, int groups)
+{
+	void *data = index->new();
+	GTimer *timer = g_timer_new();
+	double listed, removed;
+	long sum = 0, expected = 0;
+	int i;
+
+	/* Listing adds every message, listing again finds them known */
+	for (i = 0; i < 2 * messages; i++)
+		index->add(data, i % messages, i % messages % groups);
+
+	listed = g_timer_elapsed(timer, NULL);
+
+	/* A tenth are deleted one by one */
+	for (i = 0; i < messages; i += 10)
+		index->remove(data, i);
+
+	removed = g_timer_elapsed(timer, NULL);
+
+	for (i = 0; i < groups; i++)
+		index->remove_group(data, i, count_deleted, &sum);
+
+	for (i = 0; i < messages; i++)
+		if (i % 10 != 0)
+			expected += i;
+
+	if (sum != expected) {
+		fprintf(stderr, "%s: wrong messages deleted\n", index->name);
+		exit(1);
+	}
+
+	printf("%-6s list %9.3f ms, delete %9.3f ms, "
+			"delete groups %9.3f ms\n", index->name,
+			listed * 1e3, (removed - listed) * 1e3,
+			(g_timer_elapsed(timer, NULL) - removed) * 1e3);
+
+	g_timer_destroy(timer);
+	index->free(data);
+}
+
+int main(int argc, char *argv[])
+{
+	int messages = argc > 1 ? atoi(argv[1]) : 100000;
+	int groups = argc > 2 ? atoi(argv[2]) : 1000;
+	unsigned int i;
+
+	if (messages <= 0 || groups <= 0) {
+		fprintf(stderr, "usage: %s [messages] [groups]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%d messages in %d groups\n", messages, groups);
+
+	for (i = 0; i < G_N_ELEMENTS(indexes); i++)
+		run(&indexes[i], messages, groups);
+
+	return 0;
+}
@@ -0,0 +1,333 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <glib.h>
+
+#include "messages.h"
+#include "messages-listing.h"
+
+static int live_messages;
+
+static struct messages_message *new_message(int handle)
+{
+	struct messages_message *msg = g_new0(struct messages_message, 1);
+
+	msg->handle = g_strdup_printf("%d", handle);
+	live_messages++;
+
+	return msg;
+}
+
+static void free_message(gpointer data)
+{
+	struct messages_message *msg = data;
+
+	g_free(msg->handle);
+	g_free(msg);
+	live_messages--;
+}
+
+static void insert(struct listing_index *index, int handle, const char *date)
+{
+	listing_index_insert(index, new_message(handle), handle, date);
+}
+
+/* Handles in listing order, as a string */
+static char *listed(struct listing_index *index)
+{
+	GString *str = g_string_new("");
+	GSequenceIter *iter;
+
+	iter = g_sequence_get_begin_iter(index->entries);
+	for (; !g_sequence_iter_is_end(iter);
+				iter = g_sequence_iter_next(iter)) {
+		struct listing_entry *entry = g_sequence_get(iter);
+
+		g_assert(g_hash_table_lookup(index->handles,
+				GINT_TO_POINTER(entry->handle)) == iter);
+
+		g_string_append_printf(str, "%s%d", str->len ? " " : "",
+							entry->handle);
+	}
+
+	g_assert(g_sequence_get_length(index->entries) ==
+						listing_index_size(index));
+
+	return g_string_free(str, FALSE);
+}
+
+static void assert_listed(struct listing_index *index, const char *expected)
+{
+	char *str = listed(index);
+
+	g_assert_cmpstr(str, ==, expected);
+	g_free(str);
+}
+
+static struct listing_entry *lookup(struct listing_index *index, int handle)
+{
+	GSequenceIter *iter;
+
+	iter = g_hash_table_lookup(index->handles, GINT_TO_POINTER(handle));
+	if (iter == NULL)
+		return NULL;
+
+	return g_sequence_get(iter);
+}
+
+/* A cache holding 1 to 3, sent in that order */
+static void build_cache(struct listing_cache *cache)
+{
+	struct listing_index *build = listing_index_new(free_message);
+	unsigned int changes = cache->changes;
+
+	cache->building = TRUE;
+
+	insert(build, 1, "2010-01-01T10:00:00Z");
+	insert(build, 2, "2010-01-02T10:00:00Z");
+	insert(build, 3, "2010-01-03T10:00:00Z");
+
+	g_assert(listing_cache_publish(cache, build, changes));
+	g_assert(!cache->building);
+	assert_listed(cache->index, "3 2 1");
+}
+
+static void test_index_order(void)
+{
+	struct listing_index *index = listing_index_new(free_message);
+
+	insert(index, 5, "2010-05-01T10:00:00Z");
+	insert(index, 1, "2010-01-01T10:00:00Z");
+	insert(index, 9, "2010-09-01T10:00:00Z");
+	insert(index, 2, "2010-05-01T10:00:00Z");
+	assert_listed(index, "9 5 2 1");
+
+	/* Inserting a known handle again moves it */
+	insert(index, 1, "2010-12-01T10:00:00Z");
+	assert_listed(index, "1 9 5 2");
+	g_assert_cmpint(live_messages, ==, 4);
+
+	listing_index_remove(index, 9);
+	listing_index_remove(index, 42);
+	assert_listed(index, "1 5 2");
+	g_assert_cmpint(live_messages, ==, 3);
+
+	listing_index_unref(index);
+	g_assert_cmpint(live_messages, ==, 0);
+}
+
+static void test_remove(void)
+{
+	struct listing_cache cache = { "inbox" };
+	unsigned int changes, removals;
+
+	build_cache(&cache);
+
+	changes = cache.changes;
+	removals = cache.removals;
+
+	listing_cache_remove(&cache, 2);
+	assert_listed(cache.index, "3 1");
+	g_assert(cache.changes != changes);
+	g_assert(cache.removals != removals);
+
+	/* Unknown messages count as removals too, they may be in flight */
+	removals = cache.removals;
+	listing_cache_remove(&cache, 42);
+	assert_listed(cache.index, "3 1");
+	g_assert(cache.removals != removals);
+
+	listing_cache_drop(&cache);
+	g_assert(cache.index == NULL);
+	g_assert_cmpint(live_messages, ==, 0);
+}
+
+static void test_set_read(void)
+{
+	struct listing_cache cache = { "inbox" };
+	struct listing_index *snapshot;
+	unsigned int changes;
+
+	build_cache(&cache);
+
+	/* A listing being served sees the change */
+	snapshot = listing_index_ref(cache.index);
+	changes = cache.changes;
+
+	listing_cache_set_read(&cache, 2, TRUE);
+	g_assert(lookup(snapshot, 2)->msg->read);
+	g_assert(!lookup(snapshot, 1)->msg->read);
+	g_assert(cache.changes != changes);
+
+	listing_cache_set_read(&cache, 2, FALSE);
+	g_assert(!lookup(cache.index, 2)->msg->read);
+
+	listing_cache_set_read(&cache, 42, TRUE);
+	assert_listed(cache.index, "3 2 1");
+
+	/* Dropping the cache leaves the snapshot intact */
+	listing_cache_drop(&cache);
+	assert_listed(snapshot, "3 2 1");
+	listing_index_unref(snapshot);
+	g_assert_cmpint(live_messages, ==, 0);
+}
+
+/* Any change while the folder is being listed makes the build stale */
+static void test_publish_stale(void)
+{
+	struct listing_cache cache = { "inbox" };
+	struct listing_index *build;
+	unsigned int start;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		build = listing_index_new(free_message);
+		cache.building = TRUE;
+		start = cache.changes;
+
+		insert(build, 1, "2010-01-01T10:00:00Z");
+
+		switch (i) {
+		case 0:
+			listing_cache_remove(&cache, 1);
+			break;
+		case 1:
+			listing_cache_set_read(&cache, 1, TRUE);
+			break;
+		case 2:
+			g_assert(!listing_cache_invalidate(&cache, 1));
+			break;
+		case 3:
+			listing_cache_drop(&cache);
+			break;
+		}
+
+		g_assert(!listing_cache_publish(&cache, build, start));
+		g_assert(cache.index == NULL);
+		g_assert(!cache.building);
+		g_assert_cmpint(live_messages, ==, 0);
+	}
+
+	/* An aborted build */
+	cache.building = TRUE;
+	g_assert(!listing_cache_publish(&cache, NULL, cache.changes));
+	g_assert(!cache.building);
+
+	/* A listing already cached by another build is kept */
+	build_cache(&cache);
+	build = listing_index_new(free_message);
+	insert(build, 4, "2010-01-04T10:00:00Z");
+	g_assert(!listing_cache_publish(&cache, build, cache.changes));
+	assert_listed(cache.index, "3 2 1");
+
+	listing_cache_drop(&cache);
+	g_assert_cmpint(live_messages, ==, 0);
+}
+
+static void test_update(void)
+{
+	struct listing_cache cache = { "inbox" };
+	struct messages_message *msg;
+	unsigned int removals;
+
+	/* Nothing cached, nothing to look up */
+	g_assert(!listing_cache_invalidate(&cache, 2));
+	msg = new_message(2);
+	g_assert(!listing_cache_update(&cache, cache.removals, msg, 2,
+						"2010-01-05T10:00:00Z"));
+	free_message(msg);
+
+	build_cache(&cache);
+
+	/* Updated messages are taken out until found again */
+	g_assert(listing_cache_invalidate(&cache, 2));
+	assert_listed(cache.index, "3 1");
+	removals = cache.removals;
+
+	msg = new_message(2);
+	g_assert(listing_cache_update(&cache, removals, msg, 2,
+						"2010-01-05T10:00:00Z"));
+	assert_listed(cache.index, "2 3 1");
+
+	/* Moved to another folder, the lookup finds nothing */
+	g_assert(listing_cache_invalidate(&cache, 3));
+	assert_listed(cache.index, "2 1");
+
+	/* Deleted while it was looked up */
+	g_assert(listing_cache_invalidate(&cache, 1));
+	removals = cache.removals;
+	listing_cache_remove(&cache, 1);
+
+	msg = new_message(1);
+	g_assert(!listing_cache_update(&cache, removals, msg, 1,
+						"2010-01-01T10:00:00Z"));
+	free_message(msg);
+	g_assert(cache.index == NULL);
+	g_assert(!cache.overflow);
+	g_assert_cmpint(live_messages, ==, 0);
+}
+
+static void test_update_overflow(void)
+{
+	struct listing_cache cache = { "inbox" };
+	struct listing_index *build = listing_index_new(free_message);
+	struct messages_message *msg;
+	int i;
+
+	for (i = 1; i <= LISTING_CACHE_MAX; i++)
+		insert(build, i, "2010-01-01T10:00:00Z");
+
+	g_assert(listing_cache_publish(&cache, build, cache.changes));
+
+	g_assert(listing_cache_invalidate(&cache, LISTING_CACHE_MAX + 1));
+
+	msg = new_message(LISTING_CACHE_MAX + 1);
+	g_assert(!listing_cache_update(&cache, cache.removals, msg,
+				LISTING_CACHE_MAX + 1, "2010-01-02T10:00:00Z"));
+	free_message(msg);
+
+	/* Too big to keep up to date, listings fall back to paging */
+	g_assert(cache.overflow);
+	g_assert(cache.index == NULL);
+	g_assert_cmpint(live_messages, ==, 0);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/listing-cache/index-order", test_index_order);
+	g_test_add_func("/listing-cache/remove", test_remove);
+	g_test_add_func("/listing-cache/set-read", test_set_read);
+	g_test_add_func("/listing-cache/publish-stale", test_publish_stale);
+	g_test_add_func("/listing-cache/update", test_update);
+	g_test_add_func("/listing-cache/update-overflow",
+						test_update_overflow);
+
+	return g_test_run();
+}
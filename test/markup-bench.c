@@ -0,0 +1,252 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Message listing entries with every attribute, built the old way through
+ * g_markup_printf_escaped() and the new way through plugins/markup.c. The
+ * outputs are compared before anything is timed.
+ *
+ * Usage: markup-bench [entries] [rounds]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "markup.h"
+
+#define SUBJECT_LEN 256
+
+struct entry {
+	char *handle;
+	char *subject;
+	char *datetime;
+	char *sender_name;
+	char *sender_addressing;
+	char *recipient_name;
+	char *recipient_addressing;
+	char *size;
+	gboolean read;
+	gboolean sent;
+};
+
+static const char *subjects[] = {
+	"See you at 5?",
+	"Fish & chips <tonight>",
+	"Tarvitsetko kyydin? N\xc3\xa4hd\xc3\xa4\xc3\xa4n huomenna "
+		"\xe2\x82\xac",
+	"\"Quoted\" and 'apostrophes'",
+};
+
+static struct entry *build_entries(int count)
+{
+	struct entry *entries = g_new0(struct entry, count);
+	int i;
+
+	for (i = 0; i < count; i++) {
+		struct entry *e = &entries[i];
+
+		e->handle = g_strdup_printf("%d", 1000 + i);
+		e->subject = g_strdup(subjects[i % G_N_ELEMENTS(subjects)]);
+		e->datetime = g_strdup_printf("201005%02dT%02d%02d00",
+						i % 28 + 1, i % 24, i % 60);
+		e->sender_name = g_strdup_printf("Contact %d", i % 50);
+		e->sender_addressing = g_strdup_printf("+358%07d", i % 50);
+		e->recipient_name = g_strdup("");
+		e->recipient_addressing = g_strdup("");
+		e->size = g_strdup_printf("%d", 20 + i % 140);
+		e->read = i % 3 == 0;
+		e->sent = FALSE;
+	}
+
+	return entries;
+}
+
+static void free_entries(struct entry *entries, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		struct entry *e = &entries[i];
+
+		g_free(e->handle);
+		g_free(e->subject);
+		g_free(e->datetime);
+		g_free(e->sender_name);
+		g_free(e->sender_addressing);
+		g_free(e->recipient_name);
+		g_free(e->recipient_addressing);
+		g_free(e->size);
+	}
+
+	g_free(entries);
+}
+
+static const char *yesorno(gboolean a)
+{
+	return a ? "yes" : "no";
+}
+
+/* What get_messages_listing_cb() did before markup.c */
+static void append_escaped_printf(GString *string, const char *format, ...)
+{
+	va_list ap;
+	char *escaped;
+
+	va_start(ap, format);
+	escaped = g_markup_vprintf_escaped(format, ap);
+	g_string_append(string, escaped);
+	g_free(escaped);
+	va_end(ap);
+}
+
+static void old_entry(GString *buf, const struct entry *e)
+{
+	const char *end;
+	char *subject;
+
+	g_string_append(buf, "<msg");
+	append_escaped_printf(buf, " handle=\"%s\"", e->handle);
+
+	subject = g_strdup(e->subject);
+	g_utf8_validate(subject, SUBJECT_LEN, &end);
+	*((char *) end) = '\0';
+	append_escaped_printf(buf, " subject=\"%s\"", subject);
+	g_free(subject);
+
+	append_escaped_printf(buf, " datetime=\"%s\"", e->datetime);
+	append_escaped_printf(buf, " sender_name=\"%s\"", e->sender_name);
+	append_escaped_printf(buf, " sender_addressing=\"%s\"",
+						e->sender_addressing);
+	append_escaped_printf(buf, " recipient_name=\"%s\"",
+						e->recipient_name);
+	append_escaped_printf(buf, " recipient_addressing=\"%s\"",
+						e->recipient_addressing);
+	append_escaped_printf(buf, " type=\"%s\"", "SMS_GSM");
+	append_escaped_printf(buf, " size=\"%s\"", e->size);
+	append_escaped_printf(buf, " read=\"%s\"", yesorno(e->read));
+	append_escaped_printf(buf, " sent=\"%s\"", yesorno(e->sent));
+	g_string_append(buf, "/>\n");
+}
+
+static void new_entry(GString *buf, const struct entry *e)
+{
+	g_string_append(buf, "<msg");
+	markup_append_attribute(buf, " handle=\"", e->handle);
+
+	g_string_append(buf, " subject=\"");
+	markup_append_escaped(buf, e->subject,
+			markup_utf8_prefix(e->subject, SUBJECT_LEN));
+	g_string_append_c(buf, '"');
+
+	markup_append_attribute(buf, " datetime=\"", e->datetime);
+	markup_append_attribute(buf, " sender_name=\"", e->sender_name);
+	markup_append_attribute(buf, " sender_addressing=\"",
+						e->sender_addressing);
+	markup_append_attribute(buf, " recipient_name=\"",
+						e->recipient_name);
+	markup_append_attribute(buf, " recipient_addressing=\"",
+						e->recipient_addressing);
+	markup_append_attribute(buf, " type=\"", "SMS_GSM");
+	markup_append_attribute(buf, " size=\"", e->size);
+	markup_append_attribute(buf, " read=\"", yesorno(e->read));
+	markup_append_attribute(buf, " sent=\"", yesorno(e->sent));
+	g_string_append(buf, "/>\n");
+}
+
+static void build_listing(GString *buf, const struct entry *entries,
+		int count, void (*append)(GString *, const struct entry *))
+{
+	int i;
+
+	g_string_truncate(buf, 0);
+
+	for (i = 0; i < count; i++)
+		append(buf, &entries[i]);
+}
+
+static double run(const char *name, GString *buf, const struct entry *entries,
+		int count, int rounds,
+		void (*append)(GString *, const struct entry *))
+{
+	GTimer *timer = g_timer_new();
+	double elapsed;
+	int i;
+
+	for (i = 0; i < rounds; i++)
+		build_listing(buf, entries, count, append);
+
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	printf("%-24s %8.3f ms per listing, %6.1f MB/s\n", name,
+				elapsed * 1e3 / rounds,
+				buf->len * (double) rounds / elapsed / 1e6);
+
+	return elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+	int count = argc > 1 ? atoi(argv[1]) : 1024;
+	int rounds = argc > 2 ? atoi(argv[2]) : 200;
+	struct entry *entries;
+	GString *old, *new;
+	double t_old, t_new;
+
+	if (count <= 0 || rounds <= 0) {
+		fprintf(stderr, "usage: %s [entries] [rounds]\n", argv[0]);
+		return 1;
+	}
+
+	entries = build_entries(count);
+	old = g_string_sized_new(count * 256);
+	new = g_string_sized_new(count * 256);
+
+	build_listing(old, entries, count, old_entry);
+	build_listing(new, entries, count, new_entry);
+
+	if (old->len != new->len || memcmp(old->str, new->str, old->len)) {
+		fprintf(stderr, "Listings differ\n");
+		return 1;
+	}
+
+	printf("%d entries, %zu bytes\n", count, new->len);
+
+	t_old = run("g_markup_printf_escaped", old, entries, count, rounds,
+								old_entry);
+	t_new = run("markup_append_escaped", new, entries, count, rounds,
+								new_entry);
+
+	printf("%.1fx faster\n", t_old / t_new);
+
+	g_string_free(old, TRUE);
+	g_string_free(new, TRUE);
+	free_entries(entries, count);
+
+	return 0;
+}
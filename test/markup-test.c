@@ -0,0 +1,211 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Golden tests: the message listing attributes built by plugins/markup.c
+ * must match, byte for byte, what g_markup_printf_escaped() produced for
+ * them before. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <glib.h>
+
+#include "markup.h"
+
+static const char *samples[] = {
+	"",
+	"plain text",
+	"a&b<c>d'e\"f",
+	"&amp; already escaped",
+	"tab\tnewline\ncr\r",
+	"del\x7f" "del",
+	"nel\xc2\x85" "nel",
+	"nbsp\xc2\xa0" "nbsp",
+	"c2 without continuation \xc2" "A",
+	"c2 at the end \xc2",
+	"c2 before c2 \xc2\xc2\x80",
+	"latin \xc3\xa9t\xc3\xa9",
+	"euro \xe2\x82\xac and emoji \xf0\x9f\x98\x80",
+	"truncated three byte \xe2\x82",
+	"truncated four byte \xf0\x9f\x98",
+	"stray continuation \x80\xbf",
+	"mixed <\x01\xc2\x9f&\xe2\x82\xac\x1f>",
+};
+
+/* What get_messages_listing_cb() did before markup.c */
+static char *old_attribute(const char *value)
+{
+	return g_markup_printf_escaped(" name=\"%s\"", value);
+}
+
+static char *old_subject(const char *value, size_t len)
+{
+	char *subject, *ret;
+	const char *end;
+
+	subject = g_strdup(value);
+
+	g_utf8_validate(subject, len, &end);
+	*((char *) end) = '\0';
+
+	ret = g_markup_printf_escaped(" subject=\"%s\"", subject);
+	g_free(subject);
+
+	return ret;
+}
+
+static char *new_attribute(const char *value)
+{
+	GString *buf = g_string_new("");
+
+	markup_append_attribute(buf, " name=\"", value);
+
+	return g_string_free(buf, FALSE);
+}
+
+static char *new_subject(const char *value, size_t len)
+{
+	GString *buf = g_string_new(" subject=\"");
+
+	markup_append_escaped(buf, value, markup_utf8_prefix(value, len));
+	g_string_append_c(buf, '"');
+
+	return g_string_free(buf, FALSE);
+}
+
+static void check_attribute(const char *value)
+{
+	char *old = old_attribute(value);
+	char *new = new_attribute(value);
+
+	g_assert_cmpstr(new, ==, old);
+
+	g_free(old);
+	g_free(new);
+}
+
+static void check_subject(const char *value)
+{
+	size_t len, max = strlen(value) + 2;
+
+	/* Every truncation point, so sequences get cut in the middle */
+	for (len = 0; len <= max; len++) {
+		char *old = old_subject(value, len);
+		char *new = new_subject(value, len);
+
+		g_assert_cmpstr(new, ==, old);
+
+		g_free(old);
+		g_free(new);
+	}
+}
+
+static void test_samples(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(samples); i++) {
+		check_attribute(samples[i]);
+		check_subject(samples[i]);
+	}
+}
+
+static void test_null(void)
+{
+	check_attribute(NULL);
+}
+
+/* Each C0 control and DEL, alone and between text */
+static void test_c0(void)
+{
+	char value[8];
+	unsigned int c;
+
+	for (c = 0x01; c <= 0x7f; c++) {
+		if (c > 0x1f && c < 0x7f)
+			continue;
+
+		g_snprintf(value, sizeof(value), "%c", c);
+		check_attribute(value);
+		check_subject(value);
+
+		g_snprintf(value, sizeof(value), "a%cb", c);
+		check_attribute(value);
+		check_subject(value);
+	}
+}
+
+/* U+0080 to U+00BF, covering the C1 controls, U+0085 and their
+ * neighbours */
+static void test_c1(void)
+{
+	char value[8];
+	unsigned int c;
+
+	for (c = 0x80; c <= 0xbf; c++) {
+		g_snprintf(value, sizeof(value), "%c%c", 0xc2, c);
+		check_attribute(value);
+		check_subject(value);
+
+		g_snprintf(value, sizeof(value), "a%c%cb", 0xc2, c);
+		check_attribute(value);
+		check_subject(value);
+	}
+}
+
+/* Random bytes, weighted towards the ones that get escaped */
+static void test_random(void)
+{
+	static const char pool[] = "ab&<>'\"\t\n\x01\x1f\x7f\xc2\x80\x85"
+							"\x9f\xa0\xe2\x82\xac";
+	char value[32];
+	int i, j;
+
+	for (i = 0; i < 20000; i++) {
+		int len = g_random_int_range(1, sizeof(value));
+
+		for (j = 0; j < len - 1; j++)
+			value[j] = pool[g_random_int_range(0,
+							sizeof(pool) - 1)];
+
+		value[len - 1] = '\0';
+
+		check_attribute(value);
+		check_subject(value);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/markup/samples", test_samples);
+	g_test_add_func("/markup/null", test_null);
+	g_test_add_func("/markup/c0", test_c0);
+	g_test_add_func("/markup/c1", test_c1);
+	g_test_add_func("/markup/random", test_random);
+
+	return g_test_run();
+}
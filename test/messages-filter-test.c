@@ -0,0 +1,585 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* The SPARQL rules from messages_filter_sparql() against the C filter
+ * messages_filter_match(): for random filters over a set of stored SMS,
+ * the rules must never drop a message the C filter accepts, and must
+ * accept exactly the same messages when they claim to be exact.
+ *
+ * The rules are evaluated here on a model of the rows the listing query
+ * joins: message, phone number, its local form and the contact having
+ * it. Only the rule forms the builder emits are understood, anything
+ * else fails the test. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+#include "messages.h"
+#include "messages-filter.h"
+
+#define LOCAL_DIGITS 7
+#define ROUNDS 2000
+
+struct contact {
+	const char *given;
+	const char *family;
+	const char *phone;
+};
+
+struct row {
+	gboolean sent;
+	gboolean read;
+	char sdate[21];		/* UTC, empty if unbound */
+	char rdate[21];
+	const char *phone;
+	const struct contact *contact;
+};
+
+static const struct contact contacts[] = {
+	{ "Ann", "Jones", "+358401234567" },
+	{ "John", "Johnson", "0409876543" },
+	{ "Mary Ann", "", "+15551230000" },
+	{ "", "O\"Brien\\", "0501112222" },
+	{ "\xc3\x84iti", "Virtanen", "+358505556666" },
+};
+
+/* Numbers as they appear on messages, some written differently from the
+ * contact's number and some belonging to no contact */
+static const char *numbers[] = {
+	"+358401234567", "0401234567", "0409876543", "+358409876543",
+	"+15551230000", "0501112222", "+358505556666", "12345", "+44700900123",
+	"Operator",
+};
+
+static GSList *rows;
+
+static const char *local_number(const char *phone)
+{
+	size_t len = strlen(phone);
+
+	return len > LOCAL_DIGITS ? phone + len - LOCAL_DIGITS : phone;
+}
+
+static const struct contact *find_contact(const char *phone)
+{
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(contacts); i++)
+		if (strcmp(local_number(contacts[i].phone),
+						local_number(phone)) == 0)
+			return &contacts[i];
+
+	return NULL;
+}
+
+/* Random time within 2010, in whole seconds */
+static time_t random_time(void)
+{
+	return 1262304000 + g_random_int_range(0, 365 * 24 * 3600);
+}
+
+/* Local times that don't map back to the same instant, around the DST
+ * changes, can't be compared in either direction */
+static gboolean ambiguous(time_t t)
+{
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	tm.tm_isdst = -1;
+
+	return mktime(&tm) != t;
+}
+
+static void utc_stamp(time_t t, char *buf)
+{
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	strftime(buf, 21, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+static char *map_stamp(time_t t)
+{
+	char buf[16];
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	strftime(buf, sizeof(buf), "%Y%m%dT%H%M%S", &tm);
+
+	return g_strdup(buf);
+}
+
+static void create_rows(void)
+{
+	int i;
+
+	for (i = 0; i < 300; i++) {
+		struct row *row = g_new0(struct row, 1);
+		time_t t;
+
+		do {
+			t = random_time();
+		} while (ambiguous(t));
+
+		row->sent = g_random_int_range(0, 2);
+		row->read = g_random_int_range(0, 2);
+		row->phone = numbers[g_random_int_range(0,
+						G_N_ELEMENTS(numbers))];
+		row->contact = find_contact(row->phone);
+
+		/* Received messages may lack a sent date */
+		if (row->sent || g_random_int_range(0, 4) > 0)
+			utc_stamp(t, row->sdate);
+
+		utc_stamp(t + g_random_int_range(0, 120), row->rdate);
+
+		rows = g_slist_prepend(rows, row);
+	}
+}
+
+/* What pull_message_data() makes of a row, as far as the filter cares */
+static void row2message(const struct row *row, struct messages_message *msg,
+								char **names)
+{
+	const char *stamp = row->sdate[0] ? row->sdate : row->rdate;
+	struct tm tm;
+	time_t t;
+
+	memset(msg, 0, sizeof(*msg));
+
+	memset(&tm, 0, sizeof(tm));
+	strptime(stamp, "%Y-%m-%dT%H:%M:%SZ", &tm);
+	t = timegm(&tm);
+	msg->datetime = map_stamp(t);
+
+	if (row->contact == NULL)
+		*names = g_strdup("");
+	else if (row->contact->family[0] == '\0')
+		*names = g_strdup(row->contact->given);
+	else if (row->contact->given[0] == '\0')
+		*names = g_strdup(row->contact->family);
+	else
+		*names = g_strdup_printf("%s %s", row->contact->given,
+						row->contact->family);
+
+	msg->sent = row->sent;
+	msg->read = row->read;
+	msg->type = "SMS_GSM";
+	msg->priority = FALSE;
+
+	if (row->sent) {
+		msg->recipient_name = *names;
+		msg->recipient_addressing = (char *) row->phone;
+	} else {
+		msg->sender_name = *names;
+		msg->sender_addressing = (char *) row->phone;
+		msg->recipient_addressing = "";
+	}
+}
+
+/* Reads a SPARQL string literal, returning where it ends */
+static const char *parse_string(const char *p, GString *out)
+{
+	g_assert(*p == '"');
+
+	for (p++; *p != '"'; p++) {
+		g_assert(*p != '\0');
+
+		if (*p != '\\') {
+			g_string_append_c(out, *p);
+			continue;
+		}
+
+		switch (*++p) {
+		case 'n':
+			g_string_append_c(out, '\n');
+			break;
+		case 'r':
+			g_string_append_c(out, '\r');
+			break;
+		case 't':
+			g_string_append_c(out, '\t');
+			break;
+		case '"':
+		case '\\':
+			g_string_append_c(out, *p);
+			break;
+		default:
+			g_assert_not_reached();
+		}
+	}
+
+	return p + 1;
+}
+
+static gboolean contains(const char *value, const char *str)
+{
+	return value != NULL && strstr(value, str) != NULL;
+}
+
+/* One operand of the party rule's disjunction */
+static gboolean eval_party_term(const char **pos, const struct row *row)
+{
+	static const char *ops[] = {
+		"fn:contains(nco:phoneNumber(?phone), ",
+		"fn:contains(nco:nameGiven(?cont), ",
+		"fn:contains(nco:nameFamily(?cont), ",
+	};
+	const char *p = *pos;
+	GString *str = g_string_new("");
+	gboolean match = FALSE;
+	unsigned int i;
+
+	if (g_str_has_prefix(p, "?lphone IN (")) {
+		p += strlen("?lphone IN (");
+
+		while (TRUE) {
+			g_string_truncate(str, 0);
+			p = parse_string(p, str);
+
+			if (strcmp(str->str, local_number(row->phone)) == 0)
+				match = TRUE;
+
+			if (*p == ')')
+				break;
+
+			g_assert(g_str_has_prefix(p, ", "));
+			p += 2;
+		}
+
+		*pos = p + 1;
+		g_string_free(str, TRUE);
+
+		return match;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(ops); i++)
+		if (g_str_has_prefix(p, ops[i]))
+			break;
+
+	g_assert(i < G_N_ELEMENTS(ops));
+
+	p = parse_string(p + strlen(ops[i]), str);
+	g_assert(*p == ')');
+
+	/* Unbound values make the term false */
+	if (i == 0)
+		match = contains(row->phone, str->str);
+	else if (row->contact != NULL)
+		match = contains(i == 1 ? row->contact->given :
+					row->contact->family, str->str);
+
+	*pos = p + 1;
+	g_string_free(str, TRUE);
+
+	return match;
+}
+
+static gboolean eval_period(const char **pos, const struct row *row)
+{
+	const char *prefix = "FILTER (COALESCE(nmo:sentDate(?msg), "
+					"nmo:receivedDate(?msg)) ";
+	const char *p = *pos;
+	const char *date = row->sdate[0] ? row->sdate : row->rdate;
+	GString *str = g_string_new("");
+	gboolean match;
+	int cmp;
+
+	g_assert(g_str_has_prefix(p, prefix));
+	p += strlen(prefix);
+
+	g_assert(g_str_has_prefix(p, ">= ") || g_str_has_prefix(p, "<= "));
+	p = parse_string(p + 3, str);
+	g_assert(g_str_has_prefix(p, "^^xsd:dateTime) . "));
+
+	/* Same fixed width UTC format on both sides */
+	cmp = strcmp(date, str->str);
+	match = (*pos)[strlen(prefix)] == '>' ? cmp >= 0 : cmp <= 0;
+
+	*pos = p + strlen("^^xsd:dateTime) . ");
+	g_string_free(str, TRUE);
+
+	return date[0] != '\0' && match;
+}
+
+static gboolean eval_rules(const char *rules, const struct row *row)
+{
+	const char *p = rules;
+	gboolean match = TRUE;
+
+	while (*p != '\0') {
+		if (g_str_has_prefix(p, "FILTER (!BOUND(?msg)) . ")) {
+			match = FALSE;
+			p += strlen("FILTER (!BOUND(?msg)) . ");
+		} else if (g_str_has_prefix(p, "?msg nmo:isRead ")) {
+			p += strlen("?msg nmo:isRead ");
+			if (g_str_has_prefix(p, "true . "))
+				match &= row->read;
+			else if (g_str_has_prefix(p, "false . "))
+				match &= !row->read;
+			else
+				g_assert_not_reached();
+			p = strstr(p, " . ") + 3;
+		} else if (g_str_has_prefix(p, "?msg nmo:isSent ")) {
+			p += strlen("?msg nmo:isSent ");
+			if (g_str_has_prefix(p, "true . "))
+				match &= row->sent;
+			else if (g_str_has_prefix(p, "false . "))
+				match &= !row->sent;
+			else
+				g_assert_not_reached();
+			p = strstr(p, " . ") + 3;
+		} else if (g_str_has_prefix(p, "FILTER (COALESCE(")) {
+			match &= eval_period(&p, row);
+		} else if (g_str_has_prefix(p, "FILTER (")) {
+			gboolean any = FALSE;
+
+			p += strlen("FILTER (");
+
+			while (TRUE) {
+				any |= eval_party_term(&p, row);
+				if (!g_str_has_prefix(p, " || "))
+					break;
+				p += 4;
+			}
+
+			g_assert(g_str_has_prefix(p, ") . "));
+			p += 4;
+			match &= any;
+		} else {
+			g_test_message("unknown rule: %s", p);
+			g_assert_not_reached();
+		}
+	}
+
+	return match;
+}
+
+/* Local numbers of the contacts whose names contain party, as
+ * contacts_matching() in the tracker backend does */
+static gboolean numbers_matching(const char *party, GSList **list)
+{
+	unsigned int i;
+
+	*list = NULL;
+
+	for (i = 0; i < G_N_ELEMENTS(contacts); i++)
+		if (contains(contacts[i].given, party) ||
+				contains(contacts[i].family, party))
+			*list = g_slist_prepend(*list, (char *)
+					local_number(contacts[i].phone));
+
+	return TRUE;
+}
+
+static gboolean numbers_too_many(const char *party, GSList **list)
+{
+	*list = NULL;
+
+	return FALSE;
+}
+
+static char *random_party(void)
+{
+	static const char *parties[] = {
+		"*", "", "**", "Ann", "ann", "Jo", "John", "son", "Jones",
+		"Mary Ann", "Ann Jones", "J*n", "?nn", "O\"Brien", "\\",
+		"\xc3\x84iti", "4567", "+358", "0409", "555", "Operator",
+		"nobody",
+	};
+	int i = g_random_int_range(0, G_N_ELEMENTS(parties) + 2);
+
+	if (i >= (int) G_N_ELEMENTS(parties))
+		return NULL;
+
+	return g_strdup(parties[i]);
+}
+
+static char *random_period(void)
+{
+	time_t t;
+
+	switch (g_random_int_range(0, 5)) {
+	case 0:
+	case 1:
+		return NULL;
+	case 2:
+		return g_strdup("garbage");
+	}
+
+	do {
+		t = random_time();
+	} while (ambiguous(t));
+
+	return map_stamp(t);
+}
+
+static void random_filter(struct messages_filter *filter)
+{
+	static const uint8_t types[] = { 0, 0, 0x01, 0x02, 0x0e, 0x0f };
+
+	memset(filter, 0, sizeof(*filter));
+
+	filter->type = types[g_random_int_range(0, G_N_ELEMENTS(types))];
+	filter->read_status = g_random_int_range(0, 3);
+	filter->priority = g_random_int_range(0, 3);
+	filter->period_begin = random_period();
+	filter->period_end = random_period();
+
+	switch (g_random_int_range(0, 3)) {
+	case 0:
+		filter->originator = random_party();
+		break;
+	case 1:
+		filter->recipient = random_party();
+		break;
+	default:
+		filter->originator = random_party();
+		filter->recipient = random_party();
+	}
+}
+
+static void free_filter(struct messages_filter *filter)
+{
+	g_free(filter->period_begin);
+	g_free(filter->period_end);
+	g_free(filter->originator);
+	g_free(filter->recipient);
+}
+
+static void check_filter(const struct messages_filter *filter,
+				messages_filter_numbers_func numbers_func)
+{
+	gboolean exact;
+	char *rules;
+	GSList *l;
+
+	rules = messages_filter_sparql(filter, numbers_func, &exact);
+
+	for (l = rows; l != NULL; l = l->next) {
+		struct row *row = l->data;
+		struct messages_message msg;
+		gboolean c, sparql;
+		char *names;
+
+		row2message(row, &msg, &names);
+
+		c = messages_filter_match(&msg, filter);
+		sparql = eval_rules(rules, row);
+
+		if (c != sparql && (c || exact)) {
+			g_test_message("rules: %s", rules);
+			g_test_message("message %s from %s (%s) read %d "
+					"sent %d: C %d, SPARQL %d",
+					msg.datetime, row->phone, names,
+					row->read, row->sent, c, sparql);
+			g_assert_not_reached();
+		}
+
+		g_free(msg.datetime);
+		g_free(names);
+	}
+
+	g_free(rules);
+}
+
+static void test_random(messages_filter_numbers_func numbers_func)
+{
+	struct messages_filter filter;
+	int i;
+
+	for (i = 0; i < ROUNDS; i++) {
+		random_filter(&filter);
+		check_filter(&filter, numbers_func);
+		free_filter(&filter);
+	}
+}
+
+static void test_names_in_query(void)
+{
+	test_random(NULL);
+}
+
+static void test_names_cached(void)
+{
+	test_random(numbers_matching);
+}
+
+static void test_names_too_many(void)
+{
+	test_random(numbers_too_many);
+}
+
+static void test_exact(void)
+{
+	struct messages_filter filter;
+	gboolean exact;
+	char *rules;
+
+	memset(&filter, 0, sizeof(filter));
+
+	filter.read_status = 0x01;
+	filter.period_begin = "20100601T000000";
+	filter.originator = "Ann";
+	rules = messages_filter_sparql(&filter, NULL, &exact);
+	g_assert(exact);
+	g_free(rules);
+
+	filter.originator = "Ann Jones";
+	rules = messages_filter_sparql(&filter, NULL, &exact);
+	g_assert(!exact);
+	g_free(rules);
+
+	filter.originator = NULL;
+	filter.period_begin = "garbage";
+	rules = messages_filter_sparql(&filter, NULL, &exact);
+	g_assert(!exact);
+	g_free(rules);
+}
+
+int main(int argc, char *argv[])
+{
+	/* Local time differs from UTC and has DST changes */
+	setenv("TZ", "EET-2EEST,M3.5.0/3,M10.5.0/4", 1);
+	tzset();
+
+	g_test_init(&argc, &argv, NULL);
+
+	create_rows();
+
+	g_test_add_func("/messages-filter/names-in-query",
+						test_names_in_query);
+	g_test_add_func("/messages-filter/names-cached", test_names_cached);
+	g_test_add_func("/messages-filter/names-too-many",
+						test_names_too_many);
+	g_test_add_func("/messages-filter/exact", test_exact);
+
+	return g_test_run();
+}
@@ -0,0 +1,288 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Pushed message bodies come in OBEX packets of any size and may be taken
+ * only in part, or refused with -EAGAIN until the backend calls ready_cb.
+ * This drives the dummy backend, the one that writes straight to a non
+ * blocking descriptor, the way mas.c does and checks that the stored
+ * message is the body, byte for byte, whatever the chunking.
+ *
+ * The backend's writes go through the write() below, which takes a short
+ * count or fails with EAGAIN on a fixed pattern while a body is pushed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <glib.h>
+
+#include "messages.h"
+
+#define FOLDER "outbox"
+
+static char *root;
+static gboolean throttle;
+static unsigned int writes;
+
+struct push {
+	int ready;		/* ready_cb calls */
+	gboolean done;
+	int err;
+	char *handle;
+};
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	if (throttle) {
+		writes++;
+
+		if (writes % 3 == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		if (writes % 3 == 1 && count > 1)
+			count = count / 2;
+	}
+
+	return syscall(SYS_write, fd, buf, count);
+}
+
+static void push_cb(void *session, int err, const char *handle,
+							void *user_data)
+{
+	struct push *push = user_data;
+
+	g_assert(!push->done);
+
+	push->done = TRUE;
+	push->err = err;
+	push->handle = g_strdup(handle);
+}
+
+static void ready_cb(void *session, void *user_data)
+{
+	struct push *push = user_data;
+
+	push->ready++;
+}
+
+static int push_body(void *session, const char *body, size_t len)
+{
+	int ret;
+
+	throttle = TRUE;
+	ret = messages_push_message_body(session, body, len);
+	throttle = FALSE;
+
+	return ret;
+}
+
+/* Like mas.c: the rest of a chunk is offered again, and after -EAGAIN
+ * nothing is offered until ready_cb */
+static void push_chunk(void *session, struct push *push, const char *data,
+								size_t len)
+{
+	while (len > 0) {
+		int ready = push->ready;
+		int ret;
+
+		ret = push_body(session, data, len);
+
+		if (ret == -EAGAIN) {
+			while (push->ready == ready)
+				g_main_context_iteration(NULL, TRUE);
+
+			g_assert_cmpint(push->ready, ==, ready + 1);
+			continue;
+		}
+
+		g_assert_cmpint(ret, >, 0);
+		g_assert_cmpint(ret, <=, (int) len);
+		g_assert_cmpint(push->ready, ==, ready);
+
+		data += ret;
+		len -= ret;
+	}
+}
+
+static GString *build_body(size_t len)
+{
+	GString *body = g_string_new("BEGIN:MSG\r\n");
+	size_t i;
+
+	for (i = 0; body->len < len - 11; i++)
+		g_string_append_c(body, 'a' + i % 26);
+
+	g_string_append(body, "\r\nEND:MSG\r\n");
+
+	return body;
+}
+
+static void check_push(const GString *body, size_t chunk)
+{
+	struct push push;
+	void *session;
+	size_t off;
+	char *path, *stored;
+	gsize len;
+
+	memset(&push, 0, sizeof(push));
+
+	g_assert_cmpint(messages_connect(&session), ==, 0);
+	g_assert_cmpint(messages_push_message(session, NULL, FOLDER,
+					MESSAGES_UTF8, push_cb, ready_cb,
+					&push), ==, 0);
+
+	for (off = 0; off < body->len; off += chunk)
+		push_chunk(session, &push, body->str + off,
+					MIN(chunk, body->len - off));
+
+	g_assert_cmpint(push_body(session, NULL, 0), ==, 0);
+
+	while (!push.done)
+		g_main_context_iteration(NULL, TRUE);
+
+	g_assert_cmpint(push.err, ==, 0);
+	g_assert(push.handle != NULL);
+
+	path = g_build_filename(root, FOLDER, push.handle, NULL);
+	g_assert(g_file_get_contents(path, &stored, &len, NULL));
+	g_assert_cmpint(len, ==, body->len);
+	g_assert(memcmp(stored, body->str, len) == 0);
+
+	unlink(path);
+	g_free(stored);
+	g_free(path);
+	g_free(push.handle);
+
+	messages_disconnect(session);
+}
+
+static void test_chunks(void)
+{
+	static const size_t sizes[] = { 1, 2, 3, 11, 12, 100, 4096, 32767 };
+	GString *body = build_body(20000);
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(sizes); i++) {
+		writes = 0;
+		check_push(body, sizes[i]);
+	}
+
+	g_string_free(body, TRUE);
+}
+
+/* Every chunk size for a short body, so every split of the framing */
+static void test_small(void)
+{
+	GString *body = build_body(40);
+	size_t chunk;
+
+	for (chunk = 1; chunk <= body->len; chunk++) {
+		writes = chunk;
+		check_push(body, chunk);
+	}
+
+	g_string_free(body, TRUE);
+}
+
+/* Aborting while waiting for ready_cb leaves nothing behind */
+static void test_abort(void)
+{
+	GString *body = build_body(1000);
+	struct push push;
+	void *session;
+	char *folder;
+	GDir *dir;
+	int ret, i;
+
+	memset(&push, 0, sizeof(push));
+
+	g_assert_cmpint(messages_connect(&session), ==, 0);
+	g_assert_cmpint(messages_push_message(session, NULL, FOLDER,
+					MESSAGES_UTF8, push_cb, ready_cb,
+					&push), ==, 0);
+
+	/* The next write fails */
+	writes = 2;
+	ret = push_body(session, body->str, body->len);
+	g_assert_cmpint(ret, ==, -EAGAIN);
+
+	messages_abort(session);
+
+	for (i = 0; i < 10; i++)
+		g_main_context_iteration(NULL, FALSE);
+
+	g_assert_cmpint(push.ready, ==, 0);
+	g_assert(!push.done);
+
+	folder = g_build_filename(root, FOLDER, NULL);
+	dir = g_dir_open(folder, 0, NULL);
+	g_assert(dir != NULL);
+	g_assert(g_dir_read_name(dir) == NULL);
+	g_dir_close(dir);
+	g_free(folder);
+
+	messages_disconnect(session);
+	g_string_free(body, TRUE);
+}
+
+int main(int argc, char *argv[])
+{
+	char *folder;
+	int ret;
+
+	g_test_init(&argc, &argv, NULL);
+
+	root = g_strdup("/tmp/push-test-XXXXXX");
+	g_assert(mkdtemp(root) != NULL);
+
+	folder = g_build_filename(root, FOLDER, NULL);
+	g_assert(mkdir(folder, 0700) == 0);
+
+	setenv("MAP_ROOT", root, 1);
+	g_assert_cmpint(messages_init(), ==, 0);
+
+	g_test_add_func("/push/chunks", test_chunks);
+	g_test_add_func("/push/small", test_small);
+	g_test_add_func("/push/abort", test_abort);
+
+	ret = g_test_run();
+
+	messages_exit();
+
+	rmdir(folder);
+	rmdir(root);
+	g_free(folder);
+	g_free(root);
+
+	return ret;
+}
@@ -0,0 +1,207 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Throughput of plugins/filesystem.c receiving a PUT, fed in rx_mtu sized
+ * packets and flushed after each one the way obex_read_stream() does:
+ *
+ *	direct:		--write-buffer=0, one write() per packet
+ *	buffered:	packets coalesced into --write-buffer sized writes
+ *	async:		--async-io, the coalesced writes done by a worker
+ *
+ * Usage: put-bench [file size in MB] [rx_mtu] [rounds] [directory]
+ *
+ * Every file is received with --atomic-put, so the rename is included,
+ * and removed afterwards. Writeback isn't waited for; the numbers are
+ * what the main loop sees.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include <openobex/obex.h>
+
+#include "plugin.h"
+#include "obex.h"
+#include "mimetype.h"
+#include "core.h"
+
+extern struct obex_plugin_desc __obex_builtin_filesystem;
+
+static struct obex_mime_type_driver *driver;
+static gboolean io_ready;
+static int io_err;
+
+static void fail(const char *what, int err)
+{
+	fprintf(stderr, "%s: %s (%d)\n", what, strerror(-err), -err);
+	exit(1);
+}
+
+static gboolean put_io(void *object, int flags, int err, void *user_data)
+{
+	io_ready = TRUE;
+	io_err = err;
+
+	return FALSE;
+}
+
+/* Run the main loop until the driver takes more data */
+static void wait_io(void *object)
+{
+	io_ready = FALSE;
+	driver->set_io_watch(object, put_io, NULL);
+
+	while (!io_ready)
+		g_main_context_iteration(NULL, TRUE);
+
+	if (io_err < 0)
+		fail("write", io_err);
+}
+
+static void put_file(const char *path, const uint8_t *packet, size_t mtu,
+								size_t total)
+{
+	size_t size = total;
+	void *object;
+	int err;
+
+	object = driver->open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600, NULL,
+								&size, &err);
+	if (object == NULL)
+		fail("open", err);
+
+	while (total > 0) {
+		size_t len = MIN(mtu, total);
+		size_t off = 0;
+		ssize_t ret;
+
+		while (off < len) {
+			ret = driver->write(object, packet + off, len - off);
+			if (ret == -EAGAIN) {
+				wait_io(object);
+				continue;
+			}
+
+			if (ret < 0)
+				fail("write", ret);
+
+			off += ret;
+		}
+
+		total -= len;
+
+		err = driver->flush(object);
+		if (err == -EAGAIN)
+			wait_io(object);
+		else if (err < 0)
+			fail("flush", err);
+	}
+
+	err = driver->close(object);
+	if (err < 0)
+		fail("close", err);
+}
+
+static double run(const char *path, const uint8_t *packet, size_t mtu,
+						size_t total, int rounds)
+{
+	GTimer *timer;
+	double elapsed;
+	int i;
+
+	if (__obex_builtin_filesystem.init() < 0) {
+		fprintf(stderr, "filesystem plugin init failed\n");
+		exit(1);
+	}
+
+	driver = obex_mime_type_driver_find(NULL, 0, NULL, NULL, 0);
+
+	timer = g_timer_new();
+
+	for (i = 0; i < rounds; i++) {
+		put_file(path, packet, mtu, total);
+		unlink(path);
+	}
+
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	__obex_builtin_filesystem.exit();
+
+	return (double) total * rounds / elapsed / (1024 * 1024);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+	size_t mtu = argc > 2 ? strtoul(argv[2], NULL, 10) : 32767;
+	int rounds = argc > 3 ? atoi(argv[3]) : 5;
+	const char *dir = argc > 4 ? argv[4] : g_get_tmp_dir();
+	size_t buffer = test_option_write_buffer;
+	uint8_t *packet;
+	char *path;
+
+	if (mb == 0 || mtu == 0 || rounds <= 0) {
+		fprintf(stderr, "usage: %s [MB] [rx_mtu] [rounds] "
+						"[directory]\n", argv[0]);
+		return 1;
+	}
+
+	if (g_thread_supported() == FALSE)
+		g_thread_init(NULL);
+
+	path = g_build_filename(dir, "put-bench", NULL);
+	packet = g_malloc(mtu);
+	memset(packet, 0x5a, mtu);
+
+	test_option_root = dir;
+	test_option_atomic_put = TRUE;
+
+	printf("%zu MB, rx_mtu %zu, %d rounds in %s\n", mb, mtu, rounds, dir);
+
+	test_option_write_buffer = 0;
+	printf("direct:   %.1f MB/s\n", run(path, packet, mtu, mb << 20,
+								rounds));
+
+	test_option_write_buffer = buffer;
+	printf("buffered: %.1f MB/s\n", run(path, packet, mtu, mb << 20,
+								rounds));
+
+	test_option_async_io = TRUE;
+	printf("async:    %.1f MB/s\n", run(path, packet, mtu, mb << 20,
+								rounds));
+
+	g_free(packet);
+	g_free(path);
+
+	return 0;
+}
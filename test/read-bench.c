@@ -0,0 +1,298 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* CPU cost and throughput of plugins/filesystem.c feeding a GET body, the
+ * two ways obex_write_stream() can take it:
+ *
+ *	read:		driver->read() into os->buf, then the copy into the
+ *			OBEX packet
+ *	read_direct:	driver->read_direct(), copied into the packet straight
+ *			out of the driver's buffer
+ *
+ * both without and with --async-io. Without it, read_direct() only serves
+ * files from FILE_DIRECT_THRESHOLD up, so keep the file above 1 MB.
+ *
+ * Usage: read-bench [file size in MB] [tx_mtu] [rounds] [directory]
+ *
+ * The file is read twice before measuring, checking every byte: with
+ * tx_mtu sized reads, then with VERIFY_MTU sized reads letting the main
+ * loop run between each read and the use of its data. All modes then run
+ * from the page cache; what is left is syscall and copy overhead. CPU
+ * time includes the I/O worker threads.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <glib.h>
+
+#include <openobex/obex.h>
+
+#include "plugin.h"
+#include "obex.h"
+#include "mimetype.h"
+#include "core.h"
+
+/* Above any buffer size in the driver, so that every read takes all of it
+ * and the read-ahead finishes while the data is held */
+#define VERIFY_MTU (1024 * 1024)
+
+extern struct obex_plugin_desc __obex_builtin_filesystem;
+
+static struct obex_mime_type_driver *driver;
+static gboolean io_ready;
+static int io_err;
+
+static void fail(const char *what, int err)
+{
+	fprintf(stderr, "%s: %s (%d)\n", what, strerror(-err), -err);
+	exit(1);
+}
+
+static double cpu_time(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+			ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static gboolean get_io(void *object, int flags, int err, void *user_data)
+{
+	io_ready = TRUE;
+	io_err = err;
+
+	return FALSE;
+}
+
+/* Run the main loop until the driver has more data */
+static void wait_io(void *object)
+{
+	io_ready = FALSE;
+	driver->set_io_watch(object, get_io, NULL);
+
+	while (!io_ready)
+		g_main_context_iteration(NULL, TRUE);
+
+	if (io_err < 0)
+		fail("read", io_err);
+}
+
+static uint8_t pattern(size_t offset)
+{
+	return offset * 7 + offset / 4093;
+}
+
+static void check(const uint8_t *data, size_t offset, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (data[i] != pattern(offset + i)) {
+			fprintf(stderr, "wrong data at %zu\n", offset + i);
+			exit(1);
+		}
+	}
+}
+
+/* verify checks every byte, hold also lets the main loop run between each
+ * read and the use of its data */
+static size_t get_file(const char *path, size_t mtu, gboolean direct,
+				uint8_t *buf, uint8_t *packet,
+				gboolean verify, gboolean hold)
+{
+	size_t total = 0;
+	void *object;
+	int err;
+
+	object = driver->open(path, O_RDONLY, 0, NULL, NULL, &err);
+	if (object == NULL)
+		fail("open", err);
+
+	while (TRUE) {
+		const void *data = buf;
+		ssize_t len;
+
+		if (direct)
+			len = driver->read_direct(object, &data, mtu);
+		else
+			len = driver->read(object, buf, mtu);
+
+		if (len == -EAGAIN) {
+			wait_io(object);
+			continue;
+		}
+
+		if (len < 0)
+			fail(direct ? "read_direct" : "read", len);
+
+		if (len == 0)
+			break;
+
+		/* Let read-ahead jobs finish and come in while the data is
+		 * held, it must stay valid until the next read */
+		if (hold) {
+			g_usleep(200);
+			while (g_main_context_iteration(NULL, FALSE))
+				;
+			g_usleep(200);
+		}
+
+		/* What OBEX_ObjectAddHeader() does with the stream data */
+		memcpy(packet, data, len);
+
+		if (verify)
+			check(packet, total, len);
+
+		total += len;
+	}
+
+	err = driver->close(object);
+	if (err < 0)
+		fail("close", err);
+
+	return total;
+}
+
+static void run(const char *name, const char *path, size_t mtu, int rounds,
+			gboolean direct, gboolean async, size_t expected)
+{
+	size_t size = MAX(mtu, VERIFY_MTU);
+	uint8_t *buf = g_malloc(size);
+	uint8_t *packet = g_malloc(size);
+	double start, cpu, elapsed;
+	GTimer *timer;
+	int i;
+
+	test_option_async_io = async;
+
+	if (__obex_builtin_filesystem.init() < 0) {
+		fprintf(stderr, "filesystem plugin init failed\n");
+		exit(1);
+	}
+
+	driver = obex_mime_type_driver_find(NULL, 0, NULL, NULL, 0);
+
+	if (get_file(path, mtu, direct, buf, packet, TRUE, FALSE) !=
+								expected ||
+			get_file(path, VERIFY_MTU, direct, buf, packet,
+						TRUE, TRUE) != expected) {
+		fprintf(stderr, "%s: short read\n", name);
+		exit(1);
+	}
+
+	timer = g_timer_new();
+	start = cpu_time();
+
+	for (i = 0; i < rounds; i++) {
+		if (get_file(path, mtu, direct, buf, packet, FALSE,
+							FALSE) != expected) {
+			fprintf(stderr, "%s: short read\n", name);
+			exit(1);
+		}
+	}
+
+	cpu = cpu_time() - start;
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	__obex_builtin_filesystem.exit();
+
+	/* Lets the last close jobs finish before the next init */
+	while (g_main_context_iteration(NULL, FALSE))
+		;
+
+	printf("%-18s %6.3f ms CPU/MB, %7.1f MB/s\n", name,
+		cpu * 1e3 / ((double) expected * rounds / (1024 * 1024)),
+		(double) expected * rounds / elapsed / (1024 * 1024));
+
+	g_free(buf);
+	g_free(packet);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+	size_t mtu = argc > 2 ? strtoul(argv[2], NULL, 10) : 32767;
+	int rounds = argc > 3 ? atoi(argv[3]) : 5;
+	const char *dir = argc > 4 ? argv[4] : g_get_tmp_dir();
+	uint8_t *chunk;
+	char *path;
+	size_t i, j;
+	int fd;
+
+	if (mb == 0 || mtu == 0 || rounds <= 0) {
+		fprintf(stderr, "usage: %s [MB] [tx_mtu] [rounds] "
+						"[directory]\n", argv[0]);
+		return 1;
+	}
+
+	if (g_thread_supported() == FALSE)
+		g_thread_init(NULL);
+
+	path = g_build_filename(dir, "read-bench", NULL);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		fail("open", -errno);
+
+	chunk = g_malloc(1024 * 1024);
+
+	for (i = 0; i < mb; i++) {
+		for (j = 0; j < 1024 * 1024; j++)
+			chunk[j] = pattern((i << 20) + j);
+
+		if (write(fd, chunk, 1024 * 1024) != 1024 * 1024) {
+			unlink(path);
+			fail("write", -errno);
+		}
+	}
+
+	close(fd);
+	g_free(chunk);
+
+	test_option_root = dir;
+
+	printf("%zu MB, tx_mtu %zu, %d rounds in %s\n", mb, mtu, rounds, dir);
+
+	run("read", path, mtu, rounds, FALSE, FALSE, mb << 20);
+	run("read_direct", path, mtu, rounds, TRUE, FALSE, mb << 20);
+	run("async read", path, mtu, rounds, FALSE, TRUE, mb << 20);
+	run("async read_direct", path, mtu, rounds, TRUE, TRUE, mb << 20);
+
+	unlink(path);
+	g_free(path);
+
+	return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ *
+ *  OBEX Server
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Cost of handing out a large string object, e.g. a phonebook pull or a
+ * folder listing, in tx_mtu sized reads:
+ *
+ *	erase:	the old string_read(), g_string_erase() of every chunk read,
+ *		which moves the rest of the buffer each time
+ *	cursor:	string_read() from plugins/filesystem.c
+ *
+ * Both are run with the whole object built up front, and with a producer
+ * appending another chunk after every read the way the listings are
+ * generated.
+ *
+ * Usage: string-bench [object size in KB] [tx_mtu] [rounds]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "filesystem.h"
+
+struct reader {
+	void *(*new) (void);
+	GString *(*string) (void *object);
+	ssize_t (*read) (void *object, void *buf, size_t count);
+	void (*free) (void *object);
+};
+
+static void *erase_new(void)
+{
+	return g_string_new("");
+}
+
+static GString *erase_string(void *object)
+{
+	return object;
+}
+
+static ssize_t erase_read(void *object, void *buf, size_t count)
+{
+	GString *string = object;
+	ssize_t len;
+
+	if (string->len == 0)
+		return 0;
+
+	len = MIN(string->len, count);
+	memcpy(buf, string->str, len);
+	g_string_erase(string, 0, len);
+
+	return len;
+}
+
+static void erase_free(void *object)
+{
+	g_string_free(object, TRUE);
+}
+
+static void *cursor_new(void)
+{
+	return string_buffer_new(NULL);
+}
+
+static GString *cursor_string(void *object)
+{
+	struct string_buffer *buffer = object;
+
+	return buffer->str;
+}
+
+static void cursor_free(void *object)
+{
+	string_buffer_free(object);
+}
+
+static const struct reader erase = {
+	erase_new, erase_string, erase_read, erase_free
+};
+
+static const struct reader cursor = {
+	cursor_new, cursor_string, string_read, cursor_free
+};
+
+/* Reads everything, returning the number of bytes that came out; with
+ * interleave set, a chunk of data is appended before every read */
+static size_t drain(const struct reader *reader, const char *data,
+			size_t size, size_t mtu, gboolean interleave, char *buf)
+{
+	void *object = reader->new();
+	size_t added = interleave ? 0 : size;
+	size_t total = 0;
+	ssize_t len;
+
+	if (!interleave)
+		g_string_append_len(reader->string(object), data, size);
+
+	do {
+		if (added < size) {
+			size_t n = MIN(mtu, size - added);
+
+			g_string_append_len(reader->string(object),
+							data + added, n);
+			added += n;
+		}
+
+		len = reader->read(object, buf, mtu);
+		if (len > 0 && memcmp(buf, data + total, len) != 0) {
+			fprintf(stderr, "data mismatch at %zu\n", total);
+			exit(1);
+		}
+
+		total += len;
+	} while (len > 0 || added < size);
+
+	reader->free(object);
+
+	return total;
+}
+
+static double run(const struct reader *reader, const char *data,
+				size_t size, size_t mtu, int rounds,
+				gboolean interleave)
+{
+	char *buf = g_malloc(mtu);
+	GTimer *timer;
+	double elapsed;
+	size_t total;
+	int i;
+
+	timer = g_timer_new();
+
+	for (i = 0; i < rounds; i++) {
+		total = drain(reader, data, size, mtu, interleave, buf);
+		if (total != size) {
+			fprintf(stderr, "read %zu of %zu bytes\n", total,
+									size);
+			exit(1);
+		}
+	}
+
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+	g_free(buf);
+
+	return elapsed * 1e3 / rounds;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t kb = argc > 1 ? strtoul(argv[1], NULL, 10) : 8192;
+	size_t mtu = argc > 2 ? strtoul(argv[2], NULL, 10) : 32767;
+	int rounds = argc > 3 ? atoi(argv[3]) : 5;
+	size_t i, size = kb << 10;
+	char *data;
+
+	if (kb == 0 || mtu == 0 || rounds <= 0) {
+		fprintf(stderr, "usage: %s [KB] [tx_mtu] [rounds]\n",
+								argv[0]);
+		return 1;
+	}
+
+	data = g_malloc(size);
+	for (i = 0; i < size; i++)
+		data[i] = 'a' + i % 26;
+
+	printf("%zu KB object, tx_mtu %zu, %d rounds\n", kb, mtu, rounds);
+	printf("built:       erase %9.3f ms  cursor %9.3f ms\n",
+				run(&erase, data, size, mtu, rounds, FALSE),
+				run(&cursor, data, size, mtu, rounds, FALSE));
+	printf("interleaved: erase %9.3f ms  cursor %9.3f ms\n",
+				run(&erase, data, size, mtu, rounds, TRUE),
+				run(&cursor, data, size, mtu, rounds, TRUE));
+
+	g_free(data);
+
+	return 0;
+}